@@ -0,0 +1,87 @@
+/** Led update rate of tiled controllers - 1, 2 and 4 Launchpads in one
+ * VirtualGrid on the fake backend, the whole surface repainted every period.
+ * Each device has its own queue, so the updates per device should not drop
+ * as devices are added (tests/grid_test.cc checks that).
+ *
+ *   grid_bench [periods]
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "fakebackend.h"
+#include "controllers.h"
+#include "virtual_grid.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Devices : backend::Callback {
+    std::vector<std::unique_ptr<GridController>> list;
+
+    int process(jack_nframes_t nframes) override {
+        for (auto &d : list) d->process(nframes);
+        return 0;
+    }
+};
+
+void run(unsigned cols, unsigned rows, const char *port, unsigned periods) {
+    FakeBackend client;
+    client.set_capture(false);
+
+    Devices devs;
+    for (unsigned i = 0; i < cols * rows; ++i)
+        devs.list.push_back(make_grid_controller(client, "lp" + std::to_string(i), port));
+
+    VirtualGrid surface(cols, rows);
+    for (unsigned i = 0; i < devs.list.size(); ++i)
+        surface.attach(i % cols, i / cols, *devs.list[i]);
+
+    client.set_callback(devs);
+    client.activate();
+
+    auto start = Clock::now();
+
+    for (unsigned p = 0; p < periods; ++p) {
+        // a moving pattern, every led changes
+        surface.fill_matrix([p](unsigned x, unsigned y) {
+            return GridSurface::color((x + y + p) % 4, (x + p) % 3);
+        });
+        surface.flip();
+        client.cycle();
+    }
+
+    double wall  = std::chrono::duration<double>(Clock::now() - start).count();
+    double secs  = double(periods) * client.get_period() / client.sample_rate();
+
+    uint64_t msgs = 0, dropped = 0;
+    for (auto &d : devs.list) {
+        msgs    += d->get_stats().led_messages.get();
+        dropped += d->get_stats().dropped.get();
+    }
+
+    size_t n = devs.list.size();
+    std::printf("%-20s %ux%u  %8.1f led msgs/s per device  %6.1f frames/s  "
+                "%5llu dropped  %6.2f us/period\n",
+                port, cols, rows, msgs / secs / n,
+                devs.list[0]->get_stats().frames.get() / secs,
+                (unsigned long long)dropped, wall * 1e6 / periods);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    unsigned periods = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 20000;
+
+    for (const char *port : {"Launchpad", "Launchpad MK2"}) {
+        run(1, 1, port, periods);
+        run(2, 1, port, periods);
+        run(2, 2, port, periods);
+    }
+
+    return 0;
+}
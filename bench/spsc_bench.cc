@@ -0,0 +1,151 @@
+/** Throughput of SpscQueue against jack::RingBuffer, one producer and one
+ * consumer thread passing jack::MidiMessage.
+ *
+ *   spsc_bench [messages]
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#include "jackmidi.h"
+#include "spsc.h"
+
+namespace {
+
+constexpr size_t CAPACITY = 1024; // messages
+constexpr size_t BATCH    = 64;
+
+using Clock = std::chrono::steady_clock;
+
+// full or empty - let the other side run (matters with fewer cores than threads)
+inline void idle() { std::this_thread::yield(); }
+
+jack::MidiMessage make_msg(size_t i) {
+    jack::MidiMessage m(3, 0x90, uchar(i & 0x7F), 100);
+    m.time = jack_nframes_t(i);
+    return m;
+}
+
+template<typename ProducerT, typename ConsumerT>
+void run(const char *name, size_t count, ProducerT produce, ConsumerT consume) {
+    auto start = Clock::now();
+
+    std::thread producer([&] { produce(count); });
+    uint64_t sum = consume(count);
+    producer.join();
+
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+    std::printf("%-28s %8.2f Mmsg/s  (check %llu)\n", name, count / secs / 1e6,
+                (unsigned long long)sum);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 20000000;
+
+    // the byte copies the wrapper did before, one message per peek/read
+    {
+        jack::RingBuffer rb(CAPACITY * sizeof(jack::MidiMessage));
+        rb.mlock();
+        run("RingBuffer bytes", count,
+            [&](size_t n) {
+                for (size_t i = 0; i < n;) {
+                    if (rb.write_space() < sizeof(jack::MidiMessage)) { idle(); continue; }
+                    jack::MidiMessage m = make_msg(i++);
+                    rb.write(reinterpret_cast<const char *>(&m), sizeof(m));
+                }
+            },
+            [&](size_t n) {
+                uint64_t sum = 0;
+                jack::MidiMessage m;
+                for (size_t i = 0; i < n;) {
+                    if (rb.read_space() < sizeof(m)) { idle(); continue; }
+                    rb.read(reinterpret_cast<char *>(&m), sizeof(m));
+                    sum += m.data[1];
+                    ++i;
+                }
+                return sum;
+            });
+    }
+
+    // length prefixed records, as the router rings carry now
+    {
+        jack::RingBuffer rb(CAPACITY * sizeof(jack::MidiMessage));
+        rb.mlock();
+        run("RingBuffer records", count,
+            [&](size_t n) {
+                for (size_t i = 0; i < n;) {
+                    if (rb.write_record(make_msg(i))) ++i; else idle();
+                }
+            },
+            [&](size_t n) {
+                uint64_t sum = 0;
+                uchar data[3];
+                jack::RingBuffer::Record r;
+                for (size_t i = 0; i < n;) {
+                    if (!rb.peek_record(r)) { idle(); continue; }
+                    rb.read_record(r, data);
+                    sum += data[1];
+                    ++i;
+                }
+                return sum;
+            });
+    }
+
+    {
+        SpscQueue<jack::MidiMessage> q(CAPACITY);
+        q.mlock();
+        run("SpscQueue push/pop", count,
+            [&](size_t n) {
+                for (size_t i = 0; i < n;) {
+                    if (q.push(make_msg(i))) ++i; else idle();
+                }
+            },
+            [&](size_t n) {
+                uint64_t sum = 0;
+                jack::MidiMessage m;
+                for (size_t i = 0; i < n;) {
+                    if (!q.pop(m)) { idle(); continue; }
+                    sum += m.data[1];
+                    ++i;
+                }
+                return sum;
+            });
+    }
+
+    {
+        SpscQueue<jack::MidiMessage> q(CAPACITY);
+        q.mlock();
+        run("SpscQueue batch/consume", count,
+            [&](size_t n) {
+                jack::MidiMessage batch[BATCH];
+                for (size_t i = 0; i < n;) {
+                    size_t k = std::min(BATCH, n - i);
+                    for (size_t j = 0; j < k; ++j) batch[j] = make_msg(i + j);
+
+                    size_t done = 0;
+                    while (done < k) {
+                        size_t pushed = q.push(batch + done, k - done);
+                        if (!pushed) idle();
+                        done += pushed;
+                    }
+                    i += k;
+                }
+            },
+            [&](size_t n) {
+                uint64_t sum = 0;
+                for (size_t i = 0; i < n;) {
+                    size_t k = q.consume([&](const jack::MidiMessage *span, size_t cnt) {
+                        for (size_t j = 0; j < cnt; ++j) sum += span[j].data[1];
+                    });
+                    if (!k) idle();
+                    i += k;
+                }
+                return sum;
+            });
+    }
+
+    return 0;
+}
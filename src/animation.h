@@ -0,0 +1,237 @@
+#pragma once
+
+#include <mutex>
+#include <chrono>
+#include <bitset>
+#include <cmath>
+#include <algorithm>
+
+#include "grid.h"
+#include "timer.h"
+
+/** Animations on top of what the screens draw. The screens draw the static
+ * picture into the animator as into any surface, the animator keeps it and
+ * presents it with the running animations composed over:
+ *
+ *   blink - the device blinks the led on its own if it can (the original
+ *           Launchpad in flash mode), otherwise the blink phase timer
+ *           switches it, twice per BLINK_PERIOD
+ *   pulse - the brightness of a button going up and down over a period
+ *   sweep - a column passing over the grid from left to right
+ *
+ * The pulses and sweeps get recomposed every FRAME_INTERVAL, the surface
+ * only sends the leds that changed. The timers run only while there is
+ * something to animate.
+ *
+ * @note the timers fire in the thread advancing the wheel - the UI thread
+ */
+class Animator : public GridSurface {
+public:
+    using GridSurface::set_color;
+    using GridSurface::fill_matrix;
+    using Clock    = TimerWheel::Clock;
+    using Duration = Clock::duration;
+
+    static constexpr Duration FRAME_INTERVAL = std::chrono::milliseconds(40);
+    static constexpr Duration BLINK_PERIOD   = std::chrono::milliseconds(500);
+
+    Animator(GridSurface &target, TimerWheel &timers)
+        : target(target), timers(timers)
+    {}
+
+    ~Animator() {
+        timers.cancel(frame_timer);
+        timers.cancel(blink_timer);
+    }
+
+    Animator(const Animator &) = delete;
+    Animator &operator=(const Animator &) = delete;
+
+    unsigned width() const override  { return target.width(); }
+    unsigned height() const override { return target.height(); }
+
+    void set_callback(KeyCb c) override { target.set_callback(c); }
+
+    void set_color(unsigned btn, Color col) override {
+        if (btn >= BUTTONS) return;
+
+        lock l(mtx);
+        base[btn] = col;
+    }
+
+    void fill_matrix(ColorCb cb) override {
+        lock l(mtx);
+
+        for (unsigned y = 0; y < height(); ++y)
+            for (unsigned x = 0; x < width(); ++x)
+                base[coord_to_btn(x, y)] = cb(x, y);
+    }
+
+    void set_blink(unsigned btn, bool blink) override {
+        if (btn >= BUTTONS) return;
+
+        lock l(mtx);
+        blinks[btn] = blink;
+        update_timers();
+    }
+
+    /// the phase follows the blink timer here
+    void blink_phase(bool) override {}
+
+    void flip() override {
+        lock l(mtx);
+        present();
+    }
+
+    /// sets the color of the button and makes it blink
+    void blink(unsigned btn, Color col) {
+        set_color(btn, col);
+        set_blink(btn, true);
+    }
+
+    /// the button pulses up to the color and back down every period
+    void pulse(unsigned btn, Color col, Duration period) {
+        if (btn >= BUTTONS) return;
+
+        lock l(mtx);
+        pulses[btn] = {col, std::max(period, FRAME_INTERVAL), Clock::now()};
+        pulsing[btn] = true;
+        update_timers();
+    }
+
+    /// stops the blinking and pulsing of the button
+    void stop(unsigned btn) {
+        if (btn >= BUTTONS) return;
+
+        lock l(mtx);
+        blinks[btn]  = false;
+        pulsing[btn] = false;
+        update_timers();
+    }
+
+    /// a column of the color sweeps over the grid every period
+    void sweep(Color col, Duration period) {
+        lock l(mtx);
+        sweep_anim = {col, std::max(period, FRAME_INTERVAL), Clock::now()};
+        sweeping = true;
+        update_timers();
+    }
+
+    void stop_sweep() {
+        lock l(mtx);
+        sweeping = false;
+        update_timers();
+    }
+
+protected:
+    // the grid and side codes are below BC_UP, the top row above
+    static constexpr unsigned BUTTONS = BC_UP + MAX_W;
+
+    struct Anim {
+        Color color;
+        Duration period;
+        Clock::time_point start;
+
+        /// 0..1..0 over the period
+        double level(Clock::time_point now) const {
+            double ph = std::fmod(std::chrono::duration<double>(now - start).count()
+                                  / std::chrono::duration<double>(period).count(), 1.0);
+            return ph < 0.5 ? ph * 2 : (1 - ph) * 2;
+        }
+
+        /// 0..1 over the period
+        double position(Clock::time_point now) const {
+            return std::fmod(std::chrono::duration<double>(now - start).count()
+                             / std::chrono::duration<double>(period).count(), 1.0);
+        }
+    };
+
+    static Color scale(Color c, double f) {
+        return {uchar(c.r() * f + 0.5), uchar(c.g() * f + 0.5), uchar(c.b() * f + 0.5)};
+    }
+
+    /// the timers run while there is something for them
+    void update_timers() {
+        bool frames = sweeping || pulsing.any();
+
+        if (frames && frame_timer == TimerWheel::NO_TIMER) {
+            frame_timer = timers.schedule(FRAME_INTERVAL, [this] { flip(); }, FRAME_INTERVAL);
+        } else if (!frames && frame_timer != TimerWheel::NO_TIMER) {
+            timers.cancel(frame_timer);
+            frame_timer = TimerWheel::NO_TIMER;
+        }
+
+        bool blinking = blinks.any();
+
+        if (blinking && blink_timer == TimerWheel::NO_TIMER) {
+            blink_timer = timers.schedule(BLINK_PERIOD / 2, [this] { toggle_phase(); },
+                                          BLINK_PERIOD / 2);
+        } else if (!blinking && blink_timer != TimerWheel::NO_TIMER) {
+            timers.cancel(blink_timer);
+            blink_timer = TimerWheel::NO_TIMER;
+            phase_on = true;
+            target.blink_phase(true);
+        }
+    }
+
+    void toggle_phase() {
+        lock l(mtx);
+        phase_on = !phase_on;
+        target.blink_phase(phase_on);
+        target.flip();
+    }
+
+    /// composes the animations over the picture and presents it
+    void present() {
+        auto now = Clock::now();
+        unsigned w = width(), h = height();
+
+        unsigned sweep_x = sweeping ? unsigned(sweep_anim.position(now) * w) : w;
+
+        auto compose = [&](unsigned btn) {
+            if (pulsing[btn]) return scale(pulses[btn].color, pulses[btn].level(now));
+            return base[btn];
+        };
+
+        target.fill_matrix([&](unsigned x, unsigned y) {
+            if (x == sweep_x) return sweep_anim.color;
+            return compose(coord_to_btn(x, y));
+        });
+
+        for (unsigned y = 0; y < h; ++y) {
+            unsigned btn = side_btn(y);
+            target.set_color(btn, compose(btn));
+            target.set_blink(btn, blinks[btn]);
+        }
+
+        for (unsigned x = 0; x < w; ++x) {
+            unsigned btn = top_btn(x);
+            target.set_color(btn, compose(btn));
+            target.set_blink(btn, blinks[btn]);
+        }
+
+        for (unsigned y = 0; y < h; ++y) {
+            for (unsigned x = 0; x < w; ++x) {
+                unsigned btn = coord_to_btn(x, y);
+                target.set_blink(btn, blinks[btn] && x != sweep_x);
+            }
+        }
+
+        target.flip();
+    }
+
+    GridSurface &target;
+    TimerWheel &timers;
+
+    std::mutex mtx;
+    Color base[BUTTONS] = {};
+    std::bitset<BUTTONS> blinks;
+    std::bitset<BUTTONS> pulsing;
+    Anim pulses[BUTTONS];
+    Anim sweep_anim;
+    bool sweeping = false;
+    bool phase_on = true;
+
+    TimerWheel::Id frame_timer = TimerWheel::NO_TIMER;
+    TimerWheel::Id blink_timer = TimerWheel::NO_TIMER;
+};
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <jack/types.h>
+#include <jack/midiport.h>
+
+#include "common.h"
+
+/** Abstract audio/MIDI backend. The engine (router, sequencer, launchpad
+ * drivers) only talks to these interfaces, so it can run on top of jack
+ * (jack::Client) or on a simulated clock without any server
+ * (FakeBackend).
+ *
+ * The midi event struct and frame types are borrowed from jack, as they
+ * are plain data.
+ */
+namespace backend {
+
+/// midi buffer of a port for a single process period
+class MidiBuffer {
+public:
+    virtual ~MidiBuffer() = default;
+
+    virtual uint32_t get_event_count() = 0;
+
+    virtual void get_event(jack_midi_event_t &ev, uint32_t order) = 0;
+
+    virtual void clear() = 0;
+
+    /** allocates space for an event at given frame offset. Offsets have to
+     * be non-decreasing, returns nullptr when out of space/order.
+     */
+    virtual jack_midi_data_t *event_reserve(jack_nframes_t time,
+                                            size_t data_size) = 0;
+};
+
+/// a registered midi port
+class Port {
+public:
+    virtual ~Port() = default;
+
+    /// returns the buffer for the current period (only valid in process)
+    virtual MidiBuffer &get_midi_buffer(jack_nframes_t nframes) = 0;
+
+    // establishes a connection of this registered port with a different one
+    virtual void connect_from(const char *source) = 0;
+    virtual void disconnect_from(const char *source) = 0;
+    virtual void connect_to(const char *target) = 0;
+    virtual void disconnect_to(const char *target) = 0;
+
+    virtual const char *name() = 0;
+};
+
+// implement in a class listening to the backend's process cycle
+struct Callback {
+    virtual int process(jack_nframes_t nframes) = 0;
+};
+
+/** implement in a class following the ports of the graph.
+ * @note called from a backend thread - only queue the notice and handle it
+ * elsewhere, the backend must not be called back from here
+ */
+struct PortListener {
+    /// a port of another client appeared or is about to disappear
+    virtual void on_port_registered(const char *name, unsigned long flags,
+                                    bool registered) = 0;
+
+    /// a connection of one of our ports was made or broken
+    virtual void on_port_connected(const char *source, const char *target,
+                                   bool connected) = 0;
+};
+
+class Backend {
+public:
+    // input/output port flags, compatible with jack
+    enum PortFlags : unsigned long {
+        PORT_INPUT  = 0x1,
+        PORT_OUTPUT = 0x2
+    };
+
+    virtual ~Backend() = default;
+
+    /// registers a midi port. Throws on failure
+    virtual std::unique_ptr<Port> register_port(const char *name,
+                                                unsigned long flags) = 0;
+
+    virtual void set_callback(Callback &cb) = 0;
+
+    /// follows the ports of the graph. Has to be set before activate
+    virtual void set_port_listener(PortListener &l) = 0;
+
+    /** names of the midi ports matching the regex pattern (all if nullptr)
+     * and having all the flags
+     */
+    virtual std::vector<std::string> get_ports(const char *port_name_pattern = nullptr,
+                                               unsigned long flags = 0) const = 0;
+
+    /// true if the port was registered by us
+    virtual bool is_own_port(const char *name) const = 0;
+
+    virtual void activate() = 0;
+    virtual void deactivate() = 0;
+
+    /// frame time of the start of the current process period
+    virtual jack_nframes_t last_frame_time() const = 0;
+
+    /// estimated current frame time
+    virtual jack_nframes_t frame_time() const = 0;
+
+    virtual jack_nframes_t sample_rate() = 0;
+};
+
+} // namespace backend
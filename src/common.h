@@ -395,12 +395,14 @@ inline int lowest_bit_set(uchar c) {
 */
 
 // essentially a logarithm
-inline int highest_bit_set(uchar c) {
+inline int highest_bit_set(unsigned c) {
     // 4 bit lookup
     int nib[16] = {-1, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3};
 
-    if (c >> 4)
-        return nib[c >> 4] + 4;
+    for (int shift = 28; shift > 0; shift -= 4) {
+        if (c >> shift)
+            return nib[(c >> shift) & 0xf] + shift;
+    }
 
     if (c & 0xf)
         return nib[c & 0xf];
@@ -410,10 +412,10 @@ inline int highest_bit_set(uchar c) {
 
 // TODO: This is basically highest_bit_set(c & (0xff >> (7 - pos)))
 // which would probably be faster than a cycle with comparison
-inline uchar nearest_lower_bit(uchar c, uchar pos) {
-    uchar cand = pos;
+inline unsigned nearest_lower_bit(unsigned c, unsigned pos) {
+    unsigned cand = pos;
 
-    for (uchar o = 0; o < pos; ++o) {
+    for (unsigned o = 0; o < pos; ++o) {
         if (c >> o) cand = o;
     }
 
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "backend.h"
+#include "grid.h"
+#include "launchpad.h"
+#include "launchpad_rgb.h"
+
+/** creates the driver for the controller behind the named port, the
+ * original Launchpad if the name tells nothing
+ */
+inline std::unique_ptr<GridController> make_grid_controller(backend::Backend &client,
+                                                            const std::string &prefix,
+                                                            const std::string &port)
+{
+    if (LaunchpadMk2::matchName(port))
+        return std::make_unique<LaunchpadMk2>(client, prefix);
+    if (LaunchpadPro::matchName(port))
+        return std::make_unique<LaunchpadPro>(client, prefix);
+    if (LaunchpadMiniMk3::matchName(port))
+        return std::make_unique<LaunchpadMiniMk3>(client, prefix);
+    if (LaunchpadX::matchName(port))
+        return std::make_unique<LaunchpadX>(client, prefix);
+
+    return std::make_unique<Launchpad>(client, prefix);
+}
+
+/// true if the port looks like one of a supported controller
+inline bool is_grid_controller(const std::string &port) {
+    return LaunchpadMk2::matchName(port) || LaunchpadPro::matchName(port)
+           || LaunchpadMiniMk3::matchName(port) || LaunchpadX::matchName(port)
+           || Launchpad::matchName(port);
+}
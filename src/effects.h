@@ -0,0 +1,550 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <algorithm>
+#include <initializer_list>
+
+#include "common.h"
+#include "jackmidi.h"
+#include "tableswap.h"
+
+/** Per-track realtime midi effects (arpeggiator, transpose/scale lock,
+ * velocity curve, ratchet) between the sequence walker and the groove.
+ *
+ * The chain is composed on configuration (UI thread) into a flat table of
+ * stage functions with their parameters precomputed. Each stage hands its
+ * output to the next one, the last one to the sink - there are no virtual
+ * calls or allocations per event, and the jack thread state of all the
+ * effects is a fixed State kept by the sequencer per track.
+ *
+ * Events carry absolute ticks. Stages may emit events later than the input
+ * (ratchet repeats, arpeggiated notes with their note-offs), the sequencer
+ * holds those back till their window.
+ *
+ * @note the arpeggiator expects its input in time order, keep it first
+ */
+class EffectChain {
+public:
+    static constexpr size_t MAX_STAGES    = 4;
+    static constexpr size_t ARP_NOTES     = 16;   // held notes the arpeggiator follows
+    static constexpr size_t RATCHET_NOTES = 16;   // held notes still repeating
+    static constexpr uchar  NO_NOTE       = 0xFF; // note filtered out
+
+    enum Kind : uchar {
+        FX_ARPEGGIATOR = 0,
+        FX_RATCHET     = 1,
+        FX_TRANSPOSE   = 2,
+        FX_VELOCITY    = 3
+    };
+
+    enum ArpMode : uchar {
+        ARP_UP        = 0,
+        ARP_DOWN      = 1,
+        ARP_UP_DOWN   = 2,
+        ARP_AS_PLAYED = 3
+    };
+
+    struct Event {
+        ticks tick;
+        jack::MidiMessage msg;
+    };
+
+    /// receives the output of the chain
+    using SinkFn = void (*)(void *ctx, const Event &ev);
+
+    /// realtime part - per track state kept by the sequencer
+    struct State {
+        struct Arp {
+            uchar notes[ARP_NOTES]    = {}; // held notes in the played order
+            uchar velocity[ARP_NOTES] = {};
+            size_t count   = 0;
+            unsigned step  = 0;
+            uchar channel  = 0;
+            ticks pos      = -1; // stepped up to this tick, -1 restarts the grid
+        } arp;
+
+        struct Repeat {
+            ticks next;    // tick of the next repeat
+            unsigned left; // repeats still to go
+            uchar note, channel, velocity;
+        };
+
+        struct Ratchet {
+            Repeat notes[RATCHET_NOTES];
+            size_t count = 0;
+        } ratchet;
+
+        uchar mapped[NOTE_MAX + 1];           // transpose - sounding note per input note
+        bool  ratcheted[NOTE_MAX + 1] = {};   // ratchet - note-off is swallowed
+        unsigned holding = 0; // notes mapped or ratcheted, waiting for the note-off
+
+        State() { reset(); }
+
+        /// forgets all held notes (track stopped or changed sequence)
+        void reset() {
+            arp.count = 0;
+            arp.step  = 0;
+            arp.pos   = -1;
+            ratchet.count = 0;
+            std::fill(std::begin(mapped), std::end(mapped), NO_NOTE);
+            std::fill(std::begin(ratcheted), std::end(ratcheted), false);
+            holding = 0;
+        }
+
+        /// transport jumped - the arpeggiator grid restarts at the new
+        /// position, the repeats to come were on the old timeline
+        void relocate() {
+            arp.pos = -1;
+            ratchet.count = 0;
+        }
+
+        /// the note-offs of some notes still have to go through the chain,
+        /// even if it does nothing else now
+        bool is_holding() const { return holding > 0; }
+    };
+
+    EffectChain() {
+        rebuild();
+    }
+
+    EffectChain(const EffectChain &) = delete;
+    EffectChain &operator=(const EffectChain &) = delete;
+
+    /// sets the stages in processing order, repeated kinds are ignored
+    void set_chain(std::initializer_list<Kind> kinds) {
+        order_count = 0;
+        for (Kind k : kinds) {
+            if (order_count == MAX_STAGES) break;
+            if (std::find(order, order + order_count, k) != order + order_count)
+                continue;
+            order[order_count++] = k;
+        }
+        rebuild();
+    }
+
+    /** arpeggiator - plays the held notes one by one on a grid of rate ticks
+     * (synced to the transport), spanning given octaves. Gate is the note
+     * length in percent of the rate. Rate 0 disables the arpeggiator.
+     */
+    void set_arpeggiator(ticks rate, ArpMode mode = ARP_UP, uchar octaves = 1,
+                         unsigned gate = 50)
+    {
+        arp_rate    = std::max(rate, ticks(0));
+        arp_mode    = mode;
+        arp_octaves = std::clamp(octaves, uchar(1), uchar(4));
+        arp_gate    = std::clamp(gate, 1u, 100u);
+        rebuild();
+    }
+
+    /** transposes by semitones, then snaps the notes down into the scale
+     * (index into NoteScaler::scales, 0 is chromatic) with the given root
+     */
+    void set_transpose(int semitones, uchar scale = 0, uchar root = 0) {
+        transpose = std::clamp(semitones, -int(NOTE_MAX), int(NOTE_MAX));
+        scale_idx = scale < NoteScaler::scales.size() ? scale : 0;
+        scale_root = root % 12;
+        rebuild();
+    }
+
+    /// same as the thru velocity curve - scaled to [lo, hi] with the exponent
+    void set_velocity_curve(double gamma, uchar lo = 1, uchar hi = NOTE_MAX) {
+        velo_gamma = gamma > 0 ? gamma : 1.0;
+        velo_lo    = std::clamp(lo, uchar(1), NOTE_MAX);
+        velo_hi    = std::clamp(hi, velo_lo, NOTE_MAX);
+        rebuild();
+    }
+
+    /// ratchet - every note is repeated given times, interval ticks apart, while held
+    void set_ratchet(unsigned repeats, ticks interval) {
+        ratchet_repeats  = std::clamp(repeats, 1u, 16u);
+        ratchet_interval = std::max(interval, ticks(2));
+        rebuild();
+    }
+
+    /// true if the chain modifies anything at all
+    bool is_active() const {
+        TableSwap<Tables>::Use tb(tables);
+        return tb->active;
+    }
+
+    /// passes an event through the chain
+    void process(State &st, const Event &ev, SinkFn sink, void *ctx) const {
+        TableSwap<Tables>::Use tb(tables);
+        Run run{*tb, st, sink, ctx};
+        run.feed(0, ev);
+    }
+
+    /// lets the time driven stages (arpeggiator, ratchet) run up to the given tick
+    void advance(State &st, ticks until, SinkFn sink, void *ctx) const {
+        TableSwap<Tables>::Use tb(tables);
+        Run run{*tb, st, sink, ctx};
+
+        for (size_t i = 0; i < run.tb.count; ++i) {
+            if (run.tb.stages[i].advance) run.tb.stages[i].advance(run, i, until);
+        }
+    }
+
+protected:
+    struct Run;
+
+    using EventFn   = void (*)(const Run &run, size_t stage, const Event &ev);
+    using AdvanceFn = void (*)(const Run &run, size_t stage, ticks until);
+
+    struct Stage {
+        EventFn   event   = nullptr;
+        AdvanceFn advance = nullptr; // only for the time driven stages
+    };
+
+    struct Tables {
+        bool   active = false; // any stage besides the releasing ones
+        size_t count = 0;
+        Stage  stages[MAX_STAGES];
+
+        ticks    arp_rate    = 0;
+        ArpMode  arp_mode    = ARP_UP;
+        uchar    arp_octaves = 1;
+        ticks    arp_length  = 1;
+
+        unsigned ratchet_repeats  = 1;
+        ticks    ratchet_interval = 2;
+        ticks    ratchet_length   = 1;
+
+        bool  transposing = false;
+        uchar note[NOTE_MAX + 1];
+        uchar velocity[NOTE_MAX + 1];
+    };
+
+    /// a single pass through the chain
+    struct Run {
+        const Tables &tb;
+        State &st;
+        SinkFn sink;
+        void *ctx;
+
+        void feed(size_t stage, const Event &ev) const {
+            if (stage >= tb.count) {
+                sink(ctx, ev);
+                return;
+            }
+
+            const Stage &s = tb.stages[stage];
+            if (s.advance) s.advance(*this, stage, ev.tick);
+            s.event(*this, stage, ev);
+        }
+    };
+
+    static bool is_note_on(const jack::MidiMessage &msg) {
+        return (msg.data[0] & EV_CLEAR_CHAN_MASK) == EV_NOTE_ON && msg.data[2] > 0;
+    }
+
+    static bool is_note_off(const jack::MidiMessage &msg) {
+        uchar status = msg.data[0] & EV_CLEAR_CHAN_MASK;
+        return status == EV_NOTE_OFF || (status == EV_NOTE_ON && msg.data[2] == 0);
+    }
+
+    // ======================== ARPEGGIATOR ==========================
+    static void arp_event(const Run &run, size_t stage, const Event &ev) {
+        State::Arp &a = run.st.arp;
+        uchar note = ev.msg.data[1] & NOTE_MAX;
+
+        if (is_note_on(ev.msg)) {
+            if (a.count == ARP_NOTES) return;
+            if (std::find(a.notes, a.notes + a.count, note) != a.notes + a.count)
+                return;
+            if (!a.count) a.step = 0; // new chord starts from its first note
+
+            a.channel = ev.msg.data[0] & 0x0F;
+            a.notes[a.count]    = note;
+            a.velocity[a.count] = ev.msg.data[2];
+            ++a.count;
+        } else if (is_note_off(ev.msg)) {
+            uchar *it = std::find(a.notes, a.notes + a.count, note);
+            if (it == a.notes + a.count) return;
+
+            size_t i = it - a.notes;
+            std::copy(a.notes + i + 1, a.notes + a.count, a.notes + i);
+            std::copy(a.velocity + i + 1, a.velocity + a.count, a.velocity + i);
+            --a.count;
+        } else {
+            run.feed(stage + 1, ev);
+        }
+    }
+
+    static void arp_advance(const Run &run, size_t stage, ticks until) {
+        State::Arp &a = run.st.arp;
+        const Tables &tb = run.tb;
+
+        // (re)started or jumped back - continue on the grid from here
+        if (a.pos < 0 || a.pos > until) a.pos = until;
+
+        if (a.count) {
+            for (ticks g = next_multiple(a.pos, tb.arp_rate); g < until; g += tb.arp_rate)
+                arp_step(run, stage, g);
+        }
+
+        a.pos = until;
+    }
+
+    static void arp_step(const Run &run, size_t stage, ticks t) {
+        State::Arp &a = run.st.arp;
+        const Tables &tb = run.tb;
+
+        uchar order[ARP_NOTES];
+        std::copy(a.notes, a.notes + a.count, order);
+        if (tb.arp_mode != ARP_AS_PLAYED) std::sort(order, order + a.count);
+
+        unsigned total = unsigned(a.count) * tb.arp_octaves;
+        unsigned step  = a.step++;
+        unsigned i     = step % total;
+
+        if (tb.arp_mode == ARP_DOWN) {
+            i = total - 1 - i;
+        } else if (tb.arp_mode == ARP_UP_DOWN && total > 1) {
+            // the top and bottom notes are not repeated on the turn
+            unsigned period = 2 * total - 2;
+            i = step % period;
+            if (i >= total) i = period - i;
+        }
+
+        int note = order[i % a.count] + 12 * int(i / a.count);
+        if (note > NOTE_MAX) return;
+
+        size_t vi = std::find(a.notes, a.notes + a.count, order[i % a.count]) - a.notes;
+
+        run.feed(stage + 1, {t, jack::MidiMessage::compose_note_on(
+                                        a.channel, uchar(note), a.velocity[vi])});
+        run.feed(stage + 1, {t + tb.arp_length,
+                             jack::MidiMessage::compose_note_off(a.channel, uchar(note))});
+    }
+
+    // ======================== RATCHET ==========================
+    /** the first hit goes out with the note-on, the repeats as their time
+     * comes (advance) - the note-off cuts the ones not played yet. With the
+     * ratchet off the stage only releases what it still holds
+     */
+    static void ratchet_event(const Run &run, size_t stage, const Event &ev) {
+        const Tables &tb = run.tb;
+        State &st = run.st;
+        uchar note = ev.msg.data[1] & NOTE_MAX;
+        uchar ch   = ev.msg.data[0] & 0x0F;
+
+        if (is_note_on(ev.msg) && tb.ratchet_repeats > 1) {
+            ratchet_cut(st, note, ch); // retriggered
+
+            run.feed(stage + 1, ev);
+            run.feed(stage + 1, {ev.tick + tb.ratchet_length,
+                                 jack::MidiMessage::compose_note_off(ch, note)});
+
+            if (st.ratchet.count < RATCHET_NOTES) {
+                st.ratchet.notes[st.ratchet.count++] = {
+                        ev.tick + tb.ratchet_interval, tb.ratchet_repeats - 1,
+                        note, ch, ev.msg.data[2]};
+            }
+
+            if (!st.ratcheted[note]) ++st.holding;
+            st.ratcheted[note] = true;
+        } else if (is_note_off(ev.msg)) {
+            ratchet_cut(st, note, ch);
+
+            // the hits carry their own note-offs
+            if (st.ratcheted[note]) {
+                st.ratcheted[note] = false;
+                --st.holding;
+                return;
+            }
+            run.feed(stage + 1, ev);
+        } else {
+            run.feed(stage + 1, ev);
+        }
+    }
+
+    static void ratchet_advance(const Run &run, size_t stage, ticks until) {
+        const Tables &tb = run.tb;
+        State::Ratchet &r = run.st.ratchet;
+
+        // switched off - no more repeats
+        if (tb.ratchet_repeats <= 1) r.count = 0;
+
+        for (size_t i = 0; i < r.count;) {
+            State::Repeat &n = r.notes[i];
+
+            for (; n.left && n.next < until; n.next += tb.ratchet_interval, --n.left) {
+                run.feed(stage + 1, {n.next, jack::MidiMessage::compose_note_on(
+                                                     n.channel, n.note, n.velocity)});
+                run.feed(stage + 1, {n.next + tb.ratchet_length,
+                                     jack::MidiMessage::compose_note_off(n.channel, n.note)});
+            }
+
+            if (!n.left) {
+                n = r.notes[--r.count];
+                continue;
+            }
+            ++i;
+        }
+    }
+
+    /// drops the repeats of the note still to come
+    static void ratchet_cut(State &st, uchar note, uchar ch) {
+        State::Ratchet &r = st.ratchet;
+
+        for (size_t i = 0; i < r.count; ++i) {
+            if (r.notes[i].note == note && r.notes[i].channel == ch) {
+                r.notes[i] = r.notes[--r.count];
+                return;
+            }
+        }
+    }
+
+    // ======================== TRANSPOSE ==========================
+    /** the note-offs follow their note-ons even if the config changes - with
+     * the transpose off the stage only maps the note-offs still mapped
+     */
+    static void transpose_event(const Run &run, size_t stage, const Event &ev) {
+        const Tables &tb = run.tb;
+        State &st = run.st;
+        uchar status = ev.msg.data[0] & EV_CLEAR_CHAN_MASK;
+        uchar note   = ev.msg.data[1] & NOTE_MAX;
+        Event out = ev;
+
+        if (is_note_on(ev.msg)) {
+            if (!tb.transposing) {
+                run.feed(stage + 1, ev);
+                return;
+            }
+
+            uchar n = tb.note[note];
+            if (n == NO_NOTE) return;
+
+            if (st.mapped[note] == NO_NOTE) ++st.holding;
+            st.mapped[note] = n;
+            out.msg.data[1] = n;
+        } else if (is_note_off(ev.msg)) {
+            uchar n = st.mapped[note];
+
+            if (n == NO_NOTE) {
+                // filtered out note-on, or played untransposed
+                if (tb.transposing) return;
+                run.feed(stage + 1, ev);
+                return;
+            }
+
+            st.mapped[note] = NO_NOTE;
+            --st.holding;
+            out.msg.data[1] = n;
+        } else if (status == EV_AFTERTOUCH) {
+            uchar n = tb.note[note];
+            if (n == NO_NOTE) return;
+            out.msg.data[1] = n;
+        }
+
+        run.feed(stage + 1, out);
+    }
+
+    // ======================== VELOCITY ==========================
+    static void velocity_event(const Run &run, size_t stage, const Event &ev) {
+        if (!is_note_on(ev.msg)) {
+            run.feed(stage + 1, ev);
+            return;
+        }
+
+        Event out = ev;
+        out.msg.data[2] = run.tb.velocity[ev.msg.data[2] & NOTE_MAX];
+        run.feed(stage + 1, out);
+    }
+
+    /// true if the note is in the configured scale
+    bool in_scale(int note) const {
+        uchar rel = uchar(((note - scale_root) % 12 + 12) % 12);
+        return NoteScaler::scales[scale_idx].note_to_position(0, rel) != Scale::INVALID;
+    }
+
+    /// recomputes the spare table set and publishes it
+    void rebuild() {
+        Tables &tb = tables.spare();
+
+        tb.arp_rate    = arp_rate;
+        tb.arp_mode    = arp_mode;
+        tb.arp_octaves = arp_octaves;
+        tb.arp_length  = std::max(arp_rate * ticks(arp_gate) / 100, ticks(1));
+
+        tb.ratchet_repeats  = ratchet_repeats;
+        tb.ratchet_interval = ratchet_interval;
+        tb.ratchet_length   = ratchet_interval / 2;
+
+        for (int n = 0; n <= NOTE_MAX; ++n) {
+            int t = n + transpose;
+            while (t >= 0 && !in_scale(t)) --t;
+            tb.note[n] = t >= 0 && t <= NOTE_MAX ? uchar(t) : NO_NOTE;
+        }
+
+        tb.velocity[0] = 0;
+        for (int v = 1; v <= NOTE_MAX; ++v) {
+            double c = std::pow(double(v) / NOTE_MAX, velo_gamma);
+            tb.velocity[v] = uchar(std::lround(velo_lo + c * (velo_hi - velo_lo)));
+        }
+
+        tb.transposing = transpose || scale_idx;
+
+        // only the stages that change anything make it into the table - and
+        // the ratchet and transpose always, to release the notes they hold
+        // when switched off. Left out of the chain they go last
+        Kind kinds[MAX_STAGES];
+        size_t n = std::copy(order, order + order_count, kinds) - kinds;
+        for (Kind k : {FX_RATCHET, FX_TRANSPOSE}) {
+            if (std::find(kinds, kinds + n, k) == kinds + n) kinds[n++] = k;
+        }
+
+        tb.count  = 0;
+        tb.active = false;
+        for (size_t i = 0; i < n; ++i) {
+            Stage s;
+            bool on = false;
+
+            switch (kinds[i]) {
+            case FX_ARPEGGIATOR:
+                on = arp_rate > 0;
+                if (on) s = {&arp_event, &arp_advance};
+                break;
+            case FX_RATCHET:
+                on = ratchet_repeats > 1;
+                s  = {&ratchet_event, &ratchet_advance};
+                break;
+            case FX_TRANSPOSE:
+                on = tb.transposing;
+                s  = {&transpose_event, nullptr};
+                break;
+            case FX_VELOCITY:
+                on = velo_gamma != 1.0 || velo_lo != 1 || velo_hi != NOTE_MAX;
+                if (on) s = {&velocity_event, nullptr};
+                break;
+            }
+
+            if (s.event) tb.stages[tb.count++] = s;
+            tb.active = tb.active || on;
+        }
+
+        tables.publish();
+    }
+
+    // configuration (UI thread only)
+    Kind   order[MAX_STAGES] = {FX_ARPEGGIATOR, FX_RATCHET, FX_TRANSPOSE, FX_VELOCITY};
+    size_t order_count = MAX_STAGES;
+
+    ticks    arp_rate    = 0;
+    ArpMode  arp_mode    = ARP_UP;
+    uchar    arp_octaves = 1;
+    unsigned arp_gate    = 50;
+
+    unsigned ratchet_repeats  = 1;
+    ticks    ratchet_interval = PPQN / 8;
+
+    int    transpose  = 0;
+    uchar  scale_idx  = 0;
+    uchar  scale_root = 0;
+    double velo_gamma = 1.0;
+    uchar  velo_lo    = 1;
+    uchar  velo_hi    = NOTE_MAX;
+
+    TableSwap<Tables> tables;
+};
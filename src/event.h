@@ -1,20 +1,52 @@
 #pragma once
 
+#include <memory>
+#include <vector>
+
 #include "error.h"
 #include "common.h"
 
+/// length of a (non-sysex) midi message with the given status byte
+inline uchar midi_message_size(uchar status) {
+    switch (status & EV_CLEAR_CHAN_MASK) {
+    case EV_PROGRAM_CHANGE:
+    case EV_CHANNEL_PRESSURE: return 2;
+    case EV_SYSEX:
+        switch (status) {
+        case 0xF1:                // MTC quarter frame
+        case 0xF3: return 2;      // song select
+        case 0xF2: return 3;      // song position
+        default:   return 1;      // tune request, realtime
+        }
+    default: return 3;
+    }
+}
+
 // A single midi event
 class Event {
 public:
     Event() : marked(false) {};
 
+    /** creates the event from a raw midi message - a 1 to 3 byte channel or
+     * system message, or a sysex of any length
+     */
     Event(const unsigned char *srcbuf, int srcsize) {
-        if (srcsize != 3)
+        if (srcsize < 1)
+            throw Exception("Midi Event: Empty input source buffer");
+
+        if (srcbuf[0] == EV_SYSEX) {
+            status = EV_SYSEX;
+            sysex  = std::make_shared<const std::vector<uchar>>(srcbuf, srcbuf + srcsize);
+            return;
+        }
+
+        if (srcsize > 3)
             throw Exception("Midi Event: Input source buffer size mismatch");
 
-        status = srcbuf[0];
-        data[0] = srcbuf[1];
-        data[1] = srcbuf[2];
+        set_status(srcbuf[0]);
+        size = srcsize;
+        if (srcsize > 1) data[0] = srcbuf[1];
+        if (srcsize > 2) data[1] = srcbuf[2];
     }
 
     bool is_linked() const { return linked; }
@@ -52,9 +84,18 @@ public:
             status = st;
         else
             status = st & EV_CLEAR_CHAN_MASK;
+        size = midi_message_size(st);
         return *this;
     }
 
+    bool is_sysex() const { return sysex != nullptr; }
+
+    // length of the whole message in bytes, including the status
+    size_t get_size() const { return sysex ? sysex->size() : size; }
+
+    // all bytes of a sysex message (F0 ... F7), nullptr for other events
+    const uchar *get_sysex() const { return sysex ? sysex->data() : nullptr; }
+
     ticks get_ticks() const { return tick; }
     Event &set_ticks(ticks t) { tick = t;  return *this; }
 
@@ -112,7 +153,11 @@ protected:
     ticks tick    = 0;
     uchar status  = 0;
     uchar data[2] = {0x0, 0x0};
+    uchar size    = 3;
     bool  marked    = false;
     bool  selected  = false;
     Event *linked   = nullptr;
+
+    // sysex bytes are immutable, so copies of the event share them
+    std::shared_ptr<const std::vector<uchar>> sysex;
 };
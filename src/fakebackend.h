@@ -0,0 +1,401 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <regex>
+#include <algorithm>
+
+#include "backend.h"
+#include "error.h"
+
+/** Simulated backend - drives the process callback from a virtual frame
+ * clock, without any server. Input events can be injected into input
+ * ports, everything written to output ports is captured with absolute
+ * frame times. Used to run, benchmark and timing-check the whole engine
+ * deterministically.
+ *
+ * Ports of other clients are simulated by plug()/unplug(). The port
+ * notifications are delivered at the start of the next cycle, from the
+ * cycling thread.
+ *
+ * @note cycle()/run() call the process callback synchronously in the
+ * calling thread - that thread plays the role of the jack thread.
+ */
+class FakeBackend : public backend::Backend {
+public:
+    /// an event on a port, with absolute frame time
+    struct Event {
+        jack_nframes_t frame;
+        std::vector<uchar> data;
+    };
+
+    class FakePort;
+
+    /// preallocated midi buffer, behaves like the jack one (rejects events
+    /// out of order or out of the period)
+    class FakeMidiBuffer : public backend::MidiBuffer {
+    public:
+        static constexpr size_t MAX_BYTES  = 32768;
+        static constexpr size_t MAX_EVENTS = 4096;
+
+        uint32_t get_event_count() override { return count; }
+
+        void get_event(jack_midi_event_t &ev, uint32_t order) override {
+            if (order >= count) {
+                ev = {0, 0, nullptr};
+                return;
+            }
+            ev.time   = events[order].time;
+            ev.size   = events[order].size;
+            ev.buffer = bytes + events[order].offset;
+        }
+
+        void clear() override {
+            count = 0;
+            used  = 0;
+        }
+
+        jack_midi_data_t *event_reserve(jack_nframes_t time,
+                                        size_t data_size) override
+        {
+            if (time >= nframes) return nullptr;
+            if (count && time < events[count - 1].time) return nullptr;
+            if (count >= MAX_EVENTS || used + data_size > MAX_BYTES)
+                return nullptr;
+
+            events[count++] = {time, used, data_size};
+            jack_midi_data_t *res = bytes + used;
+            used += data_size;
+            return res;
+        }
+
+    protected:
+        friend class FakePort;
+
+        struct Slot {
+            jack_nframes_t time;
+            size_t offset;
+            size_t size;
+        };
+
+        jack_nframes_t nframes = 0;
+        uint32_t count = 0;
+        size_t used = 0;
+        Slot events[MAX_EVENTS];
+        jack_midi_data_t bytes[MAX_BYTES];
+    };
+
+    class FakePort : public backend::Port {
+    public:
+        FakePort(FakeBackend &owner, const char *name, unsigned long flags)
+            : owner(owner), port_name(name), flags(flags)
+        {
+            buffer = std::make_unique<FakeMidiBuffer>();
+        }
+
+        ~FakePort() override {
+            for (const auto &c : connections) notify_connect(c.c_str(), false);
+            owner.unregister(this);
+        }
+
+        backend::MidiBuffer &get_midi_buffer(jack_nframes_t) override {
+            return *buffer;
+        }
+
+        void connect_from(const char *source) override {
+            connections.emplace_back(source);
+            notify_connect(source, true);
+        }
+
+        void connect_to(const char *target) override {
+            connections.emplace_back(target);
+            notify_connect(target, true);
+        }
+
+        void disconnect_from(const char *source) override { disconnect(source); }
+        void disconnect_to(const char *target) override { disconnect(target); }
+
+        const char *name() override { return port_name.c_str(); }
+
+        bool is_input() const { return flags & PORT_INPUT; }
+
+        const std::vector<std::string> &get_connections() const { return connections; }
+
+    protected:
+        friend class FakeBackend;
+
+        void disconnect(const char *other) {
+            auto it = std::remove(connections.begin(), connections.end(), other);
+            if (it == connections.end()) return;
+
+            connections.erase(it, connections.end());
+            notify_connect(other, false);
+        }
+
+        void notify_connect(const char *other, bool connected) {
+            if (is_input())
+                owner.notify({N_CONNECT, other, port_name, 0, connected});
+            else
+                owner.notify({N_CONNECT, port_name, other, 0, connected});
+        }
+
+        // fills the input buffer with the injected events for the period
+        void prepare(jack_nframes_t frame, jack_nframes_t nframes) {
+            buffer->clear();
+            buffer->nframes = nframes;
+
+            if (!is_input()) return;
+
+            size_t n = 0;
+            for (; n < injected.size(); ++n) {
+                const Event &ev = injected[n];
+                if (int32_t(ev.frame - (frame + nframes)) >= 0) break;
+
+                // late injections are delivered at the start of the period
+                jack_nframes_t t = int32_t(ev.frame - frame) > 0 ? ev.frame - frame : 0;
+                if (buffer->count && t < buffer->events[buffer->count - 1].time)
+                    t = buffer->events[buffer->count - 1].time;
+
+                jack_midi_data_t *d = buffer->event_reserve(t, ev.data.size());
+                if (d) std::copy(ev.data.begin(), ev.data.end(), d);
+            }
+
+            injected.erase(injected.begin(), injected.begin() + n);
+        }
+
+        // stores whatever the engine wrote into the output buffer
+        void capture(jack_nframes_t frame) {
+            if (is_input() || !owner.capturing) return;
+
+            for (uint32_t i = 0; i < buffer->count; ++i) {
+                jack_midi_event_t ev;
+                buffer->get_event(ev, i);
+                captured.push_back({frame + ev.time,
+                                    {ev.buffer, ev.buffer + ev.size}});
+            }
+        }
+
+        FakeBackend &owner;
+        std::string port_name;
+        unsigned long flags;
+        std::unique_ptr<FakeMidiBuffer> buffer;
+        std::vector<std::string> connections;
+        std::vector<Event> injected; // sorted by frame
+        std::vector<Event> captured;
+    };
+
+    FakeBackend(jack_nframes_t sample_rate = 48000, jack_nframes_t period = 256)
+        : rate(sample_rate), period(period)
+    {}
+
+    FakeBackend(const FakeBackend &) = delete;
+    FakeBackend &operator=(const FakeBackend &) = delete;
+
+    std::unique_ptr<backend::Port> register_port(const char *name,
+                                                 unsigned long flags) override
+    {
+        std::scoped_lock<std::mutex> l(ports_mtx);
+
+        if (find_port(name))
+            throw Exception(format("Port ", name, " already registered"));
+
+        auto p = std::make_unique<FakePort>(*this, name, flags);
+        ports.push_back(p.get());
+
+        // jack tells about our own ports too
+        notify({N_REGISTER, name, {}, flags, true});
+        return p;
+    }
+
+    void set_callback(backend::Callback &cb) override { callback = &cb; }
+
+    void set_port_listener(backend::PortListener &l) override { listener = &l; }
+
+    std::vector<std::string> get_ports(const char *port_name_pattern = nullptr,
+                                       unsigned long flags = 0) const override
+    {
+        std::scoped_lock<std::mutex> l(ports_mtx);
+        std::vector<std::string> res;
+
+        auto add = [&](const std::string &name, unsigned long f) {
+            if ((f & flags) != flags) return;
+            if (port_name_pattern && !std::regex_search(name, std::regex(port_name_pattern)))
+                return;
+            res.push_back(name);
+        };
+
+        for (const FakePort *p : ports) add(p->port_name, p->flags);
+        for (const auto &e : external) add(e.name, e.flags);
+
+        return res;
+    }
+
+    bool is_own_port(const char *name) const override {
+        std::scoped_lock<std::mutex> l(ports_mtx);
+        return find_port(name) != nullptr;
+    }
+
+    /// a port of another client appears (flags as seen by jack)
+    void plug(const std::string &name, unsigned long flags) {
+        {
+            std::scoped_lock<std::mutex> l(ports_mtx);
+            external.push_back({name, flags});
+        }
+
+        notify({N_REGISTER, name, {}, flags, true});
+    }
+
+    /// the port of another client disappears, with its connections
+    void unplug(const std::string &name) {
+        unsigned long flags = 0;
+
+        {
+            std::scoped_lock<std::mutex> l(ports_mtx);
+
+            auto it = std::find_if(external.begin(), external.end(),
+                                   [&](const External &e) { return e.name == name; });
+            if (it == external.end()) return;
+
+            flags = it->flags;
+            external.erase(it);
+
+            for (FakePort *p : ports) p->disconnect(name.c_str());
+        }
+
+        notify({N_REGISTER, name, {}, flags, false});
+    }
+
+    void activate() override   { active = true; }
+    void deactivate() override { active = false; }
+
+    jack_nframes_t last_frame_time() const override { return frame; }
+
+    // between cycles, the virtual clock stands at the start of the period
+    jack_nframes_t frame_time() const override { return frame; }
+
+    jack_nframes_t sample_rate() override { return rate; }
+
+    jack_nframes_t get_period() const { return period; }
+
+    /// runs a single process period and advances the virtual clock
+    void cycle() {
+        deliver_notices();
+
+        std::scoped_lock<std::mutex> l(ports_mtx);
+        jack_nframes_t f = frame;
+
+        for (FakePort *p : ports) p->prepare(f, period);
+
+        if (active && callback) callback->process(period);
+
+        for (FakePort *p : ports) p->capture(f);
+
+        frame = f + period;
+    }
+
+    void run(unsigned periods) {
+        for (unsigned i = 0; i < periods; ++i) cycle();
+    }
+
+    /// runs enough periods to cover given number of frames
+    void run_frames(jack_nframes_t nframes) {
+        run((nframes + period - 1) / period);
+    }
+
+    /// queues an event to appear on an input port at absolute frame time
+    void inject(const char *port, jack_nframes_t at,
+                std::initializer_list<uchar> data)
+    {
+        std::scoped_lock<std::mutex> l(ports_mtx);
+        FakePort *p = find_port(port);
+        if (!p) throw Exception(format("No such port ", port));
+
+        auto &inj = p->injected;
+        auto pos = std::upper_bound(
+                inj.begin(), inj.end(), at,
+                [](jack_nframes_t t, const Event &e) { return t < e.frame; });
+        inj.insert(pos, Event{at, data});
+    }
+
+    /// all events output on the given port so far
+    const std::vector<Event> &get_captured(const char *port) {
+        std::scoped_lock<std::mutex> l(ports_mtx);
+        FakePort *p = find_port(port);
+        if (!p) throw Exception(format("No such port ", port));
+        return p->captured;
+    }
+
+    void clear_captured() {
+        std::scoped_lock<std::mutex> l(ports_mtx);
+        for (FakePort *p : ports) p->captured.clear();
+    }
+
+    /// capturing can be switched off for benchmarking
+    void set_capture(bool c) { capturing = c; }
+
+    FakePort *find_port(const char *name) const {
+        for (FakePort *p : ports)
+            if (p->port_name == name) return p;
+        return nullptr;
+    }
+
+protected:
+    enum NoticeKind { N_REGISTER, N_CONNECT };
+
+    struct Notice {
+        NoticeKind kind;
+        std::string name, other;
+        unsigned long flags;
+        bool on;
+    };
+
+    struct External {
+        std::string name;
+        unsigned long flags;
+    };
+
+    void unregister(FakePort *p) {
+        std::scoped_lock<std::mutex> l(ports_mtx);
+        ports.erase(std::remove(ports.begin(), ports.end(), p), ports.end());
+        notify({N_REGISTER, p->port_name, {}, p->flags, false});
+    }
+
+    void notify(Notice n) {
+        std::scoped_lock<std::mutex> l(notice_mtx);
+        notices.push_back(std::move(n));
+    }
+
+    void deliver_notices() {
+        std::vector<Notice> pending;
+        {
+            std::scoped_lock<std::mutex> l(notice_mtx);
+            pending.swap(notices);
+        }
+
+        if (!listener) return;
+
+        for (const Notice &n : pending) {
+            if (n.kind == N_REGISTER)
+                listener->on_port_registered(n.name.c_str(), n.flags, n.on);
+            else
+                listener->on_port_connected(n.name.c_str(), n.other.c_str(), n.on);
+        }
+    }
+
+    jack_nframes_t rate;
+    jack_nframes_t period;
+    std::atomic<jack_nframes_t> frame = 0;
+    std::atomic<bool> active = false;
+    bool capturing = true;
+    backend::Callback *callback = nullptr;
+    backend::PortListener *listener = nullptr;
+
+    mutable std::mutex ports_mtx; // ports may come and go from other threads
+    std::vector<FakePort *> ports;
+    std::vector<External> external;
+
+    std::mutex notice_mtx;
+    std::vector<Notice> notices;
+};
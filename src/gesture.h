@@ -0,0 +1,244 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <map>
+
+#include "grid.h"
+#include "timer.h"
+
+/// thresholds of the Gestures
+struct GestureConfig {
+    std::chrono::milliseconds long_press{500};
+    std::chrono::milliseconds double_tap{300}; // between the two presses
+    std::chrono::milliseconds chord{50};       // between the first and the last pad
+};
+
+/** Recognizes gestures in the key events of a surface. The durations are
+ * measured between the frame stamps of the keys, so they do not depend on
+ * when the keys got dispatched. What has to fire while a key is still held
+ * (long press, the end of a chord) is driven by the timer wheel, nothing
+ * polls.
+ *
+ *   G_TAP        - a press and release shorter than the long press
+ *   G_DOUBLE_TAP - a second press of the button within double_tap of the
+ *                  first one, fired on the press
+ *   G_LONG_PRESS - the button held for long_press, fired while held
+ *   G_HOLD_PRESS - a button pressed while another one is held (anchor)
+ *   G_CHORD      - two or more pads pressed within the chord window, fired
+ *                  when the window ends
+ *
+ * A button that took part in a double tap, a hold press (either side) or a
+ * chord gives no tap nor long press of its own.
+ *
+ * @note UI thread only - the keys get dispatched there, the timers fire there
+ */
+class Gestures {
+public:
+    using Duration = std::chrono::milliseconds;
+    using Config   = GestureConfig;
+
+    enum Kind {
+        G_TAP = 1,
+        G_DOUBLE_TAP,
+        G_LONG_PRESS,
+        G_HOLD_PRESS,
+        G_CHORD
+    };
+
+    struct Gesture {
+        Kind kind;
+        unsigned code;     // the button - the one pressed for G_HOLD_PRESS
+        unsigned anchor;   // G_HOLD_PRESS: the button held before
+        GridSurface::Bitmap pads; // G_CHORD: the pads
+        jack_nframes_t time; // frame of the key completing it, or now for the timed ones
+    };
+
+    using Callback = std::function<void(const Gesture &)>;
+
+    Gestures(TimerWheel &timers, jack_nframes_t sample_rate, Callback cb,
+             const Config &cfg = {})
+        : timers(timers), sample_rate(sample_rate), callback(std::move(cb)), cfg(cfg)
+    {}
+
+    ~Gestures() { reset(); }
+
+    Gestures(const Gestures &) = delete;
+    Gestures &operator=(const Gestures &) = delete;
+
+    const Config &get_config() const { return cfg; }
+    void set_config(const Config &c) { cfg = c; }
+
+    /// feed with all the keys of the surface, in the order they came
+    void on_key(const GridSurface::KeyEvent &ev) {
+        if (ev.press)
+            pressed(ev);
+        else
+            released(ev);
+    }
+
+    /// forgets the held buttons and the pending gestures (screen change)
+    void reset() {
+        for (auto &h : held) timers.cancel(h.second.timer);
+        held.clear();
+
+        timers.cancel(chord_timer);
+        chord_timer = TimerWheel::NO_TIMER;
+        chord.clear();
+        chord_size = 0;
+
+        tapped = false;
+    }
+
+protected:
+    struct Held {
+        jack_nframes_t since;
+        TimerWheel::Id timer = TimerWheel::NO_TIMER;
+        bool used = false; // part of another gesture, or the long press fired
+    };
+
+    Duration to_duration(jack_nframes_t frames) const {
+        return Duration(uint64_t(frames) * 1000 / sample_rate);
+    }
+
+    void pressed(const GridSurface::KeyEvent &ev) {
+        if (held.count(ev.code)) return; // a repeated press, device glitch
+
+        Held h{ev.time};
+
+        bool in_chord = ev.type == GridSurface::BTN_GRID && chord_size
+                        && to_duration(ev.time - chord_since) <= cfg.chord;
+
+        if (ev.type == GridSurface::BTN_GRID && !in_chord) start_chord(ev);
+
+        if (in_chord) {
+            chord.mark(ev.x, ev.y);
+            ++chord_size;
+            use_chord();
+            h.used = true;
+        } else if (Held *anchor = earliest_held()) {
+            anchor->used = true;
+            timers.cancel(anchor->timer);
+            h.used = true;
+
+            emit({G_HOLD_PRESS, ev.code, anchor_code, {}, ev.time});
+        }
+
+        if (tapped && tap_code == ev.code
+            && to_duration(ev.time - tap_since) <= cfg.double_tap)
+        {
+            tapped = false;
+            h.used = true;
+            emit({G_DOUBLE_TAP, ev.code, 0, {}, ev.time});
+        }
+
+        if (!h.used) {
+            unsigned code = ev.code;
+            h.timer = timers.schedule(cfg.long_press, [this, code] { long_press(code); });
+        }
+
+        held[ev.code] = h;
+    }
+
+    void released(const GridSurface::KeyEvent &ev) {
+        auto it = held.find(ev.code);
+        if (it == held.end()) return;
+
+        Held h = it->second;
+        held.erase(it);
+        timers.cancel(h.timer);
+
+        if (h.used) return;
+
+        // the frames tell - the timer may not have fired yet
+        if (to_duration(ev.time - h.since) >= cfg.long_press) {
+            emit({G_LONG_PRESS, ev.code, 0, {}, ev.time});
+            return;
+        }
+
+        tapped   = true;
+        tap_code = ev.code;
+        tap_since = h.since;
+        emit({G_TAP, ev.code, 0, {}, ev.time});
+    }
+
+    void long_press(unsigned code) {
+        auto it = held.find(code);
+        if (it == held.end() || it->second.used) return;
+
+        it->second.used  = true;
+        it->second.timer = TimerWheel::NO_TIMER;
+        emit({G_LONG_PRESS, code, 0, {}, it->second.since + to_frames(cfg.long_press)});
+    }
+
+    void start_chord(const GridSurface::KeyEvent &ev) {
+        timers.cancel(chord_timer);
+
+        chord.clear();
+        chord.mark(ev.x, ev.y);
+        chord_size  = 1;
+        chord_since = ev.time;
+        chord_timer = timers.schedule(cfg.chord, [this] { end_chord(); });
+    }
+
+    /// the pads of the chord give no taps nor long presses
+    void use_chord() {
+        for (auto &h : held) {
+            unsigned x = GridSurface::btn_x(h.first), y = GridSurface::btn_y(h.first);
+            if (h.first >= GridSurface::BC_UP || !chord.get(x, y)) continue;
+
+            h.second.used = true;
+            timers.cancel(h.second.timer);
+        }
+    }
+
+    void end_chord() {
+        chord_timer = TimerWheel::NO_TIMER;
+        if (chord_size >= 2)
+            emit({G_CHORD, 0, 0, chord, chord_since + to_frames(cfg.chord)});
+
+        chord.clear();
+        chord_size = 0;
+    }
+
+    /// the button held the longest, sets anchor_code
+    Held *earliest_held() {
+        Held *res = nullptr;
+
+        for (auto &h : held) {
+            if (res && jack_nframes_t(h.second.since - res->since) < 0x80000000u) continue;
+
+            res = &h.second;
+            anchor_code = h.first;
+        }
+
+        return res;
+    }
+
+    jack_nframes_t to_frames(Duration d) const {
+        return jack_nframes_t(uint64_t(d.count()) * sample_rate / 1000);
+    }
+
+    void emit(const Gesture &g) {
+        if (callback) callback(g);
+    }
+
+    TimerWheel &timers;
+    const jack_nframes_t sample_rate;
+    Callback callback;
+    Config cfg;
+
+    std::map<unsigned, Held> held;
+    unsigned anchor_code = 0;
+
+    // the last tap, for double taps
+    bool tapped = false;
+    unsigned tap_code = 0;
+    jack_nframes_t tap_since = 0;
+
+    // the chord being collected
+    GridSurface::Bitmap chord;
+    unsigned chord_size = 0;
+    jack_nframes_t chord_since = 0;
+    TimerWheel::Id chord_timer = TimerWheel::NO_TIMER;
+};
@@ -0,0 +1,682 @@
+#pragma once
+
+#include <functional>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+
+#include "jackmidi.h"
+#include "backend.h"
+#include "common.h"
+#include "error.h"
+#include "metrics.h"
+#include "spsc.h"
+
+namespace grid {
+
+/** Device independent led color, 8 bits per channel. The drivers quantize it
+ * to whatever the device can show.
+ */
+struct Color {
+    constexpr Color() = default;
+
+    constexpr Color(uchar r, uchar g, uchar b)
+        : rgb(uint32_t(r) << 16 | uint32_t(g) << 8 | b)
+    {}
+
+    static constexpr Color from_packed(uint32_t v) {
+        Color c;
+        c.rgb = v;
+        return c;
+    }
+
+    constexpr uchar r() const { return rgb >> 16; }
+    constexpr uchar g() const { return rgb >> 8; }
+    constexpr uchar b() const { return rgb; }
+
+    constexpr bool operator==(const Color &o) const { return rgb == o.rgb; }
+    constexpr bool operator!=(const Color &o) const { return rgb != o.rgb; }
+
+    uint32_t rgb = 0; // 0x00RRGGBB
+};
+
+/** Compile time layout of a controller. All the leds in one order - the grid
+ * row by row from the top, then the side column (top to bottom), then the
+ * top row.
+ */
+template<unsigned W, unsigned H>
+struct Geometry {
+    static constexpr unsigned WIDTH     = W;
+    static constexpr unsigned HEIGHT    = H;
+    static constexpr unsigned LED_SIDE  = W * H;
+    static constexpr unsigned LED_TOP   = LED_SIDE + H;
+    static constexpr unsigned LED_COUNT = LED_TOP + W;
+    static constexpr unsigned NO_LED    = LED_COUNT;
+
+    static constexpr unsigned grid_led(unsigned x, unsigned y) { return y * W + x; }
+    static constexpr unsigned side_led(unsigned y) { return LED_SIDE + y; }
+    static constexpr unsigned top_led(unsigned x)  { return LED_TOP + x; }
+};
+
+/// colors of all the leds of a geometry
+template<typename GeometryT>
+struct ColorBuffer {
+    using Geometry = GeometryT;
+
+    Color &operator[](unsigned led) { return leds[led]; }
+    const Color &operator[](unsigned led) const { return leds[led]; }
+
+    void fill(Color c) { std::fill(std::begin(leds), std::end(leds), c); }
+
+    Color leds[Geometry::LED_COUNT] = {};
+};
+
+/// color model of the rgb devices - BITS per channel
+template<unsigned BITS>
+struct RgbModel {
+    static constexpr uchar channel(uchar c) { return c >> (8 - BITS); }
+};
+
+/// color model of the red/green devices - 4 brightness levels of the two
+struct RedGreenModel {
+    static constexpr uchar level(uchar c) { return (c + 42) / 85; }
+    static constexpr uchar encode(Color c) { return level(c.g()) << 4 | level(c.r()); }
+};
+
+} // namespace grid
+
+/** What the screens draw on - a grid of pads with a side column on the right
+ * and a top row of function buttons. Either a single controller or several
+ * of them tiled (VirtualGrid), so the size is only known at runtime, up to
+ * MAX_W x MAX_H.
+ *
+ * Buttons have logical codes - coord_to_btn(x, y) for the grid, the side
+ * column is x == width(), the top row is BC_UP + x.
+ */
+class GridSurface {
+public:
+    using lock  = std::scoped_lock<std::mutex>;
+    using Color = grid::Color;
+
+    static const unsigned MAX_W = 16;
+    static const unsigned MAX_H = 16;
+
+    enum ButtonCode {
+        BC_UP       = 512, // above all the grid and side codes
+        BC_DOWN     = 513,
+        BC_LEFT     = 514,
+        BC_RIGHT    = 515,
+        BC_SESSION  = 516,
+        BC_USER1    = 517,
+        BC_USER2    = 518,
+        BC_MIXER    = 519
+    };
+
+    enum ButtonType {
+        BTN_GRID = 1, // Any grid button (x,y coordinates will be ginen)
+        BTN_SIDE,     // Any right side button (y gives the button)
+        BTN_TOP,      // Top row button (x gives the button)
+    };
+
+    /// some basic colors, the red/green levels of color()
+    static constexpr Color CL_BLACK    {0, 0, 0};
+    static constexpr Color CL_GREEN    {0, 255, 0};
+    static constexpr Color CL_GREEN_M  {0, 170, 0};
+    static constexpr Color CL_GREEN_L  {0, 85, 0};
+    static constexpr Color CL_RED      {255, 0, 0};
+    static constexpr Color CL_RED_M    {170, 0, 0};
+    static constexpr Color CL_RED_L    {85, 0, 0};
+    static constexpr Color CL_AMBER    {255, 255, 0};
+    static constexpr Color CL_AMBER_M  {170, 170, 0};
+    static constexpr Color CL_AMBER_L  {85, 85, 0};
+    static constexpr Color CL_YELLOW   {170, 255, 0};
+    static constexpr Color CL_YELLOW_M {85, 170, 0};
+    static constexpr Color CL_ORANGE   {255, 85, 0};
+
+    // converted keypress -
+    struct KeyEvent {
+        ButtonType type;
+        unsigned code; // logical button code (see coord_to_btn, ButtonCode)
+        unsigned int x, y; // coords for grid buttons, X for toprow buttons, Y for siderow
+        bool press; // true for press, false for release
+        jack_nframes_t time = 0; // frame the device sent it at
+    };
+
+    // NOTE: This callback is called from the thread dispatching the keys (the
+    // UI thread), not from jack - see GridController::dispatch_keys
+    using KeyCb    = std::function<void(GridSurface&, const KeyEvent&)>;
+
+    // for fast_fill, this is a callback to get field color based on coords
+    using ColorCb  = std::function<Color(unsigned,unsigned)>;
+
+    /// packed flags for the grid part, a row of bits per grid row
+    struct Bitmap {
+        Bitmap() = default;
+
+        void mark(unsigned x, unsigned y) {
+            if (x >= MAX_W) return;
+            if (y >= MAX_H) return;
+
+            rows[y] |= 1 << x;
+        }
+
+        void unmark(unsigned x, unsigned y) {
+            if (x >= MAX_W) return;
+            if (y >= MAX_H) return;
+
+            rows[y] &= ~(1 << x);
+        }
+
+        bool get(unsigned x, unsigned y) const {
+            if (x >= MAX_W) return false;
+            if (y >= MAX_H) return false;
+
+            return (rows[y] >> x) & 1;
+        }
+
+        Bitmap &operator|=(const Bitmap &b) {
+            for (unsigned y = 0; y < MAX_H; ++y) rows[y] |= b.rows[y];
+            return *this;
+        }
+
+        Bitmap &operator&=(const Bitmap &b) {
+            for (unsigned y = 0; y < MAX_H; ++y) rows[y] &= b.rows[y];
+            return *this;
+        }
+
+        Bitmap operator~() const {
+            Bitmap r;
+            for (unsigned y = 0; y < MAX_H; ++y) r.rows[y] = ~rows[y];
+            return r;
+        }
+
+        // iterates the bitfields and calls a callback
+        template<typename CbT>
+        void iterate(CbT cb) const {
+            for (unsigned x = 0; x < MAX_W; ++x) {
+                for (unsigned y = 0; y < MAX_H; ++y) {
+                    if ((rows[y] >> x) & 1) cb(x, y);
+                }
+            }
+        }
+
+        void clear() {
+            std::fill(std::begin(rows), std::end(rows), 0);
+        }
+
+        bool has_value() const {
+            return std::any_of(std::begin(rows), std::end(rows),
+                               [](uint16_t r) { return r != 0; });
+        }
+
+        uint16_t row(unsigned y) const {
+            return y < MAX_H ? rows[y] : 0;
+        }
+
+        explicit operator bool() const {
+            return has_value();
+        }
+
+        bool operator==(const Bitmap &o) const {
+            return std::equal(std::begin(rows), std::end(rows), std::begin(o.rows));
+        }
+        bool operator!=(const Bitmap &o) const {
+            return !operator==(o);
+        }
+
+    protected:
+        static_assert(MAX_W <= 16, "a row of the bitmap is 16 bits");
+
+        uint16_t rows[MAX_H] = {};
+    };
+
+    virtual ~GridSurface() = default;
+
+    virtual unsigned width() const  = 0;
+    virtual unsigned height() const = 0;
+
+    virtual void set_callback(KeyCb c) = 0;
+
+    /** Sets color of the button btn (as specified in KeyEvent code) in the
+     * frame. Shows up on the next flip.
+     */
+    virtual void set_color(unsigned btn, Color col) = 0;
+
+    /* Fills the whole matrix part of the frame with colors given by callback
+     *
+     */
+    virtual void fill_matrix(ColorCb cb) = 0;
+
+    /** makes the button blink between its color and black. The devices
+     * able to blink on their own do so without any messages, on the others
+     * blink_phase switches the blinking leds.
+     */
+    virtual void set_blink(unsigned btn, bool blink) = 0;
+
+    /// shows the blinking leds lit or dark, from the next flip
+    virtual void blink_phase(bool on) = 0;
+
+    /// presents the composed frame
+    virtual void flip() = 0;
+
+    void set_color(unsigned btn, uchar r, uchar g) {
+        set_color(btn, color(r, g));
+    }
+
+    void fill_matrix(Color col) {
+        fill_matrix(
+             [col](unsigned x, unsigned y) { return col; });
+    }
+
+    /// color from the red/green levels (0..3) of the original Launchpad
+    static constexpr Color color(uchar r, uchar g) {
+        return {uchar(std::min(r, uchar(3)) * 85), uchar(std::min(g, uchar(3)) * 85), 0};
+    }
+
+    static unsigned coord_to_btn(unsigned x, unsigned y) {
+        return x | y << 5;
+    }
+
+    static unsigned btn_x(unsigned btn) { return btn & 0x1F; }
+    static unsigned btn_y(unsigned btn) { return btn >> 5; }
+
+    /// code of the side column button in the row y
+    unsigned side_btn(unsigned y) const { return coord_to_btn(width(), y); }
+
+    /// code of the top row button x
+    static unsigned top_btn(unsigned x) { return BC_UP + x; }
+};
+
+/** Grid controller abstraction - a single device. The screens draw into a
+ * device independent frame with the logical layout (8x8 grid, side column,
+ * top row) and flip it. The changed leds land in a last-value slot table
+ * and the driver sends those from the jack thread in the cheapest form the
+ * device offers (see send_leds). The driver also converts the device input
+ * into the logical key events.
+ */
+class GridController : public GridSurface {
+public:
+    using GridSurface::set_color;
+    using GridSurface::fill_matrix;
+
+    /// the leds of a single device
+    using Layout = grid::Geometry<8, 8>;
+    using Frame  = grid::ColorBuffer<Layout>;
+
+    static constexpr size_t RINGBUFFER_SIZE = 1024 * sizeof(jack::MidiMessage);
+    static constexpr size_t KEY_QUEUE_SIZE  = 256; // key events waiting for dispatch
+
+    static const unsigned MATRIX_W = Layout::WIDTH;
+    static const unsigned MATRIX_H = Layout::HEIGHT;
+
+    static const unsigned LED_SIDE  = Layout::LED_SIDE;
+    static const unsigned LED_TOP   = Layout::LED_TOP;
+    static const unsigned LED_COUNT = Layout::LED_COUNT;
+    static const unsigned NO_LED    = Layout::NO_LED;
+
+    static_assert(LED_COUNT <= 128, "the dirty leds are two 64 bit words");
+
+    /// set in the slot of a led the device blinks on its own (see hw_blink)
+    static constexpr uint32_t BLINK_BIT = 1u << 24;
+
+    GridController(const GridController &) = delete;
+
+    GridController(backend::Backend &client, const std::string &prefix)
+        : client(client)
+        , input_port(client.register_port((prefix + ":in").c_str(), backend::Backend::PORT_INPUT))
+        , output_port(client.register_port((prefix + ":out").c_str(), backend::Backend::PORT_OUTPUT))
+        , ringbuffer(RINGBUFFER_SIZE)
+        , keys(KEY_QUEUE_SIZE)
+    {
+        ringbuffer.mlock();
+        keys.mlock();
+    }
+
+    virtual ~GridController() = default;
+
+    unsigned width() const override  { return MATRIX_W; }
+    unsigned height() const override { return MATRIX_H; }
+
+    void set_callback(KeyCb c) override {
+        lock l(cb_mtx);
+        callback = c;
+    }
+
+    /** calls the key callback with the key events the jack thread queued,
+     * returns how many there were.
+     * @note a single thread only - the UI one
+     */
+    unsigned dispatch_keys() {
+        if (keys.empty()) return 0;
+
+        KeyCb cback;
+        {
+            lock l(cb_mtx);
+            cback = callback;
+        }
+
+        unsigned count = 0;
+        KeyEvent ev;
+        while (keys.pop(ev)) {
+            // no cback, no work - the events are dropped all the same
+            if (cback) cback(*this, ev);
+            ++count;
+        }
+
+        return count;
+    }
+
+    /** presents the composed frame - the leds that differ from what was
+     * presented last go into the led slots, the jack thread sends them
+     * (see process).
+     */
+    void flip() override {
+        lock l(frame_mtx);
+        bool changed = false;
+
+        for (unsigned i = 0; i < LED_COUNT; ++i) {
+            uint32_t v = packed(i);
+            if (v == shadow[i]) continue;
+
+            shadow[i] = v;
+            slots[i].store(v, std::memory_order_relaxed);
+            mark_dirty(i);
+            changed = true;
+        }
+
+        blinking.store(led_count(blink), std::memory_order_relaxed);
+        if (changed) stats.frames.add();
+    }
+
+    void set_blink(unsigned btn, bool b) override {
+        unsigned led = btn_to_led(btn);
+        if (led == NO_LED) return;
+
+        lock l(frame_mtx);
+        if (b) set_led(blink, led);
+        else blink[led / 64] &= ~(uint64_t(1) << (led % 64));
+    }
+
+    void blink_phase(bool on) override {
+        lock l(frame_mtx);
+        phase_on = on;
+    }
+
+    /// forgets what the device shows, every led gets sent again
+    void invalidate() {
+        dirty[0].store(~uint64_t(0), std::memory_order_release);
+        dirty[1].store((uint64_t(1) << (LED_COUNT - 64)) - 1, std::memory_order_release);
+    }
+
+    /// maximal led messages sent per period, the rest waits for the next one
+    void set_led_budget(unsigned msgs) {
+        led_budget.store(std::max(msgs, 1u), std::memory_order_relaxed);
+    }
+
+    void fill_matrix(ColorCb cb) override {
+        lock l(frame_mtx);
+
+        for (unsigned y = 0; y < MATRIX_H; ++y) {
+            for (unsigned x = 0; x < MATRIX_W; ++x) {
+                frame[Layout::grid_led(x, y)] = cb(x, y);
+            }
+        }
+    }
+
+    void set_color(unsigned btn, Color col) override {
+        unsigned led = btn_to_led(btn);
+        if (led == NO_LED) return; // err!
+
+        lock l(frame_mtx);
+        frame[led] = col;
+    }
+
+    /// index into the led order for the button code, NO_LED if there's none
+    static unsigned btn_to_led(unsigned btn) {
+        if (btn >= BC_UP)
+            return btn < BC_UP + MATRIX_W ? Layout::top_led(btn - BC_UP) : NO_LED;
+
+        unsigned x = btn_x(btn), y = btn_y(btn);
+        if (y >= MATRIX_H) return NO_LED;
+        if (x == MATRIX_W) return Layout::side_led(y);
+        if (x > MATRIX_W) return NO_LED;
+        return Layout::grid_led(x, y);
+    }
+
+    /** called from the process callback in jack - we read/write midi events
+     * here. The keys only get queued (see dispatch_keys). The queued commands
+     * go first, then the dirty led slots - with their latest color, so
+     * intermediate colors never get sent. The leds wait while there are
+     * commands due in the next period (mode setup).
+     * @return the number of key events queued
+     */
+    unsigned process(int nframes) {
+        backend::MidiBuffer &buf = input_port->get_midi_buffer(nframes);
+
+        uint32_t nevents = buf.get_event_count();
+        jack_nframes_t period_start = client.last_frame_time();
+        unsigned queued = 0;
+
+        for (uint32_t n = 0; n < nevents; ++n) {
+            jack_midi_event_t ev;
+            buf.get_event(ev, n);
+            if (process_event(ev.buffer, ev.size, period_start + ev.time)) ++queued;
+        }
+
+        // output part
+        backend::MidiBuffer &jbuf = output_port->get_midi_buffer(nframes);
+        jbuf.clear();
+
+        jack_nframes_t last_frame_time = client.last_frame_time();
+        int last_t = 0;
+        bool commands = false;
+
+        // iterate all available Midi messages in the ringbuffer
+        jack::RingBuffer::Record rec;
+        while (ringbuffer.peek_record(rec)) {
+            // if the time of the event is out of this window, break out of the loop
+            int t = rec.time + nframes - last_frame_time;
+
+            // sometimes we have an event queued that should already be out?!
+            if (t < 0) t = 0;
+            if (t >= nframes) return queued;
+
+            jack_midi_data_t *evbuf = jbuf.event_reserve(t, rec.len);
+            if (!evbuf) {
+                ringbuffer.skip_record(rec);
+                stats.dropped.add();
+                continue;
+            }
+
+            ringbuffer.read_record(rec, evbuf);
+            last_t   = t;
+            commands = true;
+        }
+
+        send_leds(jbuf, last_t, commands);
+        return queued;
+    }
+
+    /// problems encountered while talking to the device
+    struct Stats {
+        metrics::Counter overruns;  // output queue was full
+        metrics::Counter dropped;   // no space in the port buffer
+        metrics::Counter ignored;   // unexpected input messages
+        metrics::Counter keys_lost; // the key queue was full
+        metrics::Gauge   queue_fill; // bytes waiting in the output queue
+        metrics::Counter frames;       // flips with any change
+        metrics::Counter led_messages; // messages those took
+        metrics::Gauge   led_backlog;  // dirty leds left for the next period
+    };
+
+    const Stats &get_stats() const { return stats; }
+
+    void register_metrics(metrics::Registry &r, const std::string &prefix) {
+        r.add(prefix + ".overruns",   stats.overruns);
+        r.add(prefix + ".dropped",    stats.dropped);
+        r.add(prefix + ".ignored",    stats.ignored);
+        r.add(prefix + ".keys_lost",  stats.keys_lost);
+        r.add(prefix + ".queue_fill", stats.queue_fill);
+        r.add(prefix + ".frames",     stats.frames);
+        r.add(prefix + ".led_messages", stats.led_messages);
+        r.add(prefix + ".led_backlog",  stats.led_backlog);
+    }
+
+    void connect(const char *input, const char *output) {
+        input_port->connect_from(input);
+        output_port->connect_to(output);
+    }
+
+protected:
+    /** sends the dirty led slots at frame offset t. commands tells the
+     * queued commands went out before in this period.
+     * @note jack thread only
+     */
+    virtual void send_leds(backend::MidiBuffer &jbuf, jack_nframes_t t, bool commands) = 0;
+
+    /// converts a 3 byte device message to a logical key event
+    virtual bool decode_key(const uchar *data, KeyEvent &ev) = 0;
+
+    /// true if the device blinks the leds on its own - the slots of those
+    /// have BLINK_BIT, blink_phase does nothing
+    virtual bool hw_blink() const { return false; }
+
+    void send_msg(jack::MidiMessage msg) {
+        send_raw(msg.data, msg.len);
+    }
+
+    /// sends a message of any length (sysex)
+    void send_raw(const uchar *data, size_t len) {
+        // immediate send - use current frame time
+        if (!ringbuffer.write_record(client.frame_time(), data, len)) {
+            stats.overruns.add();
+            return;
+        }
+
+        stats.queue_fill.set(ringbuffer.read_space());
+    }
+
+    /// blanks the frame and forgets the pending leds (after a device reset)
+    void clear() {
+        lock l(frame_mtx);
+        frame.fill(CL_BLACK);
+        std::fill(std::begin(shadow), std::end(shadow), CL_BLACK.rgb);
+        blink[0] = blink[1] = 0;
+        blinking.store(0, std::memory_order_relaxed);
+
+        for (auto &s : slots) s.store(CL_BLACK.rgb, std::memory_order_relaxed);
+        dirty[0].store(0, std::memory_order_release);
+        dirty[1].store(0, std::memory_order_release);
+    }
+
+    // ================= led slots (driver side) ====================
+    using LedSet = uint64_t[2];
+
+    static bool is_dirty(const LedSet &d, unsigned led) {
+        return (d[led / 64] >> (led % 64)) & 1;
+    }
+
+    static void set_led(LedSet &d, unsigned led) {
+        d[led / 64] |= uint64_t(1) << (led % 64);
+    }
+
+    static unsigned led_count(const LedSet &d) {
+        return __builtin_popcountll(d[0]) + __builtin_popcountll(d[1]);
+    }
+
+    void load_dirty(LedSet &d) const {
+        d[0] = dirty[0].load(std::memory_order_acquire);
+        d[1] = dirty[1].load(std::memory_order_acquire);
+    }
+
+    /// takes the leds for sending, a color changing meanwhile marks them again
+    void claim(const LedSet &take) {
+        dirty[0].fetch_and(~take[0], std::memory_order_acq_rel);
+        dirty[1].fetch_and(~take[1], std::memory_order_acq_rel);
+    }
+
+    void mark_dirty(unsigned led) {
+        dirty[led / 64].fetch_or(uint64_t(1) << (led % 64), std::memory_order_release);
+    }
+
+    Color slot(unsigned led) const {
+        return Color::from_packed(slots[led].load(std::memory_order_relaxed) & ~BLINK_BIT);
+    }
+
+    bool slot_blinks(unsigned led) const {
+        return slots[led].load(std::memory_order_relaxed) & BLINK_BIT;
+    }
+
+    /// leds blinking in the last flip
+    unsigned get_blinking() const { return blinking.load(std::memory_order_relaxed); }
+
+    /// the slot value of the frame led
+    uint32_t packed(unsigned led) const {
+        if (!is_dirty(blink, led)) return frame[led].rgb;
+        if (hw_blink()) return frame[led].rgb | BLINK_BIT;
+        return phase_on ? frame[led].rgb : CL_BLACK.rgb;
+    }
+
+    unsigned get_led_budget() const { return led_budget.load(std::memory_order_relaxed); }
+
+    /// publishes how many leds wait for the next period
+    void update_backlog() {
+        LedSet left;
+        load_dirty(left);
+        stats.led_backlog.set(led_count(left));
+    }
+
+    /// decodes the key and queues it for dispatch_keys, true if queued
+    bool process_event(const uchar *data, size_t size, jack_nframes_t time) {
+        // pressure of the velocity sensitive pads - not used
+        if (size && ((data[0] & 0xF0) == 0xA0 || (data[0] & 0xF0) == 0xD0)) return false;
+
+        KeyEvent ev;
+        if (size != 3 || !decode_key(data, ev)) {
+            stats.ignored.add();
+            return false;
+        }
+
+        ev.time = time;
+
+        if (!keys.push(ev)) {
+            stats.keys_lost.add();
+            return false;
+        }
+
+        return true;
+    }
+
+    // locks the callback. Never taken in the jack thread
+    std::mutex cb_mtx;
+    KeyCb callback;
+
+    backend::Backend &client;
+
+    std::unique_ptr<backend::Port> input_port;
+    std::unique_ptr<backend::Port> output_port;
+
+    // queue for sent messages
+    jack::RingBuffer ringbuffer;
+
+    // decoded keys, jack thread -> dispatch_keys
+    SpscQueue<KeyEvent> keys;
+
+    static constexpr unsigned DEFAULT_LED_BUDGET = 16; // messages per period
+
+    // frame being composed, and the slot values last presented
+    std::mutex frame_mtx;
+    Frame frame;
+    LedSet blink = {0, 0};
+    bool phase_on = true;
+    uint32_t shadow[LED_COUNT] = {};
+    std::atomic<unsigned> blinking = 0;
+
+    // latest color of every led, and which of them still have to be sent
+    std::atomic<uint32_t> slots[LED_COUNT] = {};
+    std::atomic<uint64_t> dirty[2] = {};
+    std::atomic<unsigned> led_budget = DEFAULT_LED_BUDGET;
+
+    Stats stats;
+};
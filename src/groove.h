@@ -0,0 +1,307 @@
+#pragma once
+
+#include <atomic>
+#include <random>
+#include <algorithm>
+#include <cstdint>
+
+#include "common.h"
+#include "jackmidi.h"
+#include "sequence.h"
+#include "tableswap.h"
+
+/** Per-track timing and velocity transform (swing, groove template and
+ * humanize) applied to the events between the sequence walker and the
+ * router.
+ *
+ * All the offsets are precomputed into tables when the groove is configured
+ * (UI thread), so grooving an event in the jack thread is just a couple of
+ * table lookups. The offsets are never negative - groove only ever delays
+ * events - so the sequencer can keep its output time-ordered with a small
+ * hold queue instead of looking ahead.
+ */
+class Groove {
+public:
+    static constexpr unsigned STEPS          = 16;       // template steps per bar
+    static constexpr ticks    STEP_LENGTH    = PPQN / 4; // 1/16 per step
+    static constexpr ticks    BAR_LENGTH     = STEPS * STEP_LENGTH;
+    static constexpr unsigned HUMANIZE_SIZE  = 256;      // size of the random tables
+    static constexpr ticks    MAX_OFFSET     = STEP_LENGTH; // clamp for all offsets
+
+    static constexpr unsigned SWING_STRAIGHT = 50; // 50% - no swing at all
+    static constexpr unsigned SWING_MAX      = 75; // 75% - 3:1 (dotted) feel
+
+    Groove() {
+        rebuild();
+    }
+
+    Groove(const Groove &) = delete;
+    Groove &operator=(const Groove &) = delete;
+
+    /// swing in percent (50 is straight, 66 is triplet feel, 75 is dotted).
+    /// Only odd 1/16 steps are delayed.
+    void set_swing(unsigned percent) {
+        swing = std::clamp(percent, SWING_STRAIGHT, SWING_MAX);
+        rebuild();
+    }
+
+    unsigned get_swing() const { return swing; }
+
+    /** Sets humanize amounts. Timing is a maximal random delay in ticks,
+     * velocity a maximal deviation to each side. The same seed always
+     * produces the same result, so rendered output stays reproducible.
+     */
+    void set_humanize(ticks timing, uchar velocity, uint32_t seed = 0) {
+        human_timing   = std::clamp(timing, ticks(0), MAX_OFFSET);
+        human_velocity = std::min(velocity, uchar(63));
+        human_seed     = seed;
+        rebuild();
+    }
+
+    /** Extracts a groove template from a reference sequence. Each note-on is
+     * attributed to the nearest 1/16 step, and the average deviation and
+     * relative velocity per step become the template. The deviations are
+     * shifted so the earliest step has zero offset (groove only delays).
+     */
+    void extract_template(Sequence &ref) {
+        long offset_sum[STEPS] = {};
+        long velo_sum[STEPS]   = {};
+        unsigned count[STEPS]  = {};
+        long velo_total = 0;
+        unsigned notes  = 0;
+
+        {
+            auto h = ref.get_handle();
+            for (const auto &ev : h) {
+                if (!ev.is_note_on()) continue;
+
+                ticks t    = ev.get_ticks();
+                ticks grid = ((t + STEP_LENGTH / 2) / STEP_LENGTH) * STEP_LENGTH;
+                unsigned s = (grid / STEP_LENGTH) % STEPS;
+
+                offset_sum[s] += t - grid;
+                velo_sum[s]   += ev.get_velocity();
+                velo_total    += ev.get_velocity();
+                ++count[s];
+                ++notes;
+            }
+        }
+
+        if (!notes) {
+            clear_template();
+            return;
+        }
+
+        long velo_avg = velo_total / notes;
+        long min_off  = 0;
+
+        for (unsigned s = 0; s < STEPS; ++s) {
+            if (!count[s]) {
+                tpl_offset[s]   = 0;
+                tpl_velocity[s] = 100;
+                continue;
+            }
+
+            tpl_offset[s]   = offset_sum[s] / long(count[s]);
+            tpl_velocity[s] = velo_avg ? (velo_sum[s] * 100 / count[s]) / velo_avg
+                                       : 100;
+            min_off = std::min(min_off, long(tpl_offset[s]));
+        }
+
+        for (unsigned s = 0; s < STEPS; ++s)
+            tpl_offset[s] -= min_off;
+
+        rebuild();
+    }
+
+    void clear_template() {
+        for (unsigned s = 0; s < STEPS; ++s) {
+            tpl_offset[s]   = 0;
+            tpl_velocity[s] = 100;
+        }
+        rebuild();
+    }
+
+    /// true if the groove modifies anything at all
+    bool is_active() const {
+        TableSwap<Tables>::Use tb(tables);
+        return tb->active;
+    }
+
+    /// realtime part - per track state kept by the sequencer
+    struct State {
+        ticks    note_on[NOTE_MAX + 1] = {}; // grooved tick of the last note-on
+        ticks    delta[NOTE_MAX + 1]   = {}; // the offset it got
+        unsigned counter = 0;                // indexes the humanize tables
+    };
+
+    /** Computes the grooved tick for the event (absolute tick t, the step
+     * grid is taken relative to seq_start) and modifies the velocity of
+     * the message in place. Note-offs move with their note-on, so the
+     * notes keep their length, and are never moved before it.
+     */
+    ticks apply(State &st, ticks t, ticks seq_start, jack::MidiMessage &msg) const {
+        TableSwap<Tables>::Use use(tables);
+        const Tables &tb = *use;
+
+        if (!tb.active) return t;
+
+        uchar status = msg.data[0] & EV_CLEAR_CHAN_MASK;
+        uchar note   = msg.data[1] & NOTE_MAX;
+        bool  on     = status == EV_NOTE_ON && msg.data[2] > 0;
+        bool  off    = status == EV_NOTE_OFF
+                       || (status == EV_NOTE_ON && msg.data[2] == 0);
+
+        if (off) return std::max(t + st.delta[note], st.note_on[note] + 1);
+
+        ticks rel     = t - seq_start;
+        unsigned step = unsigned(((rel + STEP_LENGTH / 2) / STEP_LENGTH) % STEPS);
+        unsigned hidx = st.counter % HUMANIZE_SIZE;
+
+        ticks g = t + tb.offset[step] + tb.human_time[hidx];
+
+        if (on) {
+            int v = int(msg.data[2]) * tb.velocity[step] / 100 + tb.human_velo[hidx];
+            msg.data[2] = uchar(std::clamp(v, 1, int(NOTE_MAX)));
+            st.note_on[note] = g;
+            st.delta[note]   = g - t;
+            ++st.counter;
+        }
+
+        return g;
+    }
+
+protected:
+    struct Tables {
+        bool    active = false;
+        int16_t offset[STEPS]               = {};
+        int16_t velocity[STEPS]             = {}; // percent
+        int16_t human_time[HUMANIZE_SIZE]   = {};
+        int8_t  human_velo[HUMANIZE_SIZE]   = {};
+    };
+
+    /// recomputes the spare table set and publishes it
+    void rebuild() {
+        Tables &tb = tables.spare();
+
+        ticks swing_off = STEP_LENGTH * (2 * ticks(swing) - 100) / 100;
+
+        bool any = swing != SWING_STRAIGHT || human_timing || human_velocity;
+
+        for (unsigned s = 0; s < STEPS; ++s) {
+            ticks off = tpl_offset[s] + ((s & 1) ? swing_off : 0);
+            tb.offset[s]   = int16_t(std::clamp(off, ticks(0), MAX_OFFSET));
+            tb.velocity[s] = tpl_velocity[s];
+            any = any || tb.offset[s] || tb.velocity[s] != 100;
+        }
+
+        std::mt19937 rng(human_seed);
+        std::uniform_int_distribution<int> dt(0, int(human_timing));
+        std::uniform_int_distribution<int> dv(-int(human_velocity),
+                                              int(human_velocity));
+
+        for (unsigned i = 0; i < HUMANIZE_SIZE; ++i) {
+            tb.human_time[i] = int16_t(dt(rng));
+            tb.human_velo[i] = int8_t(dv(rng));
+        }
+
+        tb.active = any;
+        tables.publish();
+    }
+
+    // configuration (UI thread only)
+    unsigned swing          = SWING_STRAIGHT;
+    ticks    human_timing   = 0;
+    uchar    human_velocity = 0;
+    uint32_t human_seed     = 0;
+    int16_t  tpl_offset[STEPS]   = {};
+    int16_t  tpl_velocity[STEPS] = {100, 100, 100, 100, 100, 100, 100, 100,
+                                    100, 100, 100, 100, 100, 100, 100, 100};
+
+    TableSwap<Tables> tables;
+};
+
+/** Fixed capacity time-ordered hold queue for grooved events. Events
+ * delayed past the current process window wait here, so the router still
+ * receives them in time order. Events with the same tick keep their
+ * insertion order (note-on before its zero length note-off).
+ *
+ * Long (sysex) events only reference their bytes, those stay owned by the
+ * sequence - they have to be popped while the sequence is still locked.
+ */
+class GrooveQueue {
+public:
+    static constexpr size_t CAPACITY = 512;
+
+    struct Item {
+        ticks tick;
+        unsigned track;
+        jack::MidiMessage msg;
+        const uchar *long_data = nullptr; // sysex, msg is unused then
+        size_t long_len = 0;
+    };
+
+    bool push(ticks t, unsigned track, const jack::MidiMessage &msg) {
+        return push({t, track, msg});
+    }
+
+    bool push(const Item &item) {
+        ticks t = item.tick;
+
+        if (tail == CAPACITY) {
+            if (head == 0) return false; // full
+            std::move(items + head, items + tail, items);
+            tail -= head;
+            head  = 0;
+        }
+
+        // insertion sort from the back - usually appends
+        size_t pos = tail;
+        while (pos > head && items[pos - 1].tick > t) {
+            items[pos] = items[pos - 1];
+            --pos;
+        }
+
+        items[pos] = item;
+        ++tail;
+        return true;
+    }
+
+    /// calls cb(item) for all events sooner than stop, removing them
+    template<typename CbT>
+    void pop_until(ticks stop, CbT cb) {
+        while (head < tail && items[head].tick < stop) {
+            cb(items[head]);
+            ++head;
+        }
+
+        if (head == tail) head = tail = 0;
+    }
+
+    /// calls cb(item) for all events of the track, in order, removing them
+    template<typename CbT>
+    void remove_track(unsigned track, CbT cb) {
+        size_t out = head;
+
+        for (size_t i = head; i < tail; ++i) {
+            if (items[i].track == track) {
+                cb(items[i]);
+                continue;
+            }
+
+            if (out != i) items[out] = items[i];
+            ++out;
+        }
+
+        tail = out;
+        if (head == tail) head = tail = 0;
+    }
+
+    bool empty() const { return head == tail; }
+
+    void clear() { head = tail = 0; }
+
+protected:
+    Item   items[CAPACITY];
+    size_t head = 0, tail = 0;
+};
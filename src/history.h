@@ -0,0 +1,181 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cmath>
+#include <cstdint>
+
+#include "common.h"
+#include "router.h"
+#include "transport.h"
+#include "sequence.h"
+
+/** Always-on history of the notes played into the router input, so a good
+ * improvisation can be kept after the fact (capture()).
+ *
+ * The jack thread stamps the notes with ticks and writes them into a fixed
+ * ring that overwrites the oldest entries. Each entry is a single atomic
+ * word, so readers can copy the ring at any time without locking; entries
+ * overwritten during the copy are detected and dropped.
+ *
+ * The tick clock follows the transport while it runs, and free-runs at the
+ * current tempo while it is stopped (the bar grid is arbitrary then).
+ */
+class InputHistory : public Router::InputHandler {
+public:
+    static constexpr size_t CAPACITY    = 8192; // events kept
+    static constexpr size_t MAX_PENDING = 256;  // input events per period
+    static constexpr ticks  BAR_LENGTH  = 4 * PPQN;
+
+    InputHistory() = default;
+
+    InputHistory(const InputHistory &) = delete;
+    InputHistory &operator=(const InputHistory &) = delete;
+
+    // Router::InputHandler
+    void on_input(jack_nframes_t frame, const uchar *data, size_t size) override {
+        if (size != 3) return;
+
+        uchar status = data[0] & EV_CLEAR_CHAN_MASK;
+        if (status != EV_NOTE_ON && status != EV_NOTE_OFF) return;
+        if (pending_count >= MAX_PENDING) return;
+
+        pending[pending_count++] = {frame, {data[0], data[1], data[2]}};
+    }
+
+    /// stamps the input of this period with ticks. Call after transport advance
+    void process(const Transport::Window &w) {
+        double start = w.running ? w.start : clock;
+
+        for (size_t i = 0; i < pending_count; ++i) {
+            const Pending &p = pending[i];
+            double off = double(jack_nframes_t(p.frame - w.frame));
+            ticks t = ticks(std::lround(start + off / w.frames_per_tick));
+            append(t, p.data);
+        }
+
+        pending_count = 0;
+        clock = w.running ? w.stop : clock + w.nframes / w.frames_per_tick;
+    }
+
+    /** Turns the last bars of the history into notes of the sequence,
+     * replacing its contents. The captured range ends with the bar in which
+     * the last note ended. Returns the number of captured notes.
+     * @note not realtime safe (allocates, locks the sequence)
+     */
+    size_t capture(Sequence &seq, unsigned bars) {
+        if (!bars) return 0;
+
+        std::vector<Entry> events = snapshot();
+        if (events.empty()) return 0;
+
+        ticks end   = next_multiple(events.back().tick + 1, BAR_LENGTH);
+        ticks start = end - ticks(bars) * BAR_LENGTH;
+
+        // pair the notes
+        std::vector<Sequence::Note> notes;
+        ticks on_tick[NOTE_MAX + 1];
+        uchar on_velo[NOTE_MAX + 1] = {};
+
+        for (const Entry &e : events) {
+            uchar status = e.data[0] & EV_CLEAR_CHAN_MASK;
+            uchar note   = e.data[1] & NOTE_MAX;
+            bool on      = status == EV_NOTE_ON && e.data[2] > 0;
+
+            if (on_velo[note]) {
+                ticks from = on_tick[note];
+                if (from >= start)
+                    notes.push_back({from - start,
+                                     std::max(std::min(e.tick, end) - from, ticks(1)),
+                                     note, on_velo[note]});
+                on_velo[note] = 0;
+            }
+
+            if (on) {
+                on_tick[note] = e.tick;
+                on_velo[note] = e.data[2];
+            }
+        }
+
+        // still held - ends with the captured range
+        for (uchar n = 0; n <= NOTE_MAX; ++n) {
+            if (on_velo[n] && on_tick[n] >= start)
+                notes.push_back({on_tick[n] - start, end - on_tick[n], n, on_velo[n]});
+        }
+
+        // at once - playback never sees the sequence half replaced
+        seq.replace_notes(end - start, notes);
+        return notes.size();
+    }
+
+    void clear() { cleared = written.load(std::memory_order_acquire); }
+
+protected:
+    static constexpr uint64_t TICK_MASK = (uint64_t(1) << 40) - 1;
+
+    struct Pending {
+        jack_nframes_t frame;
+        uchar data[3];
+    };
+
+    struct Entry {
+        ticks tick;
+        uchar data[3];
+    };
+
+    // entry is packed as tick (40 bits) and the 3 message bytes
+    void append(ticks t, const uchar *data) {
+        uint64_t n = written.load(std::memory_order_relaxed);
+        uint64_t word = (uint64_t(t) & TICK_MASK) << 24
+                        | uint64_t(data[0]) << 16 | uint64_t(data[1]) << 8 | data[2];
+
+        // a reader that sees the new entry sees the written count before it
+        std::atomic_thread_fence(std::memory_order_release);
+        ring[n % CAPACITY].store(word, std::memory_order_relaxed);
+        written.store(n + 1, std::memory_order_release);
+    }
+
+    /** copies the ring, oldest first. Only the tail with non-decreasing ticks
+     * is kept - the transport may have jumped back before it.
+     */
+    std::vector<Entry> snapshot() const {
+        uint64_t end   = written.load(std::memory_order_acquire);
+        uint64_t first = std::max(end > CAPACITY ? end - CAPACITY : 0,
+                                  cleared.load());
+
+        std::vector<Entry> res;
+        res.reserve(end - first);
+
+        for (uint64_t i = first; i < end; ++i) {
+            uint64_t w = ring[i % CAPACITY].load(std::memory_order_relaxed);
+            res.push_back({ticks(w >> 24), {uchar(w >> 16), uchar(w >> 8), uchar(w)}});
+        }
+
+        // the writer may have lapped us while copying. Entry i gets
+        // overwritten by i + CAPACITY before written passes that, so all up
+        // to now - CAPACITY may be torn. The fence keeps the loads above
+        // before the one of written, as in a seqlock reader
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t now = written.load(std::memory_order_relaxed);
+        if (now >= CAPACITY && now - CAPACITY + 1 > first) {
+            size_t lost = std::min<uint64_t>(now - CAPACITY + 1 - first, res.size());
+            res.erase(res.begin(), res.begin() + lost);
+        }
+
+        size_t from = res.size();
+        while (from > 1 && res[from - 2].tick <= res[from - 1].tick) --from;
+        if (from) --from;
+        res.erase(res.begin(), res.begin() + from);
+
+        return res;
+    }
+
+    // jack thread only
+    Pending pending[MAX_PENDING];
+    size_t pending_count = 0;
+    double clock = 0;
+
+    std::atomic<uint64_t> ring[CAPACITY] = {};
+    std::atomic<uint64_t> written = 0;
+    std::atomic<uint64_t> cleared = 0; // entries before this are forgotten
+};
@@ -0,0 +1,339 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <regex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+#include "backend.h"
+#include "spsc.h"
+#include "metrics.h"
+#include "controllers.h"
+
+/** Follows the midi ports of the graph and attaches the controllers and
+ * synths as they come and go. The backend thread only copies the port
+ * notifications into a lock-free ring and wakes the worker thread. The
+ * worker pairs the capture and playback ports of each controller and calls
+ * the Handler - that is where ports get registered and connected, which the
+ * notification thread must not do.
+ *
+ * A notification lost to a full ring makes the worker rescan all the ports.
+ * A controller disconnected from our ports is detached until it is plugged
+ * again - the handler should not reuse the port names of detached devices.
+ */
+class Hotplug : public backend::PortListener {
+public:
+    static constexpr size_t NAME_SIZE = 320; // full jack port name
+    static constexpr size_t RING_SIZE = 256;
+
+    /// implement in a class placing the devices. Called from the worker thread
+    struct Handler {
+        /// both ports of a controller appeared, or one of them is gone
+        virtual void on_controller(const std::string &capture,
+                                   const std::string &playback,
+                                   bool plugged) = 0;
+
+        /// an input port matching watch_synth appeared or is gone
+        virtual void on_synth(const std::string &port, unsigned output,
+                              bool plugged) = 0;
+    };
+
+    Hotplug(backend::Backend &client, Handler &handler)
+        : client(client), handler(handler), ring(RING_SIZE)
+    {
+        ring.mlock();
+        client.set_port_listener(*this);
+    }
+
+    ~Hotplug() { stop(); }
+
+    Hotplug(const Hotplug &) = delete;
+    Hotplug &operator=(const Hotplug &) = delete;
+
+    /// attaches the ports present and follows the changes
+    void start() {
+        if (worker.joinable()) return;
+
+        rescan_pending = true;
+        do_exit = false;
+        worker = std::thread([this] { watch_loop(); });
+    }
+
+    void stop() {
+        do_exit = true;
+        wake();
+        if (worker.joinable()) worker.join();
+    }
+
+    /// synth input ports matching the regex are passed to the handler
+    void watch_synth(const std::string &pattern, unsigned output) {
+        std::scoped_lock<std::mutex> l(synth_mtx);
+        synth_rules.push_back({std::regex(pattern), output});
+        rescan_pending = true;
+        wake();
+    }
+
+    // ======================== BACKEND THREAD ==========================
+    void on_port_registered(const char *name, unsigned long flags,
+                            bool registered) override
+    {
+        push(registered ? N_REGISTERED : N_UNREGISTERED, name, nullptr, flags);
+    }
+
+    void on_port_connected(const char *source, const char *target,
+                           bool connected) override
+    {
+        push(connected ? N_CONNECTED : N_DISCONNECTED, source, target, 0);
+    }
+
+    void register_metrics(metrics::Registry &r, const std::string &prefix = "hotplug") {
+        r.add(prefix + ".attached", attached);
+        r.add(prefix + ".detached", detached);
+        r.add(prefix + ".failed",   failed);
+        r.add(prefix + ".lost",     lost);
+    }
+
+protected:
+    enum Kind : uint8_t { N_REGISTERED, N_UNREGISTERED, N_CONNECTED, N_DISCONNECTED };
+
+    struct Notice {
+        Kind kind;
+        unsigned long flags;
+        char name[NAME_SIZE];
+        char other[NAME_SIZE];
+    };
+
+    /// the ports of one controller, keyed by the name without capture/playback
+    struct Device {
+        std::string capture, playback;
+        bool attached = false;
+        bool blocked  = false; // detached by a disconnect, until plugged again
+    };
+
+    struct SynthRule {
+        std::regex pattern;
+        unsigned output;
+    };
+
+    void push(Kind kind, const char *name, const char *other, unsigned long flags) {
+        Notice n;
+        n.kind  = kind;
+        n.flags = flags;
+        copy_name(n.name, name);
+        copy_name(n.other, other);
+
+        if (!ring.push(n)) {
+            lost.add();
+            rescan_pending = true;
+        }
+
+        wake();
+    }
+
+    /// the flag is set under the mutex, so the worker can't miss it between
+    /// checking and going to sleep. Not for the jack process thread
+    void wake() {
+        {
+            std::scoped_lock<std::mutex> l(wake_mtx);
+            woken = true;
+        }
+        wake_cv.notify_one();
+    }
+
+    static void copy_name(char *dst, const char *src) {
+        if (!src) src = "";
+        std::strncpy(dst, src, NAME_SIZE - 1);
+        dst[NAME_SIZE - 1] = 0;
+    }
+
+    // ======================== WORKER THREAD ==========================
+    void watch_loop() {
+        while (!do_exit) {
+            Notice n;
+            while (ring.pop(n)) handle(n);
+
+            if (rescan_pending.exchange(false)) rescan();
+
+            std::unique_lock<std::mutex> lk(wake_mtx);
+            wake_cv.wait(lk, [this] { return std::exchange(woken, false) || do_exit; });
+        }
+    }
+
+    void handle(const Notice &n) {
+        switch (n.kind) {
+        case N_REGISTERED:
+            // the ports we register ourselves (the controllers) are not synths
+            if (!client.is_own_port(n.name)) port_added(n.name, n.flags);
+            break;
+        case N_UNREGISTERED: port_removed(n.name); break;
+        case N_CONNECTED:    break;
+        case N_DISCONNECTED:
+            // only the ports still ours - not the ones of a detached device
+            if (client.is_own_port(n.other)) disconnected(n.name);
+            if (client.is_own_port(n.name))  disconnected(n.other);
+            break;
+        }
+    }
+
+    /// catches up with the ports present - after start or lost notifications
+    void rescan() {
+        auto outputs = client.get_ports(nullptr, backend::Backend::PORT_OUTPUT);
+        auto inputs  = client.get_ports(nullptr, backend::Backend::PORT_INPUT);
+
+        auto present = [](const std::vector<std::string> &v, const std::string &n) {
+            return std::find(v.begin(), v.end(), n) != v.end();
+        };
+
+        // the ports gone meanwhile
+        std::vector<Device> devs;
+        for (const auto &d : devices) devs.push_back(d.second);
+
+        for (const Device &d : devs) {
+            if (!d.capture.empty() && !present(outputs, d.capture))
+                port_removed(d.capture);
+            if (!d.playback.empty() && !present(inputs, d.playback))
+                port_removed(d.playback);
+        }
+
+        std::vector<std::string> gone;
+        for (const auto &s : synths)
+            if (!present(inputs, s.first)) gone.push_back(s.first);
+        for (const auto &s : gone) port_removed(s);
+
+        for (const auto &p : outputs)
+            if (!client.is_own_port(p.c_str())) port_added(p, backend::Backend::PORT_OUTPUT);
+        for (const auto &p : inputs)
+            if (!client.is_own_port(p.c_str())) port_added(p, backend::Backend::PORT_INPUT);
+    }
+
+    void port_added(const std::string &name, unsigned long flags) {
+        bool capture = flags & backend::Backend::PORT_OUTPUT;
+
+        if (is_grid_controller(name)) {
+            Device &d = devices[device_key(name)];
+            std::string &port = capture ? d.capture : d.playback;
+
+            if (port == name) return; // known already
+            port = name;
+
+            if (!d.capture.empty() && !d.playback.empty() && !d.attached && !d.blocked)
+                attach(d);
+            return;
+        }
+
+        if (capture || synths.count(name)) return;
+
+        std::scoped_lock<std::mutex> l(synth_mtx);
+        for (const SynthRule &r : synth_rules) {
+            if (!std::regex_search(name, r.pattern)) continue;
+
+            synths[name] = r.output;
+            call([&] { handler.on_synth(name, r.output, true); });
+            return;
+        }
+    }
+
+    void port_removed(const std::string &name) {
+        auto s = synths.find(name);
+        if (s != synths.end()) {
+            unsigned output = s->second;
+            synths.erase(s);
+            call([&] { handler.on_synth(name, output, false); });
+            return;
+        }
+
+        auto it = devices.find(device_key(name));
+        if (it == devices.end()) return;
+
+        Device &d = it->second;
+        if (d.capture != name && d.playback != name) return;
+
+        detach(d);
+        (d.capture == name ? d.capture : d.playback).clear();
+        d.blocked = false;
+
+        if (d.capture.empty() && d.playback.empty()) devices.erase(it);
+    }
+
+    /// a connection of our port broke - the controller is unplugged from us
+    void disconnected(const std::string &name) {
+        for (auto &e : devices) {
+            Device &d = e.second;
+            if (!d.attached || (d.capture != name && d.playback != name)) continue;
+
+            detach(d);
+            d.blocked = true;
+        }
+    }
+
+    void attach(Device &d) {
+        d.attached = call([&] { handler.on_controller(d.capture, d.playback, true); });
+
+        if (d.attached) attached.add();
+        else d.blocked = true; // not retried until plugged again
+    }
+
+    void detach(Device &d) {
+        if (!d.attached) return;
+
+        d.attached = false;
+        call([&] { handler.on_controller(d.capture, d.playback, false); });
+        detached.add();
+    }
+
+    /// runs the handler, a failure is counted and does not stop the worker
+    template<typename CbT>
+    bool call(CbT cb) {
+        try {
+            cb();
+            return true;
+        } catch (const std::exception &) {
+            failed.add();
+            return false;
+        }
+    }
+
+    /// a2j names the ports "client (capture): port" and "client (playback): port"
+    static std::string device_key(std::string name) {
+        for (const char *dir : {"capture", "playback"}) {
+            size_t pos = name.find(dir);
+            if (pos != std::string::npos) return name.erase(pos, std::strlen(dir));
+        }
+
+        return name;
+    }
+
+    backend::Backend &client;
+    Handler &handler;
+
+    // backend thread writes, worker reads
+    SpscQueue<Notice> ring;
+    std::atomic<bool> rescan_pending = false;
+
+    // worker thread only
+    std::map<std::string, Device> devices;
+    std::map<std::string, unsigned> synths; // attached synth ports
+
+    std::mutex synth_mtx;
+    std::vector<SynthRule> synth_rules;
+
+    std::atomic<bool> do_exit = false;
+    std::thread worker;
+
+    // wakes the worker - notifications, configuration, stop
+    std::mutex wake_mtx;
+    std::condition_variable wake_cv;
+    bool woken = false;
+
+    metrics::Counter attached;
+    metrics::Counter detached;
+    metrics::Counter failed; // handler threw
+    metrics::Counter lost;   // ring was full, rescanned
+};
@@ -2,6 +2,8 @@
 
 #include <vector>
 #include <memory>
+#include <cstdint>
+#include <cstring>
 
 #include <jack/jack.h>
 #include <jack/midiport.h>
@@ -9,6 +11,7 @@
 
 #include "common.h"
 #include "error.h"
+#include "backend.h"
 
 namespace jack {
 
@@ -32,7 +35,7 @@ public:
     static void err_handler(const char *msg) {}
 };
 
-class Client {
+class Client : public backend::Backend {
 public:
     Client(const char *name)
             : client(nullptr)
@@ -45,7 +48,7 @@ public:
         }
     }
 
-    ~Client() {
+    ~Client() override {
         jack_deactivate(client);
         jack_client_close(client);
         client = nullptr;
@@ -54,6 +57,7 @@ public:
     // Movable, not copyable
     Client(const Client &) = delete;
     Client &operator =(const Client &) = delete;
+    // the port notifications are bound to the client, move before set_port_listener
     Client(Client &&other) : client(other.client) { other.client = nullptr; }
     Client &operator =(Client &&o) {
         if (this == &o) return *this;
@@ -66,12 +70,11 @@ public:
     operator const jack_client_t*() const { return client; }
 
     std::vector<std::string> get_ports(const char *port_name_pattern = nullptr,
-                                       const char *type_name_pattern = nullptr,
-                                       unsigned long flags = 0) const
+                                       unsigned long flags = 0) const override
     {
         std::unique_ptr<const char *, decltype(&jack_free)> ports(
                 jack_get_ports(
-                        client, port_name_pattern, type_name_pattern, flags),
+                        client, port_name_pattern, JACK_DEFAULT_MIDI_TYPE, flags),
                 &jack_free);
 
         const char **cur = ports.get();
@@ -88,19 +91,22 @@ public:
         return result;
     }
 
-    void activate() {
+    std::unique_ptr<backend::Port> register_port(const char *name,
+                                                 unsigned long flags) override;
+
+    void activate() override {
         jack_activate(client);
     }
 
-    void deactivate() {
+    void deactivate() override {
         jack_deactivate(client);
     }
 
-    jack_nframes_t last_frame_time() const {
+    jack_nframes_t last_frame_time() const override {
         return jack_last_frame_time(client);
     }
 
-    jack_nframes_t frame_time() const {
+    jack_nframes_t frame_time() const override {
         return jack_frame_time(client);
     }
 
@@ -112,14 +118,13 @@ public:
     /// sample rate per second. in combination with nframes of process call
     /// this can be used to determine maximal amount of data transferrable
     /// each process call.
-    jack_nframes_t sample_rate() {
+    jack_nframes_t sample_rate() override {
         return jack_get_sample_rate(client);
     }
 
     // converts no. of frames ti miliseconds
     double frames_to_ms(jack_nframes_t nframes) {
-        // this may be used to calculate the maximal amount of
-        // bytes per frame that we can output to midi without saturating it
+        // NOTE: the output bandwidth itself is modelled in MidiPacer
         jack_nframes_t sr = sample_rate();
         return (nframes * 1000) / sr;
     }
@@ -127,16 +132,64 @@ public:
 
 
     // implement in a class listening to the jack events
-    struct Callback {
-        virtual int process(jack_nframes_t nframes) = 0;
-    };
+    using Callback = backend::Callback;
 
-    void set_callback(Callback &cb) {
+    void set_callback(Callback &cb) override {
         if (jack_set_process_callback(client, jackProcessCallback, &cb))
             throw JackException("Cannot set process callback");
     }
 
+    void set_port_listener(backend::PortListener &l) override {
+        listener = &l;
+
+        if (jack_set_port_registration_callback(client, jackPortRegistration, this))
+            throw JackException("Cannot set port registration callback");
+
+        if (jack_set_port_connect_callback(client, jackPortConnect, this))
+            throw JackException("Cannot set port connect callback");
+    }
+
+    bool is_own_port(const char *name) const override {
+        jack_port_t *p = jack_port_by_name(client, name);
+        return p && jack_port_is_mine(client, p);
+    }
+
 protected:
+    /// midi port of the id, nullptr for the others
+    jack_port_t *midi_port(jack_port_id_t id) {
+        jack_port_t *p = jack_port_by_id(client, id);
+        if (!p) return nullptr;
+
+        const char *type = jack_port_type(p);
+        if (!type || std::strcmp(type, JACK_DEFAULT_MIDI_TYPE)) return nullptr;
+
+        return p;
+    }
+
+    // port notification adapters - jack notification thread
+    static void jackPortRegistration(jack_port_id_t id, int reg, void *arg) {
+        Client *c = static_cast<Client *>(arg);
+        jack_port_t *p = c->midi_port(id);
+
+        if (!p || jack_port_is_mine(c->client, p)) return;
+
+        c->listener->on_port_registered(jack_port_name(p), jack_port_flags(p), reg);
+    }
+
+    static void jackPortConnect(jack_port_id_t a, jack_port_id_t b, int connect,
+                                void *arg)
+    {
+        Client *c = static_cast<Client *>(arg);
+        jack_port_t *pa = c->midi_port(a);
+        jack_port_t *pb = c->midi_port(b);
+
+        if (!pa || !pb) return;
+        if (!jack_port_is_mine(c->client, pa) && !jack_port_is_mine(c->client, pb))
+            return;
+
+        c->listener->on_port_connected(jack_port_name(pa), jack_port_name(pb), connect);
+    }
+
     // callback adapter
     static int jackProcessCallback(jack_nframes_t nframes, void *arg) {
         if (arg) {
@@ -147,26 +200,28 @@ protected:
     }
 
     jack_client_t *client;
+    backend::PortListener *listener = nullptr;
 };
 
 class Port;
 
-class MidiBuffer {
+class MidiBuffer : public backend::MidiBuffer {
 public:
-    int get_event_count() {
+    uint32_t get_event_count() override {
         return jack_midi_get_event_count(buffer);
     }
 
-    void clear() {
+    void clear() override {
         jack_midi_clear_buffer(buffer);
     }
 
-    void get_event(jack_midi_event_t &ev, int order) {
+    void get_event(jack_midi_event_t &ev, uint32_t order) override {
         jack_midi_event_get(&ev, buffer, order);
     }
 
     // this allocates a buffer for midi data for given frame time
-    jack_midi_data_t *event_reserve(jack_nframes_t time, size_t data_size)
+    jack_midi_data_t *event_reserve(jack_nframes_t time,
+                                    size_t data_size) override
     {
         return jack_midi_event_reserve(buffer, time, data_size);
     }
@@ -194,7 +249,7 @@ protected:
     void *buffer;
 };
 
-class Port {
+class Port : public backend::Port {
 public:
     Port(Client &client,
          const char *name,
@@ -210,7 +265,7 @@ public:
         }
     }
 
-    ~Port() {
+    ~Port() override {
         jack_port_unregister(client, port);
         port = nullptr;
     }
@@ -233,49 +288,57 @@ public:
     operator jack_port_t *() { return port; }
     operator const jack_port_t *() const { return port; }
 
-    MidiBuffer get_midi_buffer(int nframes) {
-        return {jack_port_get_buffer(port, nframes)};
+    backend::MidiBuffer &get_midi_buffer(jack_nframes_t nframes) override {
+        buffer.buffer = jack_port_get_buffer(port, nframes);
+        return buffer;
     }
 
     // establishes a connection of this registered port with a different one
     // allowing for data to go through
-    void connect_from(const char *target) {
+    void connect_from(const char *target) override {
         auto ec = jack_connect(client, target, name());
         if (ec)
             throw Exception(format(
                     "Cannot bind port ", name(), " from ", target, ": ", ec));
     }
 
-    void disconnect_from(const char *target) {
+    void disconnect_from(const char *target) override {
         auto ec = jack_disconnect(client, target, name());
         if (ec)
             throw Exception(format(
                     "Cannot unbind port ", name(), " from ", target, ": ", ec));
     }
 
-    void connect_to(const char *target) {
+    void connect_to(const char *target) override {
         auto ec = jack_connect(client, name(), target);
         if (ec)
             throw Exception(format(
                     "Cannot bind port ", name(), " to ", target, ": ", ec));
     }
 
-    void disconnect_to(const char *target) {
+    void disconnect_to(const char *target) override {
         auto ec = jack_disconnect(client, name(), target);
         if (ec)
             throw Exception(format(
                     "Cannot unbind port ", name(), " to ", target, ": ", ec));
     }
 
-    const char *name() {
+    const char *name() override {
         return jack_port_name(port);
     }
 
 protected:
     Client &client;
     jack_port_t *port;
+    MidiBuffer buffer{nullptr};
 };
 
+inline std::unique_ptr<backend::Port> Client::register_port(const char *name,
+                                                            unsigned long flags)
+{
+    return std::make_unique<Port>(*this, name, JACK_DEFAULT_MIDI_TYPE, flags);
+}
+
 // A simplified midi message used to work with the ring buffer
 struct MidiMessage {
     MidiMessage() = default;
@@ -355,6 +418,47 @@ public:
         return jack_ringbuffer_write(ringbuffer, data, size);
     }
 
+    /// header of a length-prefixed midi message record, the bytes follow it
+    struct Record {
+        jack_nframes_t time;
+        uint16_t len;
+        uint16_t tag; // free for the writer (the router keeps the source track here)
+    };
+
+    /// writes a whole variable length message or nothing
+    bool write_record(jack_nframes_t time, const uchar *data, size_t len,
+                      uint16_t tag = 0)
+    {
+        if (len > UINT16_MAX) return false;
+        if (write_space() < sizeof(Record) + len) return false;
+
+        Record r{time, uint16_t(len), tag};
+        write(reinterpret_cast<const char *>(&r), sizeof(r));
+        write(reinterpret_cast<const char *>(data), len);
+        return true;
+    }
+
+    bool write_record(const MidiMessage &msg, uint16_t tag = 0) {
+        return write_record(msg.time, msg.data, msg.len, tag);
+    }
+
+    /// reads the header of the next record, if the whole record is there
+    bool peek_record(Record &r) {
+        if (read_space() < sizeof(r)) return false;
+        peek(reinterpret_cast<char *>(&r), sizeof(r));
+        return read_space() >= sizeof(r) + r.len;
+    }
+
+    /// consumes the peeked record, copying the message bytes to dst
+    void read_record(const Record &r, uchar *dst) {
+        read_advance(sizeof(r));
+        read(reinterpret_cast<char *>(dst), r.len);
+    }
+
+    void skip_record(const Record &r) {
+        read_advance(sizeof(r) + r.len);
+    }
+
 protected:
     size_t size;
     jack_ringbuffer_t *ringbuffer;
@@ -11,179 +11,32 @@
 #include "common.h"
 #include "error.h"
 #include "event.h"
+#include "metrics.h"
+#include "grid.h"
 
 // DOCS HERE https://d2xhy469pqj8rc.cloudfront.net/sites/default/files/novation/downloads/4080/launchpad-programmers-reference.pdf
 // NOTE: Launchpad implements double buffering - 0xB0, 0x00, 0x31 - then 0xB0, 0x00, 0x34 to swap pages
 // The clear/copy bits in color setting then control what the device does with the other than selected page
-
-// Launchpad MK1. Not doing any abstractions here, but refactor to support other machines should not be hard
-class Launchpad {
+// With the flash bit set the device keeps swapping the pages itself - a led
+// written with the clear bit only (lit on one page, dark on the other) blinks
+
+/** Launchpad MK1 (and the S/Mini of the same protocol) - red/green leds,
+ * rapid update and double buffering. While any led blinks, the device runs
+ * in flash mode instead - the leds go to both pages at once and the blinking
+ * ones cost no messages.
+ */
+class Launchpad : public GridController {
 public:
-    using lock  = std::scoped_lock<std::mutex>;
-
-    static constexpr size_t RINGBUFFER_SIZE = 1024 * sizeof(jack::MidiMessage);
-
-    static const unsigned MATRIX_W = 8;
-    static const unsigned MATRIX_H = 8;
-
-    enum ButtonCode {
-        BC_UP       = 200,
-        BC_DOWN     = 201,
-        BC_LEFT     = 202,
-        BC_RIGHT    = 203,
-        BC_SESSION  = 204,
-        BC_USER1    = 205,
-        BC_USER2    = 206,
-        BC_MIXER    = 207
-    };
-
-    enum ButtonType {
-        BTN_GRID = 1, // Any grid button (x,y coordinates will be ginen)
-        BTN_SIDE,     // Any right side button (y 0..7 gives the button)
-        BTN_TOP,      // Top row button (x 0..7 gives the button)
-    };
-
-    // some basic colors (not all)
-    enum Colors {
-        CL_BLACK    = 0x00,
-        CL_GREEN    = 0x30,
-        CL_GREEN_M  = 0x20,
-        CL_GREEN_L  = 0x10,
-        CL_RED      = 0x03,
-        CL_RED_M    = 0x02,
-        CL_RED_L    = 0x01,
-        CL_AMBER    = 0x33,
-        CL_AMBER_M  = 0x22,
-        CL_AMBER_L  = 0x11,
-        CL_YELLOW   = 0x32,
-        CL_YELLOW_M = 0x21,
-        CL_ORANGE   = 0x13
-    };
-
-    // converted keypress -
-    struct KeyEvent {
-        ButtonType type;
-        unsigned code; // button code >=200 means top row, otherwise it's straight from the device
-        unsigned int x, y; // coords for grid buttons, X for toprow buttons, Y for siderow
-        bool press; // true for press, false for release
-    };
-
-    // NOTE: This callback is called from a different thread, so use atomics/mutexes
-    using KeyCb    = std::function<void(Launchpad&, const KeyEvent&)>;
-
-    // for fast_fill, this is a callback to get field color based on coords
-    using ColorCb  = std::function<uchar(unsigned,unsigned)>;
-
-    /** packed thread safe dirtiness flags for the grid part
-     * we know each row can be represented by 8 bits, so half of the grid is uint32_t
-     */
-    struct Bitmap {
-        Bitmap() = default;
-
-        void mark(unsigned x, unsigned y) {
-            if (x >= MATRIX_W) return;
-            if (y >= MATRIX_H) return;
-
-            unsigned bank = y/4;
-            unsigned bit  = x + (y & 0x03) * 8; // max is 7 + 3*8 == 31
-
-            bits[bank] |= 1 << bit;
-        }
-
-        void unmark(unsigned x, unsigned y) {
-            if (x >= MATRIX_W) return;
-            if (y >= MATRIX_H) return;
-
-            unsigned bank = y/4;
-            unsigned bit  = x + (y & 0x03) * 8; // max is 7 + 3*8 == 31
-
-            bits[bank] &= ~(1 << bit);
-        }
-
-        bool get(unsigned x, unsigned y) {
-            if (x >= MATRIX_W) return false;
-            if (y >= MATRIX_H) return false;
-
-            unsigned bank = y/4;
-            unsigned bit  = x + (y & 0x03) * 8; // max is 7 + 3*8 == 31
-
-            return (bits[bank] & (1 << bit));
-        }
-
-        Bitmap &operator|=(const Bitmap &b) {
-            bits[0] |= b.bits[0];
-            bits[1] |= b.bits[1];
-            return *this;
-        }
-
-        Bitmap &operator&=(const Bitmap &b) {
-            bits[0] &= b.bits[0];
-            bits[1] &= b.bits[1];
-            return *this;
-        }
-
-        Bitmap operator~() const {
-            return {~bits[0],~bits[1]};
-        }
-
-        // iterates the bitfields and calls a callback
-        template<typename CbT>
-        void iterate(CbT cb) const {
-            for (unsigned x = 0; x < MATRIX_W; ++x) {
-                for (unsigned y = 0; y < MATRIX_H; ++y) {
-                    unsigned bank = y/4;
-                    unsigned bit  = x + (y & 0x03) * 8; // max is 7 + 3*8 == 31
-
-                    if (bits[bank] & (1 << bit)) cb(x, y);
-                }
-            }
-        }
-
-        void clear() {
-            bits[0] = 0;
-            bits[1] = 0;
-        }
-
-        bool has_value() const {
-            return (bits[0] | bits[1]) != 0;
-        }
-
-        uchar row(unsigned y) const {
-            uchar r = 0;
-            unsigned bank = y/4;
-            unsigned row = y & 0x03;
-            return (bits[bank] >> (row * 8)) & 0xFF;
-        }
-
-        explicit operator bool() const {
-            return has_value();
-        }
-
-        bool operator==(const Bitmap &o) const {
-            return (bits[0] == o.bits[0]) && (bits[1] == o.bits[1]);
-        }
-        bool operator!=(const Bitmap &o) const {
-            return !operator==(o);
-        }
-
-    protected:
-        Bitmap(uint32_t a, uint32_t b) : bits{a,b} {}
-
-        uint32_t bits[2] = {0x0,0x0};
-    };
-
+    using Geometry   = grid::Geometry<8, 8>;
+    using ColorModel = grid::RedGreenModel;
 
-    Launchpad(const Launchpad &) = delete;
-
-    Launchpad(jack::Client &client, const std::string &prefix)
-        : cur_page(false)
-        , client(client)
-        , input_port(client, (prefix + ":in").c_str(), JACK_DEFAULT_MIDI_TYPE, JackPortIsInput)
-        , output_port(client, (prefix + ":out").c_str(), JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput)
-        , ringbuffer(RINGBUFFER_SIZE)
+    static_assert(Geometry::LED_COUNT == LED_COUNT,
+                  "the rapid update order is the logical led order");
 
+    Launchpad(backend::Backend &client, const std::string &prefix)
+        : GridController(client, prefix)
+        , cur_page(false)
     {
-        ringbuffer.mlock();
         reset();
         set_grid_layout();
         // initially we update 0 and display 2
@@ -192,159 +45,183 @@ public:
 
     ~Launchpad() { reset(); }
 
-    void set_callback(KeyCb c) {
-        lock l(cb_mtx);
-        callback = c;
-    }
-
-    // flips the currently active/displayed page
-    void flip(bool copy = false) {
-        cur_page = !cur_page;
-        set_double_buffer(cur_page, !cur_page, copy);
-    }
-
     // Sets the pad to be in grid layout
     void set_grid_layout() {
         send_msg({0xB0, 0, 1}); // 2 is drum rack layout, different numbering
     }
 
-    void fill_matrix(uchar col) {
-        fill_matrix(
-             [col](unsigned x, unsigned y) { return col; });
+    /// any Launchpad but the rgb ones (check those first) - the S and the
+    /// Mini up to MK2 speak the same protocol
+    static bool matchName(const std::string &name) {
+        return name.find("Launchpad") != std::string::npos
+               && name.find("MK3") == std::string::npos;
     }
 
-    /* Fills the whole matrix part of the device with colors given by callback
-     *
-     */
-    void fill_matrix(ColorCb cb) {
-        /*
-        @note first 64 items is the button matrix (left-right, top-bottom)
-        We don't use those, but next come:
-        then 8 for the side row
-        then 8 for the top row
-        */
-        for (unsigned y = 0; y < MATRIX_H; ++y) {
-            for (unsigned x = 0; x < MATRIX_W; x += 2) {
-                send_msg({0x92, cb(x,y), cb(x+1,y)});
-            }
-        }
+protected:
+    static constexpr unsigned MAX_FLIP_DELAY = 8; // periods
+
+    // resets lighting on the whole pad. Called by default in ctor to
+    // initialize the device to a known state
+    void reset() {
+        send_msg({0xB0, 0, 0});
+        clear();
+    }
+
+    // velocity flags of the leds
+    static constexpr uchar FL_CLEAR = 0x08; // dark on the other page
+    static constexpr uchar FL_COPY  = 0x04; // written to both pages
+
+    bool hw_blink() const override { return true; }
 
-        // as an appendix, to avoid the next fill matrix to continue
-        // we send a bogus command that should do nothing
-        send_msg({0xB0, 0x01, 0x0});
+    /// the velocity of the led slot
+    uchar encode(unsigned led) const {
+        uchar v = ColorModel::encode(slot(led));
+        if (!flashing) return v;
+        return v | (slot_blinks(led) ? FL_CLEAR : FL_CLEAR | FL_COPY);
     }
 
-    static constexpr uchar color(uchar r, uchar g) {
-        return std::min(g, uchar(3)) << 4 | std::min(r, uchar(3));
+    /// the message setting the color of a single led
+    static jack::MidiMessage led_msg(unsigned led, uchar col) {
+        if (led >= LED_TOP)
+            return {0xB0, uchar(104 + led - LED_TOP), col};
+        if (led >= LED_SIDE)
+            return {0x90, uchar((led - LED_SIDE) << 4 | MATRIX_W), col};
+        return {0x90, uchar((led / MATRIX_W) << 4 | led % MATRIX_W), col};
     }
 
-    /** Sets color of the button btn (as specified in KeyEvent code) */
-    void set_color(unsigned btn, uchar r, uchar g) {
-        // there are special bits 3, 2 - Clear and Copy. Used for double buffering
-        uchar col = color(r, g);
+    /** sends the dirty led slots at most the budget of messages. A rapid
+     * update run is used when it is cheaper than the messages per led - it
+     * starts at the first led, or continues where the run of the previous
+     * period was cut by the budget. Once all the leds are out, the pages
+     * flip (copying the displayed page to the new update page, so both
+     * match).
+     */
+    void send_leds(backend::MidiBuffer &jbuf, jack_nframes_t t, bool commands) override {
+        // any other message ends a rapid update run
+        if (commands) run_pos = 0;
+
+        if ((get_blinking() > 0) != flashing) switch_flash(jbuf, t);
 
-        if (btn >= 200) { // automap
-            if (btn > 207)
-                return; // err!
+        LedSet d;
+        load_dirty(d);
 
-            send_msg({0xB0, (uchar)(btn - 96), col});
-        } else {
-            send_msg({0x90, (uchar)btn, col});
+        if (!d[0] && !d[1]) {
+            if (flip_pending) send_flip(jbuf, t);
+            return;
         }
-    }
 
+        unsigned budget = get_led_budget();
 
-    /** Sets color of the button btn (as specified in KeyEvent code) */
-    void set_color(unsigned btn, uchar col) {
-        if (btn >= 200) { // automap
-            if (btn > 207)
-                return; // err!
+        // pick the best run length (in pairs) that fits into the budget
+        unsigned changed_after[LED_COUNT + 1];
+        changed_after[LED_COUNT] = 0;
+        for (unsigned i = LED_COUNT; i-- > 0;)
+            changed_after[i] = changed_after[i + 1] + is_dirty(d, i);
 
-            send_msg({0xB0, (uchar)(btn - 96), col});
-        } else {
-            send_msg({0x90, (uchar)btn, col});
-        }
-    }
+        unsigned start = run_pos;
+        unsigned before = changed_after[0] - changed_after[start];
+        unsigned run = 0, best_cost = changed_after[0];
 
-    static unsigned coord_to_btn(unsigned x, unsigned y) {
-        return x | y << 4;
-    }
+        for (unsigned r = 2; start + r <= LED_COUNT && r / 2 <= budget; r += 2) {
+            unsigned cost = r / 2 + before + changed_after[start + r];
+            if (cost < best_cost) {
+                best_cost = cost;
+                run       = r;
+            }
+        }
 
-    static bool matchName(const std::string &name) {
-        return (name.rfind("Launchpad:", 0) == 0) ||
-            (name.rfind("Launchpad MIDI", 0) == 0);
-    }
+        unsigned run_end = start + run;
 
-    /// called from the process callback in jack - we read/write midi events
-    /// here
-    void process(int nframes) {
-        // process all launchpads in the future...
-        jack::MidiBuffer buf = input_port.get_midi_buffer(nframes);
+        LedSet take = {0, 0};
+        unsigned msgs = run / 2;
 
-        int nevents = buf.get_event_count();
+        for (unsigned i = start; i < run_end; ++i) set_led(take, i);
 
-        for (int n = 0; n < nevents; ++n) {
-            jack_midi_event_t ev;
-            buf.get_event(ev, n);
-            process_event(ev.time, ev.buffer, ev.size);
+        for (unsigned i = 0; i < LED_COUNT && msgs < budget; ++i) {
+            if ((i >= start && i < run_end) || !is_dirty(d, i)) continue;
+            set_led(take, i);
+            ++msgs;
         }
 
-        // output part
-        // reserve events to be sent, all with zero relative time
-        jack::MidiBuffer jbuf = output_port.get_midi_buffer(nframes);
-        jbuf.clear();
+        claim(take);
 
-        jack_nframes_t last_frame_time = client.last_frame_time();
+        for (unsigned i = start; i < run_end; i += 2) {
+            write_msg(jbuf, t, {0x92, encode(i), encode(i + 1)}, i, i + 1);
+        }
 
-        // iterate all available Midi messages in the ringbuffer
-        while (ringbuffer.read_space()) {
-            jack::MidiMessage msg;
-            size_t read = ringbuffer.peek((char *)&msg, sizeof(msg));
+        bool single = false;
+        for (unsigned i = 0; i < LED_COUNT; ++i) {
+            if ((i >= start && i < run_end) || !is_dirty(take, i)) continue;
+            write_msg(jbuf, t, led_msg(i, encode(i)), i, i);
+            single = true;
+        }
 
-            if (read != sizeof(msg)) {
-                // TODO: report problem!
-                ringbuffer.read_advance(read);
-                continue;
-            }
+        // the device continues a run that no other message ended
+        run_pos = (run && !single && run_end < LED_COUNT) ? run_end : 0;
 
-            // if the time of the event is out of this window, break out of the loop
-            int t = msg.time + nframes - last_frame_time;
+        stats.led_messages.add(msgs);
+        update_backlog();
 
-            // sometimes we have an event queued that should already be out?!
-            if (t < 0) t = 0;
-            if (t >= nframes) break;
+        // both pages are written already
+        if (flashing) return;
 
-            // skip the read bytes now
-            ringbuffer.read_advance(read);
+        flip_pending = true;
 
-            jack_midi_data_t *evbuf = jbuf.event_reserve(t, 3);
-            std::copy(std::begin(msg.data), std::end(msg.data), evbuf);
+        // flip now if all is out, or if the updates keep coming for too long
+        LedSet left;
+        load_dirty(left);
+        if ((!left[0] && !left[1]) || ++flip_delay >= MAX_FLIP_DELAY) {
+            send_flip(jbuf, t);
         }
     }
 
-    void connect(const char *input, const char *output) {
-        input_port.connect_from(input);
-        output_port.connect_to(output);
-    }
+    /// writes a message to the port buffer, the leds get retried on failure
+    bool write_msg(backend::MidiBuffer &jbuf, jack_nframes_t t,
+                   const jack::MidiMessage &msg, unsigned led_a, unsigned led_b)
+    {
+        jack_midi_data_t *evbuf = jbuf.event_reserve(t, msg.len);
 
-protected:
-    void send_msg(jack::MidiMessage msg) {
-        // immediate send - use current frame time
-        msg.time = client.frame_time();
+        if (evbuf) {
+            std::copy(msg.data, msg.data + msg.len, evbuf);
+            return true;
+        }
 
-        if (ringbuffer.write_space() < sizeof(msg)) {
-            // TODO: Report this in a sane way!
-            std::cerr << "FIX: Ringbuffer full!" << std::endl;
-            return;
+        stats.dropped.add();
+        for (unsigned led : {led_a, led_b}) {
+            if (led < LED_COUNT) mark_dirty(led);
         }
 
-        ringbuffer.write(reinterpret_cast<const char*>(&msg), sizeof(msg));
+        return false;
     }
 
-    // resets lighting on the whole pad. Called by default in ctor to
-    // initialize the device to a known state
-    void reset() {
-        send_msg({0xB0, 0, 0});
+    /** enters the flash mode when leds start blinking, leaves it when none
+     * does. Entering rewrites all the leds to both pages. Leaving shows
+     * page 0 (the one the blinking leds are lit on) and copies it to the
+     * update page.
+     */
+    void switch_flash(backend::MidiBuffer &jbuf, jack_nframes_t t) {
+        bool enter = !flashing;
+
+        jack::MidiMessage msg = enter ? double_buffer_msg(false, false, false, true)
+                                      : double_buffer_msg(true, false, true);
+
+        if (!write_msg(jbuf, t, msg, NO_LED, NO_LED)) return; // next period
+
+        flashing     = enter;
+        cur_page     = !enter;
+        flip_pending = false;
+        flip_delay   = 0;
+        run_pos      = 0;
+
+        if (enter) invalidate();
+    }
+
+    void send_flip(backend::MidiBuffer &jbuf, jack_nframes_t t) {
+        cur_page = !cur_page;
+        write_msg(jbuf, t, double_buffer_msg(cur_page, !cur_page, true), NO_LED, NO_LED);
+        flip_pending = false;
+        flip_delay   = 0;
+        run_pos      = 0;
     }
 
     /** Controls double buffering.
@@ -357,72 +234,53 @@ protected:
     void set_double_buffer(bool update, bool display, bool copy = false,
                            bool flash = false)
     {
-        send_msg({0xB0, 0x00,
-                  static_cast<uchar>(
-                          0x20
-                          | (update ? 4 : 0)
-                          | (display ? 1 : 0)
-                          | (copy ? 16 : 0)
-                          | (flash ? 8 : 0))});
+        send_msg(double_buffer_msg(update, display, copy, flash));
     }
 
-    void process_event(double deltatime,
-                       uchar *data, int size)
+    static jack::MidiMessage double_buffer_msg(bool update, bool display,
+                                               bool copy = false, bool flash = false)
     {
-        if (size != 3) {
-            // TODO: log weird packet encounter
-            return;
-        }
+        return {0xB0, 0x00,
+                static_cast<uchar>(
+                        0x20
+                        | (update ? 4 : 0)
+                        | (display ? 1 : 0)
+                        | (copy ? 16 : 0)
+                        | (flash ? 8 : 0))};
+    }
 
+    bool decode_key(const uchar *data, KeyEvent &ev) override {
         // got a keypress event. convert to key event and send out
-        unsigned button = 0;
-        unsigned cx = 0, cy = 0;
-        ButtonType type = BTN_GRID;
         bool press = (data[2] > 0) && (data[0] != 0x80);
 
         // printf("MSG: %02X %02X %02X\n", data[0], data[1], data[2]);
 
-        KeyCb cback;
-        {
-            lock l(cb_mtx);
-            cback = callback;
-        }
-
-        // no cback, no work
-        if (!cback) return;
         if ((data[0] == 0x80) || (data[0] == 0x90)) {
-            button = data[1];
-            // classify - every button with lower nibble == 8 is side button
-            if ((button & 0x0F) == 0x08)
-                type = BTN_SIDE;
-            cx = button & 0x0F;
-            cy = button >> 4;
+            // the device numbers the buttons y << 4 | x
+            unsigned x = data[1] & 0x0F, y = data[1] >> 4;
+            if (x > MATRIX_W || y >= MATRIX_H) return false;
 
-            cback(*this, {type, button, cx, cy, press});
+            // classify - every button with lower nibble == 8 is side button
+            ButtonType type = (x == MATRIX_W) ? BTN_SIDE : BTN_GRID;
+            ev = {type, coord_to_btn(x, y), x, y, press};
+            return true;
         }
 
-        if (data[0] == 0xB0) {
-            // Top row buttons are shifted to 200 range
-            button = data[1] + 100 - 4;
-            type = BTN_TOP;
-            cx = button - 200;
-            cy = 0;
-
-            cback(*this, {type, button, cx, cy, press});
+        if (data[0] == 0xB0 && data[1] >= 104 && data[1] < 104 + MATRIX_W) {
+            // Top row buttons are CC 104..111
+            unsigned x = data[1] - 104;
+            ev = {BTN_TOP, top_btn(x), x, 0, press};
+            return true;
         }
-    }
 
-    // locks the callback
-    std::mutex cb_mtx;
-    KeyCb callback;
-
-    jack::Client &client;
-
-    jack::Port input_port;
-    jack::Port output_port;
+        return false;
+    }
 
-    // queue for sent messages
-    jack::RingBuffer ringbuffer;
+    // jack thread only
+    bool flashing     = false; // the device swaps the pages itself
+    bool flip_pending = false;
+    unsigned flip_delay = 0; // periods the flip waits for the leds
+    unsigned run_pos    = 0; // where the unfinished rapid update run continues
 
     bool cur_page;
 };
@@ -0,0 +1,231 @@
+#pragma once
+
+#include <string>
+#include <iterator>
+#include <algorithm>
+
+#include "grid.h"
+
+// The rgb Launchpads (see the programmer's reference of each). All of them
+// set the colors of many leds with one sysex message:
+//   MK2, Pro:    F0 00 20 29 02 <id> 0B (<led> <r> <g> <b>)... F7     6 bit rgb
+//   X, Mini MK3: F0 00 20 29 02 <id> 03 (03 <led> <r> <g> <b>)... F7  7 bit rgb
+// and number the leds (and the buttons they send) row/column in decimal -
+// 11 is the bottom left pad, 88 the top right one, 19..89 the right column.
+
+/// Launchpad MK2 in session layout
+struct LaunchpadMk2Model {
+    using Geometry   = grid::Geometry<8, 8>;
+    using ColorModel = grid::RgbModel<6>;
+
+    static constexpr uchar    DEVICE_ID = 0x18;
+    static constexpr uchar    LED_CMD   = 0x0B;  // rgb per led
+    static constexpr int      LED_TYPE  = -1;    // no color spec type byte
+    static constexpr unsigned MAX_LEDS  = 80;    // per message
+    static constexpr uchar    TOP_CC    = 104;   // first top row button
+    static constexpr bool     SIDE_CC   = false; // the right column sends notes
+
+    static constexpr uchar SETUP[]    = {0x22, 0x00}; // session layout
+    static constexpr uchar SHUTDOWN[] = {0x0E, 0x00}; // all leds off
+
+    static bool matchName(const std::string &name) {
+        return name.find("Launchpad MK2") != std::string::npos;
+    }
+};
+
+/// Launchpad Pro (the first one) in programmer layout
+struct LaunchpadProModel {
+    using Geometry   = grid::Geometry<8, 8>;
+    using ColorModel = grid::RgbModel<6>;
+
+    static constexpr uchar    DEVICE_ID = 0x10;
+    static constexpr uchar    LED_CMD   = 0x0B;
+    static constexpr int      LED_TYPE  = -1;
+    static constexpr unsigned MAX_LEDS  = 78;
+    static constexpr uchar    TOP_CC    = 91;
+    static constexpr bool     SIDE_CC   = true;
+
+    static constexpr uchar SETUP[]    = {0x2C, 0x03}; // programmer layout
+    static constexpr uchar SHUTDOWN[] = {0x0E, 0x00};
+
+    static bool matchName(const std::string &name) {
+        return name.find("Launchpad Pro") != std::string::npos
+               && name.find("Launchpad Pro MK3") == std::string::npos;
+    }
+};
+
+/// Launchpad X in programmer mode
+struct LaunchpadXModel {
+    using Geometry   = grid::Geometry<8, 8>;
+    using ColorModel = grid::RgbModel<7>;
+
+    static constexpr uchar    DEVICE_ID = 0x0C;
+    static constexpr uchar    LED_CMD   = 0x03; // led lighting
+    static constexpr int      LED_TYPE  = 3;    // rgb color spec
+    static constexpr unsigned MAX_LEDS  = 81;
+    static constexpr uchar    TOP_CC    = 91;
+    static constexpr bool     SIDE_CC   = true;
+
+    static constexpr uchar SETUP[]    = {0x0E, 0x01}; // programmer mode
+    static constexpr uchar SHUTDOWN[] = {0x0E, 0x00}; // back to live mode
+
+    static bool matchName(const std::string &name) {
+        return name.find("Launchpad X") != std::string::npos
+               || name.find("LPX") != std::string::npos;
+    }
+};
+
+/// Launchpad Mini MK3 - the protocol of the X
+struct LaunchpadMiniMk3Model : LaunchpadXModel {
+    static constexpr uchar DEVICE_ID = 0x0D;
+
+    static bool matchName(const std::string &name) {
+        return name.find("Launchpad Mini MK3") != std::string::npos
+               || name.find("LPMiniMK3") != std::string::npos;
+    }
+};
+
+/** Driver of the rgb Launchpads. The changed leds go out in bulk sysex, so
+ * even a full repaint is one or two messages.
+ */
+template<typename ModelT>
+class LaunchpadRgb : public GridController {
+public:
+    using Model      = ModelT;
+    using Geometry   = typename Model::Geometry;
+    using ColorModel = typename Model::ColorModel;
+
+    static_assert(Geometry::WIDTH == MATRIX_W && Geometry::HEIGHT == MATRIX_H,
+                  "a device is one 8x8 tile of the surface");
+
+    LaunchpadRgb(backend::Backend &client, const std::string &prefix)
+        : GridController(client, prefix)
+    {
+        send_command(Model::SETUP, sizeof(Model::SETUP));
+        // the frame is black - the first leds sent clear the device
+        invalidate();
+    }
+
+    ~LaunchpadRgb() { send_command(Model::SHUTDOWN, sizeof(Model::SHUTDOWN)); }
+
+    static bool matchName(const std::string &name) { return Model::matchName(name); }
+
+protected:
+    static constexpr uchar  HEADER[] = {0xF0, 0x00, 0x20, 0x29, 0x02, Model::DEVICE_ID};
+    static constexpr size_t SPEC_LEN = Model::LED_TYPE < 0 ? 4 : 5;
+
+    /// device number of the led
+    static uchar led_address(unsigned led) {
+        if (led >= LED_TOP) return Model::TOP_CC + (led - LED_TOP);
+        if (led >= LED_SIDE) return (MATRIX_H - (led - LED_SIDE)) * 10 + 9;
+        return (MATRIX_H - led / MATRIX_W) * 10 + led % MATRIX_W + 1;
+    }
+
+    /// sysex with the device header
+    void send_command(const uchar *body, size_t len) {
+        uchar msg[sizeof(HEADER) + 16];
+        len = std::min(len, sizeof(msg) - sizeof(HEADER) - 1);
+
+        uchar *p = std::copy(std::begin(HEADER), std::end(HEADER), msg);
+        p = std::copy(body, body + len, p);
+        *p++ = 0xF7;
+
+        send_raw(msg, p - msg);
+    }
+
+    /** the dirty leds go out in bulk sysex messages of Model::MAX_LEDS,
+     * at most the led budget of those
+     */
+    void send_leds(backend::MidiBuffer &jbuf, jack_nframes_t t, bool) override {
+        LedSet d;
+        load_dirty(d);
+
+        if (!d[0] && !d[1]) return;
+
+        unsigned budget = get_led_budget();
+        unsigned led = 0;
+
+        for (unsigned msgs = 0; msgs < budget; ++msgs) {
+            LedSet take = {0, 0};
+            unsigned count = 0;
+
+            for (; led < LED_COUNT && count < Model::MAX_LEDS; ++led) {
+                if (!is_dirty(d, led)) continue;
+                set_led(take, led);
+                ++count;
+            }
+
+            if (!count) break;
+
+            claim(take);
+
+            jack_midi_data_t *p = jbuf.event_reserve(
+                    t, sizeof(HEADER) + 1 + count * SPEC_LEN + 1);
+
+            if (!p) {
+                // retried in the next period
+                for (unsigned i = 0; i < LED_COUNT; ++i)
+                    if (is_dirty(take, i)) mark_dirty(i);
+
+                stats.dropped.add();
+                break;
+            }
+
+            p = std::copy(std::begin(HEADER), std::end(HEADER), p);
+            *p++ = Model::LED_CMD;
+
+            for (unsigned i = 0; i < LED_COUNT; ++i) {
+                if (!is_dirty(take, i)) continue;
+
+                Color c = slot(i);
+                if (Model::LED_TYPE >= 0) *p++ = uchar(Model::LED_TYPE);
+                *p++ = led_address(i);
+                *p++ = ColorModel::channel(c.r());
+                *p++ = ColorModel::channel(c.g());
+                *p++ = ColorModel::channel(c.b());
+            }
+
+            *p = 0xF7;
+            stats.led_messages.add();
+        }
+
+        update_backlog();
+    }
+
+    bool decode_key(const uchar *data, KeyEvent &ev) override {
+        uchar status = data[0] & 0xF0;
+        uchar num    = data[1];
+        bool  press  = (data[2] > 0) && (status != 0x80);
+        bool  note   = (status == 0x80) || (status == 0x90);
+
+        if (status == 0xB0 && num >= Model::TOP_CC && num < Model::TOP_CC + MATRIX_W) {
+            unsigned x = num - Model::TOP_CC;
+            ev = {BTN_TOP, top_btn(x), x, 0, press};
+            return true;
+        }
+
+        if (!note && status != 0xB0) return false;
+
+        // the Pro has more buttons around the grid, those are not used
+        unsigned row = num / 10, col = num % 10;
+        if (row < 1 || row > MATRIX_H || col < 1 || col > MATRIX_W + 1) return false;
+
+        unsigned y = MATRIX_H - row;
+
+        if (col == MATRIX_W + 1) {
+            if (note == Model::SIDE_CC) return false;
+            ev = {BTN_SIDE, coord_to_btn(MATRIX_W, y), MATRIX_W, y, press};
+            return true;
+        }
+
+        if (!note) return false;
+
+        ev = {BTN_GRID, coord_to_btn(col - 1, y), col - 1, y, press};
+        return true;
+    }
+};
+
+using LaunchpadMk2     = LaunchpadRgb<LaunchpadMk2Model>;
+using LaunchpadPro     = LaunchpadRgb<LaunchpadProModel>;
+using LaunchpadX       = LaunchpadRgb<LaunchpadXModel>;
+using LaunchpadMiniMk3 = LaunchpadRgb<LaunchpadMiniMk3Model>;
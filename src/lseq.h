@@ -1,106 +1,411 @@
 #pragma once
 
 #include <map>
+#include <string>
+#include <vector>
+#include <chrono>
 #include <condition_variable>
 
 #include "jackmidi.h"
-#include "launchpad.h"
+#include "controllers.h"
+#include "virtual_grid.h"
+#include "hotplug.h"
+#include "timer.h"
 #include "router.h"
 #include "ui.h"
 #include "project.h"
 #include "sequencer.h"
+#include "transport.h"
+#include "midiclock.h"
+#include "metrics.h"
+#include "thru.h"
+#include "recorder.h"
+#include "history.h"
+#include "trace.h"
 
 /** Main class - holds stuff together
  */
-class LSeq : public jack::Client::Callback {
+class LSeq : public jack::Client::Callback, public Hotplug::Handler {
 public:
     // TODO: Find available output midi devices - or let user specify
-    LSeq() : client("lseq"), router(client), sequencer(project, router, client) {
+    LSeq(backend::Backend &client)
+        : client(client)
+        , router(client)
+        , transport(project)
+        , sequencer(project, router)
+        , clock(client)
+        , thru(router)
+        , recorder(sequencer)
+        , hotplug(client, *this)
+    {
+        // tracks start routed to the first output, on their midi channel
+        for (unsigned t = 0; t < Project::MAX_TRACK; ++t) {
+            router.set_route(
+                    t, {{0, project.get_track(t)->get_midi_channel()}});
+        }
+
+        router.add_input_handler(clock_slave);
+        router.add_input_handler(thru);
+        router.add_input_handler(recorder);
+        router.add_input_handler(history);
+        router.set_tracer(&tracer);
+
+        router.register_metrics(registry);
+        sequencer.register_metrics(registry);
+        clock.register_metrics(registry);
+        recorder.register_metrics(registry);
+        tracer.register_metrics(registry);
+        hotplug.register_metrics(registry);
+        registry.add("process.periods",     periods);
+        registry.add("process.overlong",    overlong);
+        registry.add("process.duration_us", duration_us);
+
         client.set_callback(*this);
         client.activate();
         spawn();
+        transport.start();
     }
 
     ~LSeq() {
+        // no more devices coming, no more process calls while we're tearing down
+        hotplug.stop();
+        client.deactivate();
     }
 
     void run() {
         // TODO: watch for C-c and terminate cleanly here
         while (true) {
             std::unique_lock<std::mutex> lk(m);
-            cv.wait(lk);
+
+            // the jack thread can't take m, its wake up may get lost between
+            // the check and the wait - so the sleep is bounded
+            auto woken_up = [this] { return woken.exchange(false) || do_exit; };
+
+            auto due = std::min(timers.next_due(),
+                                TimerWheel::Clock::now() + MAX_SLEEP);
+            cv.wait_until(lk, due, woken_up);
+            lk.unlock(); // the timers scheduled below wake under it
 
             if (do_exit) break;
 
-            // iterate uis and update them
+            // keys and timers first, then the uis - no ui goes meanwhile
+            std::scoped_lock<std::mutex> l(uis_mtx);
+
+            for (auto &u : launchpads)
+                u.second->dispatch_keys();
+
+            timers.advance();
+
             for (auto &u : launchpads)
-                u.second.ui.update();
+                u.second->ui.update();
         }
     }
 
+    /// @note called from the jack thread too - must not lock
     void wake_up() {
+        woken = true;
         cv.notify_one();
     };
 
+    /// wake_up for the other threads - under m, so it never gets lost
+    void wake_up_locked() {
+        {
+            std::scoped_lock<std::mutex> l(m);
+            woken = true;
+        }
+        cv.notify_one();
+    }
+
     void exit() {
-        do_exit = true;
+        {
+            std::scoped_lock<std::mutex> l(m);
+            do_exit = true;
+        }
         cv.notify_one();
     }
 
     int process(jack_nframes_t nframes) override {
-        // iterate all launchpad
-        for (auto &u : launchpads) u.second.process(nframes);
-        sequencer.process(nframes);
-        router.process(nframes);
+        auto started = std::chrono::steady_clock::now();
+        ++cycle; // odd while processing, see remove_grid
+
+        // iterate all launchpad - the keys get queued for the ui thread
+        bool keys = false;
+        for (auto &u : live) {
+            if (LaunchpadUI *ui = u.load()) keys |= ui->process(nframes);
+        }
+
+        if (keys) wake_up();
+
+        // input first - clock slave has to see the pulses of this period
+        router.process_input(nframes);
+
+        auto window = transport.advance(
+                client.last_frame_time(), nframes, client.sample_rate());
+
+        sequencer.process(window);
+        recorder.process(window);
+        history.process(window);
+        clock.process(window);
+        router.process_output(nframes);
+
+        long us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - started).count();
+
+        duration_us.set(us);
+        periods.add();
+        if (us * double(client.sample_rate()) > nframes * 1e6) overlong.add();
+
+        ++cycle;
         return 0;
     }
 
+    backend::Backend &get_client() { return client; }
+    Project &get_project() { return project; }
     Router &get_router() { return router; }
     Sequencer &get_sequencer() { return sequencer; }
+    Transport &get_transport() { return transport; }
+    ClockMaster &get_clock() { return clock; }
+    MidiThru &get_thru() { return thru; }
+    Recorder &get_recorder() { return recorder; }
+    InputHistory &get_history() { return history; }
+
+    /// keeps the last bars played on the input as a sequence of the track
+    size_t capture_history(unsigned track, unsigned slot, unsigned bars) {
+        Track *t = project.get_track(track);
+        if (!t) return 0;
+
+        Sequence *seq = t->get_sequence(slot);
+        if (!seq) return 0;
+
+        return history.capture(*seq, bars);
+    }
+    metrics::Registry &get_metrics() { return registry; }
+
+    /// periodically dumps all the metrics to given stream (from a thread)
+    void report_metrics(std::ostream &os, std::chrono::milliseconds interval) {
+        reporter.start(os, interval);
+    }
+
+    /// traces the router input and output into a file (see trace.h)
+    void start_trace(const std::string &path) {
+        tracer.start(path, client.sample_rate());
+    }
+
+    void stop_trace() { tracer.stop(); }
+
+    /// follow the midi clock on router input instead of the project tempo
+    void set_clock_sync(bool slave) {
+        transport.set_sync(slave ? &clock_slave : nullptr);
+    }
+
+    /// capture and playback port of one controller
+    struct GridPorts {
+        std::string in, out;
+    };
+
+    /** adds an ui on cols x rows controllers tiled into one surface, ports
+     * row by row from the top left. Can be called while running. Returns
+     * the number of the ui - never reused, so are the port names.
+     */
+    int add_grid(unsigned cols, unsigned rows, const std::vector<GridPorts> &ports) {
+        if (ports.size() != cols * rows)
+            throw Exception(format("A ", cols, "x", rows, " grid needs ",
+                                   cols * rows, " controllers"));
+
+        std::scoped_lock<std::mutex> l(uis_mtx);
+
+        auto slot = std::find(std::begin(live), std::end(live), nullptr);
+        if (slot == std::end(live))
+            throw Exception(format("No more than ", MAX_UIS, " uis"));
+
+        int order = next_order++;
+        auto u = std::make_unique<LaunchpadUI>(client, order, *this, cols, rows, ports);
+
+        for (size_t i = 0; i < u->devices.size(); ++i) {
+            std::string name = "launchpad" + std::to_string(order);
+            if (u->devices.size() > 1) name += "." + std::to_string(i);
+            u->devices[i]->register_metrics(registry, name);
+        }
+
+        *slot = u.get();
+        launchpads.emplace(order, std::move(u));
+        return order;
+    }
+
+    /// removes the ui, once the jack thread is done with it
+    void remove_grid(int order) {
+        std::scoped_lock<std::mutex> l(uis_mtx);
+
+        auto it = launchpads.find(order);
+        if (it == launchpads.end()) return;
+
+        std::replace(std::begin(live), std::end(live), it->second.get(),
+                     static_cast<LaunchpadUI *>(nullptr));
+        wait_process();
+
+        registry.remove("launchpad" + std::to_string(order));
+        launchpads.erase(it);
+    }
+
+    /// synth ports matching the regex get connected to the router output
+    /// as they appear
+    void watch_synth(const std::string &pattern, unsigned output = 0) {
+        hotplug.watch_synth(pattern, output);
+    }
+
+    // Hotplug::Handler - hotplug thread
+    void on_controller(const std::string &capture, const std::string &playback,
+                       bool plugged) override
+    {
+        if (plugged) {
+            plugged_uis[capture] = add_grid(1, 1, {{capture, playback}});
+            return;
+        }
+
+        auto it = plugged_uis.find(capture);
+        if (it == plugged_uis.end()) return;
+
+        remove_grid(it->second);
+        plugged_uis.erase(it);
+    }
+
+    void on_synth(const std::string &port, unsigned output, bool plugged) override {
+        // jack drops the connections of the ports gone
+        if (!plugged) return;
+
+        if (backend::Port *out = router.get_output(output))
+            out->connect_to(port.c_str());
+    }
 
 private:
+    static constexpr unsigned MAX_UIS = 8;
+    static constexpr std::chrono::milliseconds MAX_SLEEP{10}; // of the ui thread
+
     void spawn() {
-        // TODO: Use config/commandline options
-        launchpads.try_emplace(
-                0,
-                client,
-                0,
-                *this,
-                "a2j:Launchpad (capture): Launchpad MIDI 1",
-                "a2j:Launchpad (playback): Launchpad MIDI 1");
+        // the controllers present now and the ones plugged later
+        hotplug.start();
     }
 
+    /// waits until the jack thread is out of the process call it may be in
+    void wait_process() {
+        uint64_t c = cycle;
+        if (!(c & 1)) return;
+
+        while (cycle == c)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    /** the controllers of one ui. A single one is the surface itself,
+     * more are tiled by a VirtualGrid - each still processes on its own.
+     */
     struct LaunchpadUI {
-        LaunchpadUI(jack::Client &client,
+        using Devices = std::vector<std::unique_ptr<GridController>>;
+
+        LaunchpadUI(backend::Backend &client,
                     int order,
                     LSeq &lseq,
-                    const char *inport,
-                    const char *outport)
-                : l(client, "launchpad " + std::to_string(order)), ui(lseq, lseq.project, l)
+                    unsigned cols,
+                    unsigned rows,
+                    const std::vector<GridPorts> &ports)
+                : devices(make_devices(client, order, ports))
+                , tiling(make_tiling(cols, rows, devices))
+                , ui(lseq, lseq.project, surface(), lseq.timers)
         {
-            l.connect(inport, outport);
+            for (size_t i = 0; i < devices.size(); ++i)
+                devices[i]->connect(ports[i].in.c_str(), ports[i].out.c_str());
         }
 
         // not copyable. just to be sure here
         LaunchpadUI(const LaunchpadUI &) = delete;
         LaunchpadUI &operator=(const LaunchpadUI &) = delete;
 
-        void process(jack_nframes_t nframes) {
-            l.process(nframes);
+        /// true if any key got queued
+        bool process(jack_nframes_t nframes) {
+            unsigned keys = 0;
+            for (auto &d : devices) keys += d->process(nframes);
+            return keys > 0;
         }
 
-        Launchpad l;
+        /// the keys go to the ui. @note ui thread only
+        void dispatch_keys() {
+            for (auto &d : devices) d->dispatch_keys();
+        }
+
+        /// what the ui draws on
+        GridSurface &surface() {
+            if (tiling) return *tiling;
+            return *devices.at(0);
+        }
+
+        static Devices make_devices(backend::Backend &client,
+                                    int order,
+                                    const std::vector<GridPorts> &ports)
+        {
+            Devices res;
+
+            for (size_t i = 0; i < ports.size(); ++i) {
+                std::string prefix = "launchpad " + std::to_string(order);
+                if (ports.size() > 1) prefix += "." + std::to_string(i);
+                res.push_back(make_grid_controller(client, prefix, ports[i].in));
+            }
+
+            return res;
+        }
+
+        static std::unique_ptr<VirtualGrid> make_tiling(unsigned cols,
+                                                        unsigned rows,
+                                                        Devices &devices)
+        {
+            if (devices.size() == 1) return nullptr;
+
+            auto res = std::make_unique<VirtualGrid>(cols, rows);
+
+            for (unsigned i = 0; i < devices.size(); ++i)
+                res->attach(i % cols, i / cols, *devices[i]);
+
+            return res;
+        }
+
+        Devices devices;
+        std::unique_ptr<VirtualGrid> tiling;
         UI ui;
     };
 
 
-    jack::LogHandler lh;
     std::mutex m;
     std::atomic<bool> do_exit = false;
-    std::map<int, LaunchpadUI> launchpads;
-    jack::Client client;
+    std::atomic<bool> woken   = false; // see wake_up
+    std::condition_variable cv;
+
+    // the ui thread ones - before the uis, whose screens cancel theirs when destroyed
+    TimerWheel timers{[this] { wake_up_locked(); }};
+
+    // the uis - owned by the ui thread, the jack thread sees the live ones
+    std::mutex uis_mtx;
+    std::map<int, std::unique_ptr<LaunchpadUI>> launchpads;
+    std::atomic<LaunchpadUI *> live[MAX_UIS] = {};
+    std::atomic<uint64_t> cycle = 0;
+    int next_order = 0;
+    std::map<std::string, int> plugged_uis; // capture port -> ui, hotplug thread
+
+    backend::Backend &client;
     Project project; // we just use one singular project and replace contents
+    Tracer tracer;
     Router router;
+    Transport transport;
     Sequencer sequencer;
-    std::condition_variable cv;
+    ClockMaster clock;
+    ClockSlave clock_slave;
+    MidiThru thru;
+    Recorder recorder;
+    InputHistory history;
+    Hotplug hotplug;
+
+    // process callback metrics
+    metrics::Counter periods;
+    metrics::Counter overlong; // took longer than the period itself
+    metrics::Gauge   duration_us;
+
+    metrics::Registry registry;
+    metrics::Reporter reporter{registry}; // last - stops before the rest goes
 };
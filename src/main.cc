@@ -1,10 +1,22 @@
 #include <iostream>
+#include <cstdlib>
 
 #include "lseq.h"
 
 int main() {
     try {
-        LSeq s;
+        jack::LogHandler lh;
+        jack::Client client("lseq");
+        LSeq s(client);
+
+        // LSEQ_TRACE=file traces the midi timing (decode with lseq-trace)
+        if (const char *path = std::getenv("LSEQ_TRACE"))
+            s.start_trace(path);
+
+        // LSEQ_SYNTH=regex connects the matching synth ports as they appear
+        if (const char *synth = std::getenv("LSEQ_SYNTH"))
+            s.watch_synth(synth);
+
         s.run();
     } catch (const std::exception &e) {
         std::cerr << "Terminating with an error: " << e.what() << std::endl;
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <ostream>
+#include <condition_variable>
+
+/** Realtime-safe metrics. Counters and gauges are plain relaxed atomics,
+ * each on its own cache line so the jack thread and the UI thread don't
+ * fight over them. Updating them never locks nor allocates.
+ *
+ * The owners (router, launchpad, ...) keep the metrics as members and
+ * register them by name into a Registry. A Reporter thread then
+ * periodically dumps the registry - all the formatting happens there.
+ */
+namespace metrics {
+
+static constexpr size_t CACHE_LINE = 64;
+
+/// monotonic event counter (drops, overruns, ...)
+struct alignas(CACHE_LINE) Counter {
+    void add(unsigned long n = 1) {
+        value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    unsigned long get() const { return value.load(std::memory_order_relaxed); }
+
+    std::atomic<unsigned long> value = 0;
+};
+
+/// current value with a high-water mark (ring fill, durations, ...)
+struct alignas(CACHE_LINE) Gauge {
+    void set(long v) {
+        value.store(v, std::memory_order_relaxed);
+
+        long m = max.load(std::memory_order_relaxed);
+        while (v > m && !max.compare_exchange_weak(m, v, std::memory_order_relaxed))
+            ;
+    }
+
+    long get() const     { return value.load(std::memory_order_relaxed); }
+    long get_max() const { return max.load(std::memory_order_relaxed); }
+
+    /// forgets the high-water mark
+    void reset_max() { max.store(get(), std::memory_order_relaxed); }
+
+    std::atomic<long> value = 0;
+    std::atomic<long> max   = 0;
+};
+
+/** Named list of metrics. Registration is not realtime safe (allocates),
+ * do it on setup. The registered metrics have to outlive the registry.
+ */
+class Registry {
+public:
+    void add(const std::string &name, const Counter &c) {
+        std::scoped_lock<std::mutex> l(mtx);
+        entries.push_back({name, &c, nullptr});
+    }
+
+    void add(const std::string &name, const Gauge &g) {
+        std::scoped_lock<std::mutex> l(mtx);
+        entries.push_back({name, nullptr, &g});
+    }
+
+    /// drops the metrics named prefix or prefix.*
+    void remove(const std::string &prefix) {
+        std::scoped_lock<std::mutex> l(mtx);
+
+        entries.erase(
+                std::remove_if(entries.begin(), entries.end(), [&](const Entry &e) {
+                    return e.name.compare(0, prefix.size(), prefix) == 0
+                           && (e.name.size() == prefix.size() || e.name[prefix.size()] == '.');
+                }),
+                entries.end());
+    }
+
+    /// writes one line per metric - name value [max]
+    void dump(std::ostream &os) const {
+        std::scoped_lock<std::mutex> l(mtx);
+
+        for (const auto &e : entries) {
+            os << e.name << ' ';
+            if (e.counter)
+                os << e.counter->get();
+            else
+                os << e.gauge->get() << " max " << e.gauge->get_max();
+            os << '\n';
+        }
+
+        os.flush();
+    }
+
+protected:
+    struct Entry {
+        std::string name;
+        const Counter *counter;
+        const Gauge *gauge;
+    };
+
+    mutable std::mutex mtx;
+    std::vector<Entry> entries;
+};
+
+/// background thread dumping the registry to a stream every interval
+class Reporter {
+public:
+    Reporter(const Registry &registry) : registry(registry) {}
+
+    Reporter(const Reporter &) = delete;
+    Reporter &operator=(const Reporter &) = delete;
+
+    ~Reporter() { stop(); }
+
+    void start(std::ostream &os, std::chrono::milliseconds interval) {
+        stop();
+
+        do_exit = false;
+        thread = std::thread([this, &os, interval] {
+            std::unique_lock<std::mutex> lk(mtx);
+            while (!cv.wait_for(lk, interval, [this] { return do_exit; })) {
+                os << "--- metrics\n";
+                registry.dump(os);
+            }
+        });
+    }
+
+    void stop() {
+        if (!thread.joinable()) return;
+
+        {
+            std::scoped_lock<std::mutex> l(mtx);
+            do_exit = true;
+        }
+
+        cv.notify_one();
+        thread.join();
+    }
+
+protected:
+    const Registry &registry;
+
+    std::thread thread;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool do_exit = false;
+};
+
+} // namespace metrics
@@ -0,0 +1,378 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <algorithm>
+
+#include "common.h"
+#include "jackmidi.h"
+#include "transport.h"
+#include "router.h"
+#include "metrics.h"
+
+/// system realtime/common messages used for clock sync
+enum ClockStatus : uchar {
+    EV_SONG_POSITION  = 0xF2,
+    EV_CLOCK_START    = 0xFA,
+    EV_CLOCK_CONTINUE = 0xFB,
+    EV_CLOCK_STOP     = 0xFC
+};
+
+/** MIDI clock master. Emits 24 PPQN clock pulses (0xF8) and transport
+ * messages (start, stop, continue, song position) on a dedicated port.
+ *
+ * Pulses are placed on the exact frame where the transport position crosses
+ * the pulse boundary, so the tempo is taken from the same Window the
+ * sequencer uses. To stay aligned with the router (which outputs queued
+ * events one period later), the messages computed for a window are written
+ * out in the following process call.
+ */
+class ClockMaster {
+public:
+    static constexpr ticks CLOCK_PPQN  = 24;
+    static constexpr ticks PULSE_TICKS = PPQN / CLOCK_PPQN;
+    static constexpr ticks SPP_TICKS   = PPQN / 4; // song position is in 1/16s
+    static constexpr size_t MAX_PENDING = 256;
+
+    /// inter-pulse interval statistics, in frames
+    struct JitterStats {
+        unsigned long count = 0;
+        double min    = 0;
+        double max    = 0;
+        double mean   = 0;
+        double stddev = 0;
+
+        double spread() const { return max - min; }
+    };
+
+    ClockMaster(backend::Backend &client, const char *name = "clock::out")
+        : port(client.register_port(name, backend::Backend::PORT_OUTPUT))
+    {}
+
+    void connect(const char *target) { port->connect_to(target); }
+
+    void register_metrics(metrics::Registry &r, const std::string &prefix = "clock") {
+        r.add(prefix + ".dropped",  dropped);
+        r.add(prefix + ".overruns", overruns);
+    }
+
+    /// output the previous window, then compute messages for this one
+    void process(const Transport::Window &w) {
+        backend::MidiBuffer &buf = port->get_midi_buffer(w.nframes);
+        buf.clear();
+
+        for (size_t i = 0; i < pending_count; ++i) {
+            const Pending &p = pending[i];
+            jack_midi_data_t *evbuf = buf.event_reserve(p.offset, p.len);
+            if (evbuf)
+                std::copy(p.data, p.data + p.len, evbuf);
+            else
+                dropped.add();
+        }
+
+        pending_count = 0;
+
+        // SPP is only valid when not running - we send it before continue.
+        // A locate while running stops the slaves for it
+        bool relocated = w.located && w.running && !w.started && !w.continued;
+
+        if (w.stopped || relocated) add(0, {EV_CLOCK_STOP});
+
+        if (w.located && !w.started) {
+            unsigned spp = unsigned(std::max(w.start, 0.0) / SPP_TICKS) & 0x3FFF;
+            add(0, {EV_SONG_POSITION, uchar(spp & 0x7F), uchar(spp >> 7)});
+        }
+
+        if (w.started) add(0, {EV_CLOCK_START});
+        if (w.continued || relocated) add(0, {EV_CLOCK_CONTINUE});
+
+        if (!w.running) return;
+
+        // first pulse boundary at or after the start of the window
+        ticks pulse = next_multiple(w.first_tick(), PULSE_TICKS);
+
+        for (; pulse < w.end_tick(); pulse += PULSE_TICKS) {
+            jack_nframes_t off = w.tick_to_offset(double(pulse));
+            add(off, {EV_MIDI_CLOCK});
+
+            if (measure) measure_pulse(w.frame, off, pulse);
+        }
+    }
+
+    /** enables/disables measurement of the inter-pulse intervals. Enabling
+     * resets the statistics.
+     */
+    void set_jitter_measure(bool enable) {
+        if (enable) reset_request = true;
+        measure = enable;
+    }
+
+    JitterStats get_jitter() const {
+        JitterStats s;
+        unsigned long n = j_count;
+        if (!n) return s;
+
+        double sum = j_sum, sq = j_sumsq;
+        s.count  = n;
+        s.min    = j_min;
+        s.max    = j_max;
+        s.mean   = sum / n;
+        s.stddev = std::sqrt(std::max(0.0, sq / n - s.mean * s.mean));
+        return s;
+    }
+
+    std::string format_jitter() const {
+        JitterStats s = get_jitter();
+        return format("clock: ", s.count, " intervals, mean ", s.mean,
+                      " frames, spread ", s.spread(), " (", s.min, "..",
+                      s.max, "), stddev ", s.stddev);
+    }
+
+protected:
+    struct Pending {
+        jack_nframes_t offset;
+        uint8_t len;
+        uchar data[3];
+    };
+
+    void add(jack_nframes_t offset, std::initializer_list<uchar> l) {
+        if (pending_count >= MAX_PENDING) {
+            overruns.add();
+            return;
+        }
+
+        Pending &p = pending[pending_count++];
+        p.offset = offset;
+        p.len    = 0;
+        for (uchar c : l) p.data[p.len++] = c;
+    }
+
+    // jack thread only
+    void measure_pulse(jack_nframes_t frame, jack_nframes_t off, ticks pulse) {
+        jack_nframes_t abs = frame + off;
+
+        if (reset_request.exchange(false)) {
+            j_count = 0;
+            j_sum = j_sumsq = 0;
+            last_pulse = pulse - PULSE_TICKS - 1; // invalidate
+        }
+
+        // only consecutive pulses are measured (not across locates)
+        if (pulse == last_pulse + PULSE_TICKS) {
+            double d = double(jack_nframes_t(abs - last_frame));
+            if (!j_count || d < j_min) j_min = d;
+            if (!j_count || d > j_max) j_max = d;
+            j_sum   = j_sum + d;
+            j_sumsq = j_sumsq + d * d;
+            ++j_count;
+        }
+
+        last_pulse = pulse;
+        last_frame = abs;
+    }
+
+    std::unique_ptr<backend::Port> port;
+
+    Pending pending[MAX_PENDING];
+    size_t  pending_count = 0;
+
+    // jitter measurement, written in jack thread, read from anywhere
+    std::atomic<bool> measure       = false;
+    std::atomic<bool> reset_request = false;
+    std::atomic<unsigned long> j_count = 0;
+    std::atomic<double> j_min = 0, j_max = 0, j_sum = 0, j_sumsq = 0;
+    ticks last_pulse = -1;
+    jack_nframes_t last_frame = 0;
+
+    metrics::Counter dropped;  // no space in the port buffer
+    metrics::Counter overruns; // more messages in a window than MAX_PENDING
+};
+
+/** Second order delay locked loop filtering time stamps of periodic events.
+ * See F. Adriaensen, "Using a DLL to filter time". All times are in frames.
+ */
+class ClockDll {
+public:
+    /// bandwidth is relative to the event rate (0.1 == 1/10 of pulse rate)
+    void set_bandwidth(double bw) {
+        double omega = 2 * M_PI * bw;
+        b = std::sqrt(2.0) * omega;
+        c = omega * omega;
+    }
+
+    void reset(double t, double period) {
+        e2 = period;
+        t0 = t;
+        t1 = t + period;
+    }
+
+    /// feeds a new event time, returns the prediction error before update
+    double update(double t) {
+        double e = t - t1;
+        t0  = t1;
+        t1 += b * e + e2;
+        e2 += c * e;
+        return e;
+    }
+
+    double time() const   { return t0; } // filtered time of the last event
+    double period() const { return e2; } // filtered event period
+
+protected:
+    double b = 0, c = 0;
+    double t0 = 0, t1 = 0, e2 = 0;
+};
+
+/** MIDI clock slave. Listens on the router input for clock and transport
+ * messages and acts as an external sync source for the Transport.
+ *
+ * Pulse time stamps are smoothed with a DLL. The loop starts with a wide
+ * bandwidth to lock quickly and narrows down once locked, so the following
+ * jitter stays well below a tick even with coarse input time stamps.
+ */
+class ClockSlave : public Router::InputHandler, public Transport::Sync {
+public:
+    static constexpr double BW_LOCKING = 0.1;   // bandwidth while locking
+    static constexpr double BW_LOCKED  = 0.02;  // bandwidth once locked
+    static constexpr unsigned LOCK_PULSES = ClockMaster::CLOCK_PPQN * 2;
+
+    ClockSlave() {
+        dll.set_bandwidth(BW_LOCKING);
+    }
+
+    /// true if the clock is received and the tempo estimate is stable
+    bool is_locked() const { return locked; }
+
+    /// filtered tempo of the incoming clock
+    double get_bpm() const { return bpm; }
+
+    void on_input(jack_nframes_t frame, const uchar *data,
+                  size_t size) override
+    {
+        if (!size) return;
+
+        switch (data[0]) {
+        case EV_MIDI_CLOCK:
+            pulse(frame);
+            break;
+        case EV_CLOCK_START:
+            // the next pulse marks the tick 0
+            next_pulse = 0;
+            started    = true;
+            running    = true;
+            break;
+        case EV_CLOCK_CONTINUE:
+            if (!running) continued = true;
+            running = true;
+            break;
+        case EV_CLOCK_STOP:
+            if (running) stopped = true;
+            running = false;
+            break;
+        case EV_SONG_POSITION:
+            if (size < 3) break;
+            // position is in 1/16s, each having 6 clock pulses
+            next_pulse = long(data[1] | (data[2] << 7)) * 6;
+            located    = true;
+            break;
+        }
+    }
+
+    State sync_at(jack_nframes_t frame, jack_nframes_t sample_rate) override {
+        State st;
+
+        // need at least two pulses to know the tempo
+        if (!pulses) return st;
+
+        double t      = unwrap(frame);
+        double period = dll.period();
+
+        st.valid     = true;
+        st.running   = running;
+        st.started   = started;
+        st.continued = continued;
+        st.stopped   = stopped;
+        st.located   = located;
+        started = continued = stopped = located = false;
+
+        // extrapolate from the last pulse, but never past the next one
+        double last  = double(next_pulse - 1);
+        double phase = std::clamp((t - dll.time()) / period, 0.0, 1.0);
+        st.position  = (last + phase) * ClockMaster::PULSE_TICKS;
+
+        bpm    = 60.0 * sample_rate / (ClockMaster::CLOCK_PPQN * period);
+        st.bpm = bpm;
+        return st;
+    }
+
+protected:
+    void pulse(jack_nframes_t frame) {
+        double t = unwrap(frame);
+
+        if (!have_pulse) {
+            // first pulse - nothing to estimate the period from yet
+            have_pulse = true;
+            last_pulse = t;
+            if (running) ++next_pulse;
+            return;
+        }
+
+        if (pulses == 0) {
+            // second pulse - we have the first period estimate
+            dll.set_bandwidth(BW_LOCKING);
+            dll.reset(t, t - last_pulse);
+        } else {
+            double e = dll.update(t);
+
+            // too far off - the clock was restarted or changed tempo abruptly
+            if (std::abs(e) > dll.period()) {
+                pulses = 0;
+                locked = false;
+                dll.reset(t, t - last_pulse);
+            }
+        }
+
+        last_pulse = t;
+
+        if (++pulses == LOCK_PULSES) {
+            dll.set_bandwidth(BW_LOCKED);
+            locked = true;
+        }
+
+        if (running) ++next_pulse;
+    }
+
+    /// converts the wrapping jack frame time to a monotonic frame counter
+    double unwrap(jack_nframes_t frame) {
+        if (!have_epoch) {
+            have_epoch = true;
+            last_raw   = frame;
+        }
+
+        // frames before the last stamp are possible (sync_at vs. pulses)
+        int32_t d = int32_t(frame - last_raw);
+        if (d > 0) {
+            base    += d;
+            last_raw = frame;
+            return double(base);
+        }
+
+        return double(base + d);
+    }
+
+    ClockDll dll;
+
+    // jack thread only
+    bool   have_epoch = false;
+    bool   have_pulse = false;
+    jack_nframes_t last_raw = 0;
+    int64_t base = 0;
+    double last_pulse = 0;
+    unsigned pulses = 0;
+    long next_pulse = 0; // index of the next pulse to be received
+    bool running = false;
+    bool started = false, continued = false, stopped = false, located = false;
+
+    std::atomic<bool>   locked = false;
+    std::atomic<double> bpm    = DEFAULT_BPM;
+};
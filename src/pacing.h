@@ -0,0 +1,311 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "common.h"
+#include "jackmidi.h"
+#include "backend.h"
+
+/** Bandwidth model of a hardware (DIN) midi port. A 5-pin port carries
+ * 31250 baud, 10 bits per byte - about a millisecond per 3 byte message.
+ * A burst written to jack in a single frame gets smeared (or dropped) by
+ * the interface anyway, so the pacer schedules the messages onto the wire
+ * itself:
+ *
+ *  - each message occupies the wire for its byte count (with running
+ *    status, note-offs are sent as note-on velocity 0 to make use of it)
+ *  - when the wire is busy, messages wait in a backlog. Realtime messages
+ *    (clock) and note-offs go first, continuous controllers last
+ *  - a controller value waiting in the backlog gets replaced by a newer
+ *    value of the same controller (thinning), so lanes degrade gracefully
+ *
+ * Jack thread only, except for the configuration.
+ */
+class MidiPacer {
+public:
+    static constexpr unsigned MIDI_BAUD    = 31250;
+    static constexpr unsigned BITS_PER_BYTE = 10; // start + 8 + stop bit
+    static constexpr size_t   BACKLOG_SIZE = 256;
+    static constexpr size_t   LONG_SIZE    = 4096; // bytes of waiting sysex
+
+    /// what happened to the messages during a period
+    struct Counts {
+        unsigned late    = 0; // sent later than scheduled
+        unsigned thinned = 0; // replaced by a newer value
+        unsigned shed    = 0; // backlog overflow
+    };
+
+    /// 0 baud disables pacing
+    void set_bandwidth(unsigned b, jack_nframes_t sr, bool running_status = true) {
+        sample_rate.store(sr, std::memory_order_relaxed);
+        rs_enabled.store(running_status, std::memory_order_relaxed);
+        baud.store(b, std::memory_order_release);
+    }
+
+    unsigned get_bandwidth() const { return baud.load(std::memory_order_acquire); }
+
+    /// true if the messages have to go through the pacer
+    bool is_active() const { return get_bandwidth() || count; }
+
+    /// adds a message due at given absolute frame to the backlog
+    void submit(const jack::MidiMessage &msg, jack_nframes_t due, Counts &c) {
+        uchar prio = priority(msg);
+
+        if (prio == PRIO_CONTROL) {
+            for (size_t i = 0; i < count; ++i) {
+                if (same_control(backlog[i].msg, msg)) {
+                    // keep the place in the queue, send the newest value
+                    backlog[i].msg = msg;
+                    ++c.thinned;
+                    return;
+                }
+            }
+        }
+
+        if (count == BACKLOG_SIZE) {
+            // shed the least important, latest message
+            size_t victim = 0;
+            for (size_t i = 1; i < count; ++i) {
+                if (!before(backlog[i], backlog[victim])) victim = i;
+            }
+
+            // lower prio is more important - drop the new one if it's not
+            ++c.shed;
+            if (prio >= backlog[victim].prio) return;
+            release(backlog[victim]);
+            backlog[victim] = backlog[--count];
+        }
+
+        Item &it = backlog[count++];
+        it = {msg, due, serial++, prio};
+
+        uchar ch = msg.data[0] & 0x0F, note = msg.data[1] & NOTE_MAX;
+        if (prio == PRIO_NOTE_ON)
+            ++ons_in[ch][note];
+        else if (prio == PRIO_NOTE_OFF)
+            it.wait_for = ons_in[ch][note];
+    }
+
+    /** adds a long message (sysex) due at given frame to the backlog.
+     * Returns the space to copy the message bytes into, or nullptr if there
+     * is no room for it.
+     */
+    uchar *submit_long(size_t len, jack_nframes_t due, Counts &c) {
+        if (count == BACKLOG_SIZE || long_used + len > LONG_SIZE) {
+            ++c.shed;
+            return nullptr;
+        }
+
+        Item &it = backlog[count++];
+        it = {{}, due, serial++, PRIO_OTHER, uint16_t(long_used), uint16_t(len)};
+
+        uchar *res = long_bytes + long_used;
+        long_used += len;
+        ++long_count;
+        return res;
+    }
+
+    /** writes the backlog messages the wire has time for in this period.
+     * Returns the number of messages written.
+     */
+    unsigned emit(backend::MidiBuffer &jbuf, jack_nframes_t frame,
+                  jack_nframes_t nframes, Counts &c)
+    {
+        unsigned b = baud.load(std::memory_order_acquire);
+        bool rs    = rs_enabled.load(std::memory_order_relaxed);
+
+        // frames the wire needs per byte, 0 means unlimited (flush)
+        double per_byte = b ? double(sample_rate.load(std::memory_order_relaxed))
+                                      * BITS_PER_BYTE / b
+                            : 0;
+        double wire     = wire_free > 0 ? wire_free : 0; // relative to frame
+        unsigned written = 0;
+
+        while (count && wire < nframes) {
+            int best = -1;
+            int earliest = -1;
+
+            for (size_t i = 0; i < count; ++i) {
+                if (blocked(i)) continue;
+
+                int32_t rel = int32_t(backlog[i].due - frame);
+
+                if (earliest < 0 || rel < int32_t(backlog[earliest].due - frame))
+                    earliest = i;
+
+                if (rel <= wire && (best < 0 || before(backlog[i], backlog[best])))
+                    best = i;
+            }
+
+            // wire is idle until the next sendable message is due. Nothing
+            // later to wait for - the blocked ones wait for the next period
+            if (best < 0) {
+                if (earliest < 0) break;
+
+                double next = int32_t(backlog[earliest].due - frame);
+                if (next <= wire) break;
+
+                wire = next;
+                continue;
+            }
+
+            Item it = backlog[best];
+            backlog[best] = backlog[--count];
+
+            jack::MidiMessage msg = it.msg;
+            const uchar *data = msg.data;
+            size_t len = msg.len;
+            size_t bytes;
+
+            if (it.long_len) {
+                data    = long_bytes + it.long_off;
+                len     = it.long_len;
+                bytes   = len;
+                running = 0; // sysex cancels running status
+            } else {
+                bytes = encode(msg, rs);
+            }
+
+            jack_nframes_t t = jack_nframes_t(wire);
+            if (int32_t(it.due - frame) < int32_t(t)) ++c.late;
+
+            jack_midi_data_t *evbuf = jbuf.event_reserve(t, len);
+            if (evbuf) {
+                std::copy(data, data + len, evbuf);
+                ++written;
+                wire += bytes * per_byte;
+            } else {
+                ++c.shed;
+            }
+
+            release(it);
+        }
+
+        wire_free = wire - nframes;
+        return written;
+    }
+
+protected:
+    enum Priority : uchar {
+        PRIO_REALTIME = 0, // clock, start/stop
+        PRIO_NOTE_OFF = 1,
+        PRIO_NOTE_ON  = 2,
+        PRIO_OTHER    = 3,
+        PRIO_CONTROL  = 4  // continuous controllers - thinned under pressure
+    };
+
+    struct Item {
+        jack::MidiMessage msg;
+        jack_nframes_t due;
+        uint32_t serial; // submission order for ties
+        uchar prio;
+        uint16_t long_off = 0; // long message bytes in long_bytes
+        uint16_t long_len = 0;
+        uint16_t wait_for = 0; // note-off: the ons_in of its note at submit
+    };
+
+    /// the item left the backlog (sent or shed). The long message space is
+    /// reused once no long message waits
+    void release(const Item &it) {
+        if (it.long_len && !--long_count) long_used = 0;
+
+        if (it.prio == PRIO_NOTE_ON && !it.long_len)
+            ++ons_out[it.msg.data[0] & 0x0F][it.msg.data[1] & NOTE_MAX];
+    }
+
+    static uchar priority(const jack::MidiMessage &msg) {
+        uchar st = msg.data[0];
+        if (st >= EV_MIDI_CLOCK) return PRIO_REALTIME;
+
+        switch (st & EV_CLEAR_CHAN_MASK) {
+        case EV_NOTE_OFF: return PRIO_NOTE_OFF;
+        case EV_NOTE_ON:  return msg.data[2] ? PRIO_NOTE_ON : PRIO_NOTE_OFF;
+        case EV_AFTERTOUCH:
+        case EV_CONTROL_CHANGE:
+        case EV_CHANNEL_PRESSURE:
+        case EV_PITCH_WHEEL: return PRIO_CONTROL;
+        default: return PRIO_OTHER;
+        }
+    }
+
+    /// a newer message of the same controller supersedes the older one
+    static bool same_control(const jack::MidiMessage &a, const jack::MidiMessage &b) {
+        if (a.data[0] != b.data[0]) return false;
+
+        switch (a.data[0] & EV_CLEAR_CHAN_MASK) {
+        case EV_AFTERTOUCH:
+        case EV_CONTROL_CHANGE: return a.data[1] == b.data[1];
+        case EV_CHANNEL_PRESSURE:
+        case EV_PITCH_WHEEL: return true;
+        default: return false;
+        }
+    }
+
+    // sooner served - by priority, then by due time, then by order
+    bool before(const Item &a, const Item &b) const {
+        if (a.prio != b.prio) return a.prio < b.prio;
+        int32_t d = int32_t(a.due - b.due);
+        if (d) return d < 0;
+        return int32_t(a.serial - b.serial) < 0;
+    }
+
+    /// a note-off must not overtake the note-ons of its note submitted
+    /// before it - it waits till as many of them left the backlog
+    bool blocked(size_t i) const {
+        const Item &it = backlog[i];
+        if (it.prio != PRIO_NOTE_OFF) return false;
+
+        uchar ch = it.msg.data[0] & 0x0F, note = it.msg.data[1] & NOTE_MAX;
+        return int16_t(ons_out[ch][note] - it.wait_for) < 0;
+    }
+
+    /// applies running status, returns the bytes the message takes on the wire
+    size_t encode(jack::MidiMessage &msg, bool rs) {
+        uchar st = msg.data[0];
+
+        // realtime messages can go anywhere, don't touch the running status
+        if (st >= EV_MIDI_CLOCK) return msg.len;
+
+        // system common cancels running status
+        if (st >= EV_SYSEX) {
+            running = 0;
+            return msg.len;
+        }
+
+        if (!rs) return msg.len;
+
+        // note-off as a zero velocity note-on continues a note-on run
+        if ((st & EV_CLEAR_CHAN_MASK) == EV_NOTE_OFF
+            && running == (EV_NOTE_ON | (st & 0x0F)))
+        {
+            msg.data[0] = running;
+            msg.data[2] = 0;
+            st = running;
+        }
+
+        size_t bytes = msg.len - (st == running ? 1 : 0);
+        running = st;
+        return bytes;
+    }
+
+    std::atomic<unsigned> baud = 0;
+    std::atomic<bool> rs_enabled = true;
+
+    std::atomic<jack_nframes_t> sample_rate = 48000;
+
+    // jack thread only
+    Item backlog[BACKLOG_SIZE];
+    size_t count = 0;
+    uint32_t serial = 0;
+    double wire_free = 0; // frames till the wire is free, from the period start
+    uchar running = 0;    // running status on the wire
+
+    // note-ons per channel and note that entered and left the backlog (wrap)
+    uint16_t ons_in[16][NOTE_MAX + 1]  = {};
+    uint16_t ons_out[16][NOTE_MAX + 1] = {};
+
+    uchar  long_bytes[LONG_SIZE];
+    size_t long_used  = 0;
+    size_t long_count = 0;
+};
@@ -28,6 +28,12 @@ public:
         return &tracks[num];
     }
 
+    /// index of the given track, MAX_TRACK if it's not ours
+    unsigned get_track_index(const Track *t) const {
+        if (t < tracks || t >= tracks + MAX_TRACK) return MAX_TRACK;
+        return unsigned(t - tracks);
+    }
+
 protected:
     // TODO: ID
     // TODO: Serialization
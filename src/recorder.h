@@ -0,0 +1,328 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <cmath>
+
+#include "common.h"
+#include "metrics.h"
+#include "router.h"
+#include "spsc.h"
+#include "transport.h"
+#include "sequencer.h"
+
+/** Live recording of the router input into a sequence.
+ *
+ * The jack thread only stamps the incoming notes with their tick position
+ * (relative to the start of the recording, not wrapped to the sequence
+ * length) and pushes them into a lock-free capture ring. A merger thread
+ * then pairs note-ons with note-offs, wraps the positions into the loop,
+ * quantizes and inserts the notes into the armed sequence in batches. The
+ * sequencer does not wait for the sequence while a batch goes in, it
+ * catches up with that track in the next period.
+ *
+ * Modes:
+ *  - overdub: recorded notes are added to the existing ones
+ *  - replace: whatever the play position passes while recording gets erased
+ *    (including the notes recorded on a previous loop pass)
+ */
+class Recorder : public Router::InputHandler {
+public:
+    enum Mode : uchar {
+        REC_OVERDUB = 0,
+        REC_REPLACE = 1
+    };
+
+    static constexpr size_t MAX_PENDING = 256; // input events per period
+    static constexpr size_t RING_SIZE   = 4096;
+    static constexpr auto   MERGE_INTERVAL = std::chrono::milliseconds(5);
+
+    Recorder(Sequencer &sequencer)
+        : sequencer(sequencer)
+        , ring(RING_SIZE)
+    {
+        ring.mlock();
+        merger = std::thread([this] { merge_loop(); });
+    }
+
+    Recorder(const Recorder &) = delete;
+    Recorder &operator=(const Recorder &) = delete;
+
+    ~Recorder() {
+        do_exit = true;
+        merger.join();
+    }
+
+    /** arms the sequence of the track for recording. Recording starts with
+     * the next period the transport runs in
+     */
+    void arm(unsigned track, Sequence *seq, Mode mode = REC_OVERDUB) {
+        armed_mode.store(mode, std::memory_order_relaxed);
+        armed_track.store(track, std::memory_order_relaxed);
+        armed.store(seq, std::memory_order_release);
+    }
+
+    /// stops recording. Notes still held get their note-off now
+    void disarm() { armed.store(nullptr, std::memory_order_release); }
+
+    bool is_armed() const { return armed.load(std::memory_order_acquire) != nullptr; }
+
+    /// quantization grid in ticks for the recorded note starts, 0 is off
+    void set_quantize(ticks grid) { quantize.store(std::max(grid, ticks(0))); }
+
+    ticks get_quantize() const { return quantize; }
+
+    void register_metrics(metrics::Registry &r, const std::string &prefix = "recorder") {
+        r.add(prefix + ".overruns", overruns);
+        r.add(prefix + ".notes",    notes);
+    }
+
+    // Router::InputHandler
+    void on_input(jack_nframes_t frame, const uchar *data, size_t size) override {
+        if (!recording && !armed.load(std::memory_order_relaxed)) return;
+        if (size != 3) return;
+
+        uchar status = data[0] & EV_CLEAR_CHAN_MASK;
+        if (status != EV_NOTE_ON && status != EV_NOTE_OFF) return;
+
+        if (pending_count >= MAX_PENDING) {
+            overruns.add();
+            return;
+        }
+
+        pending[pending_count++] = {frame, {data[0], data[1], data[2]}};
+    }
+
+    /** converts the input of this period to ticks and passes it to the
+     * merger. Call after the sequencer processed the window.
+     */
+    void process(const Transport::Window &w) {
+        Sequence *seq = armed.load(std::memory_order_acquire);
+        bool rec = seq && w.running;
+
+        if (recording && (!rec || seq != recorded)) {
+            // tell the merger to close the held notes and finish the batch
+            push({REC_STOP, to_rel(w.start), recorded, {}});
+            recording = false;
+        }
+
+        if (rec && !recording) {
+            unsigned track = armed_track.load(std::memory_order_relaxed);
+
+            // keep the phase of the loop if the armed sequence plays already
+            origin = sequencer.get_current(track) == seq
+                             ? sequencer.get_when_started(track)
+                             : w.first_tick();
+            recorded  = seq;
+            recording = true;
+            push({REC_START, to_rel(w.start), seq,
+                  {armed_mode.load(std::memory_order_relaxed)}});
+        }
+
+        if (recording) {
+            for (size_t i = 0; i < pending_count; ++i) {
+                const Pending &p = pending[i];
+                double off = double(jack_nframes_t(p.frame - w.frame));
+                push({REC_NOTE, to_rel(w.start + off / w.frames_per_tick),
+                      seq, {p.data[0], p.data[1], p.data[2]}});
+            }
+
+            // the play position, for replace mode erasing
+            push({REC_POSITION, to_rel(w.stop), seq, {}});
+        }
+
+        pending_count = 0;
+    }
+
+protected:
+    enum RecordType : uchar {
+        REC_START,    // data[0] is the mode
+        REC_NOTE,
+        REC_POSITION, // playback reached the tick
+        REC_STOP
+    };
+
+    /// a single entry in the capture ring
+    struct Record {
+        RecordType type;
+        ticks tick;    // relative to the recording origin, unwrapped
+        Sequence *seq; // the recorded sequence
+        uchar data[3];
+    };
+
+    struct Pending {
+        jack_nframes_t frame;
+        uchar data[3];
+    };
+
+    /// merger thread state of a note being held
+    struct Held {
+        bool on = false;
+        ticks start = 0;
+        uchar velocity = 0;
+    };
+
+    ticks to_rel(double t) const { return ticks(std::lround(t)) - origin; }
+
+    void push(const Record &r) {
+        if (!ring.push(r)) overruns.add();
+    }
+
+    // ======================== MERGER THREAD ==========================
+    void merge_loop() {
+        while (!do_exit) {
+            std::this_thread::sleep_for(MERGE_INTERVAL);
+
+            ring.consume([this](const Record *recs, size_t n) {
+                for (size_t i = 0; i < n; ++i) merge(recs[i]);
+            });
+
+            commit();
+        }
+    }
+
+    void merge(const Record &r) {
+        switch (r.type) {
+        case REC_START:
+            commit();
+            target = r.seq;
+            mode   = Mode(r.data[0]);
+            erased = r.tick;
+            for (auto &h : held) h.on = false;
+            break;
+
+        case REC_NOTE: {
+            if (!target) break;
+
+            uchar status = r.data[0] & EV_CLEAR_CHAN_MASK;
+            uchar note   = r.data[1] & NOTE_MAX;
+            Held &h = held[note];
+
+            if (status == EV_NOTE_ON && r.data[2] > 0) {
+                // retriggered without a note-off - end the previous one here
+                if (h.on) finish(note, r.tick);
+                h = {true, r.tick, r.data[2]};
+            } else if (h.on) {
+                finish(note, r.tick);
+            }
+            break;
+        }
+
+        case REC_POSITION:
+            if (target && mode == REC_REPLACE) erase(r.tick);
+            break;
+
+        case REC_STOP:
+            if (!target) break;
+
+            for (uchar n = 0; n <= NOTE_MAX; ++n)
+                if (held[n].on) finish(n, r.tick);
+
+            if (mode == REC_REPLACE) erase(r.tick);
+            commit();
+            target = nullptr;
+            break;
+        }
+    }
+
+    // pairs the note-off with its note-on
+    void finish(uchar note, ticks end) {
+        Held &h = held[note];
+        h.on = false;
+
+        ticks start = h.start;
+        ticks q = quantize.load();
+        if (q > 0) start = ((start + q / 2) / q) * q;
+
+        completed.push_back({start, std::max(end - h.start, ticks(1)),
+                             note, h.velocity});
+    }
+
+    // erases the sequence from the last erased position to the given one
+    void erase(ticks to) {
+        if (to <= erased) return;
+
+        ticks len = target->get_length();
+        if (len <= 0) return;
+
+        if (to - erased >= len) {
+            target->remove_range(0, len);
+        } else {
+            ticks a = ((erased % len) + len) % len;
+            ticks b = ((to % len) + len) % len;
+            if (a < b) {
+                target->remove_range(a, b);
+            } else {
+                target->remove_range(a, len);
+                target->remove_range(0, b);
+            }
+        }
+
+        erased = to;
+    }
+
+    /** inserts the completed notes into the sequence, wrapped into the loop.
+     * In replace mode only the notes the erasing went past are committed,
+     * otherwise they would get erased right after.
+     */
+    void commit() {
+        if (!target || completed.empty()) return;
+
+        ticks len = target->get_length();
+        if (len <= 0) return;
+
+        batch.clear();
+
+        auto keep = completed.begin();
+        for (auto it = completed.begin(); it != completed.end(); ++it) {
+            if (mode == REC_REPLACE && it->start >= erased) {
+                *keep++ = *it;
+                continue;
+            }
+
+            Sequence::Note n = *it;
+            n.start  = ((n.start % len) + len) % len;
+            n.length = std::min(n.length, len - n.start);
+            batch.push_back(n);
+        }
+
+        completed.erase(keep, completed.end());
+
+        if (batch.empty()) return;
+
+        target->add_notes(batch);
+        notes.add(batch.size());
+    }
+
+    Sequencer &sequencer;
+
+    // UI thread writes, jack thread reads
+    std::atomic<Sequence *> armed = nullptr;
+    std::atomic<unsigned> armed_track = 0;
+    std::atomic<Mode> armed_mode = REC_OVERDUB;
+    std::atomic<ticks> quantize = 0;
+
+    // jack thread only
+    Pending pending[MAX_PENDING];
+    size_t pending_count = 0;
+    bool recording = false;
+    Sequence *recorded = nullptr;
+    ticks origin = 0;
+
+    SpscQueue<Record> ring;
+
+    // merger thread only
+    Sequence *target = nullptr;
+    Mode mode = REC_OVERDUB;
+    ticks erased = 0; // replace mode - erased up to this relative tick
+    Held held[NOTE_MAX + 1];
+    std::vector<Sequence::Note> completed, batch;
+
+    std::atomic<bool> do_exit = false;
+    std::thread merger;
+
+    metrics::Counter overruns;
+    metrics::Counter notes; // committed notes
+};
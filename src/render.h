@@ -0,0 +1,155 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "common.h"
+#include "jackmidi.h"
+#include "project.h"
+#include "router.h"
+#include "transport.h"
+#include "sequencer.h"
+#include "smf.h"
+
+/** Renders a project offline, faster than realtime. Runs the same Transport
+ * and Sequencer as the live playback, but the periods are driven by a
+ * simulated frame clock and the output is captured instead of being sent
+ * to jack. Needs no jack server.
+ *
+ * Usage: schedule sequences via get_sequencer(), then render() and
+ * write_smf().
+ */
+class OfflineRenderer : public MidiSink {
+public:
+    /// one captured message with its tick position
+    struct Captured {
+        ticks tick;
+        unsigned track;
+        jack::MidiMessage msg;
+        std::vector<uchar> sysex; // the whole message for sysex, msg unused
+    };
+
+    OfflineRenderer(Project &project,
+                    jack_nframes_t sample_rate = 48000,
+                    jack_nframes_t period = 256)
+        : project(project)
+        , sample_rate(sample_rate)
+        , period(period)
+        , transport(project)
+        , sequencer(project, *this)
+    {}
+
+    OfflineRenderer(const OfflineRenderer &) = delete;
+    OfflineRenderer &operator=(const OfflineRenderer &) = delete;
+
+    Sequencer &get_sequencer() { return sequencer; }
+    Transport &get_transport() { return transport; }
+
+    /** renders from tick 0 up to given length. Notes playing at the end get
+     * their note-offs at the end position.
+     */
+    void render(ticks length) {
+        captured.clear();
+        transport.start();
+
+        do {
+            run_period();
+        } while (window.stop < length);
+
+        transport.stop();
+        run_period();
+        end = std::max(length, ticks(std::ceil(window.start)));
+
+        // the grooved and effect delayed events past the last window - the
+        // smf would have notes without note-offs otherwise
+        sequencer.flush();
+
+        // immediate events are stamped with window start, keep them in order
+        std::stable_sort(captured.begin(), captured.end(),
+                         [](const Captured &a, const Captured &b) {
+                             return a.tick < b.tick;
+                         });
+    }
+
+    const std::vector<Captured> &get_events() const { return captured; }
+
+    /// note-ons of the last render left without a note-off - 0 unless broken
+    unsigned hanging_notes() const {
+        unsigned sounding[16][NOTE_MAX + 1] = {};
+
+        for (const auto &c : captured) {
+            if (!c.sysex.empty()) continue;
+
+            uchar status = c.msg.data[0] & EV_CLEAR_CHAN_MASK;
+            unsigned &n  = sounding[c.msg.data[0] & 0x0F][c.msg.data[1] & NOTE_MAX];
+
+            if (status == EV_NOTE_ON && c.msg.data[2] > 0)
+                ++n;
+            else if ((status == EV_NOTE_OFF || status == EV_NOTE_ON) && n)
+                --n;
+        }
+
+        unsigned res = 0;
+        for (auto &ch : sounding)
+            for (unsigned n : ch) res += n;
+        return res;
+    }
+
+    /// writes the last render as a Standard MIDI File
+    void write_smf(const std::string &path) const {
+        SmfWriter smf(project.get_bpm());
+
+        for (const auto &c : captured) {
+            if (c.sysex.empty())
+                smf.add_event(c.tick, c.msg.data, c.msg.len);
+            else
+                smf.add_sysex(c.tick, c.sysex.data(), c.sysex.size());
+        }
+
+        smf.write(path, end);
+    }
+
+    // MidiSink
+    bool queue_immediate(unsigned track, jack::MidiMessage msg) override {
+        captured.push_back({window.first_tick(), track, msg});
+        return true;
+    }
+
+    bool queue_event(unsigned track, const jack::MidiMessage &msg) override {
+        captured.push_back({frame_to_tick(msg.time), track, msg});
+        return true;
+    }
+
+    bool queue_sysex(unsigned track, jack_nframes_t time,
+                     const uchar *data, size_t size) override
+    {
+        captured.push_back({frame_to_tick(time), track, {},
+                            std::vector<uchar>(data, data + size)});
+        return true;
+    }
+
+protected:
+    ticks frame_to_tick(jack_nframes_t time) const {
+        double off = double(jack_nframes_t(time - window.frame));
+        return ticks(std::lround(window.start + off / window.frames_per_tick));
+    }
+
+    void run_period() {
+        window = transport.advance(frame, period, sample_rate);
+        sequencer.process(window);
+        frame += period;
+    }
+
+    Project &project;
+    jack_nframes_t sample_rate;
+    jack_nframes_t period;
+    jack_nframes_t frame = 0; // simulated frame clock
+
+    Transport transport;
+    Sequencer sequencer;
+    Transport::Window window;
+
+    std::vector<Captured> captured;
+    ticks end = 0;
+};
@@ -1,121 +1,472 @@
 #pragma once
 
 #include <iostream>
+#include <atomic>
+#include <mutex>
 
 #include "jackmidi.h"
+#include "project.h"
+#include "metrics.h"
+#include "pacing.h"
+#include "trace.h"
 
-/// midi event router/scheduler. Connects to specified output port for midi output
-/// receives midi events with/without time markings to be output there.
-class Router {
+/// receiver of scheduled midi messages - the router for live playback,
+/// or anything capturing the output (offline rendering)
+struct MidiSink {
+    /// queues an event from a track to be immediately output
+    virtual bool queue_immediate(unsigned track, jack::MidiMessage msg) = 0;
+
+    /// queues event from a track to be output in time specified in the msg.time
+    virtual bool queue_event(unsigned track, const jack::MidiMessage &msg) = 0;
+
+    /// same as queue_event, for messages of any length (sysex)
+    virtual bool queue_sysex(unsigned track, jack_nframes_t time,
+                             const uchar *data, size_t size) = 0;
+};
+
+/// midi event router/scheduler. Owns the output ports and a routing table
+/// mapping tracks to (output port, midi channel) destinations. Receives midi
+/// events with/without time markings to be output there.
+class Router : public MidiSink {
 public:
     static constexpr size_t RINGBUFFER_SIZE = 1024 * sizeof(jack::MidiMessage);
+    static constexpr size_t MAX_INPUT_HANDLERS = 8;
+    static constexpr unsigned MAX_OUTPUTS = 16; // port index fits in a nibble
+    static constexpr unsigned MAX_FANOUT  = 7;  // destinations per track
+
+    /// implement in a class listening to the midi input port.
+    /// @note called from the jack thread, has to be realtime safe
+    struct InputHandler {
+        /// frame is the absolute frame time of the event
+        virtual void on_input(jack_nframes_t frame, const uchar *data,
+                              size_t size) = 0;
+    };
+
+    /// single destination of a track's events
+    struct Destination {
+        uchar port;    // output index (see add_output)
+        uchar channel; // 0-15
+    };
+
+    /** Destinations of a single track, packed into one 64 bit word so it can
+     * be swapped atomically. Byte 0 is the count, the rest are destinations
+     * (port << 4 | channel).
+     */
+    class Route {
+    public:
+        Route() = default;
+
+        Route(std::initializer_list<Destination> l) {
+            for (const auto &d : l) add(d);
+        }
+
+        bool add(Destination d) {
+            unsigned n = size();
+            if (n >= MAX_FANOUT) return false;
+            bits |= uint64_t((d.port & 0x0F) << 4 | (d.channel & 0x0F)) << (8 * (n + 1));
+            bits = (bits & ~uint64_t(0xFF)) | (n + 1);
+            return true;
+        }
+
+        unsigned size() const { return bits & 0xFF; }
+
+        Destination get(unsigned i) const {
+            uchar b = (bits >> (8 * (i + 1))) & 0xFF;
+            return {uchar(b >> 4), uchar(b & 0x0F)};
+        }
+
+        uint64_t get_bits() const { return bits; }
+        static Route from_bits(uint64_t b) { Route r; r.bits = b; return r; }
 
-    Router(jack::Client &client, const char *output_name = nullptr)
+    protected:
+        uint64_t bits = 0;
+    };
+
+    Router(backend::Backend &client, const char *output_name = nullptr)
             : client(client)
-            , inport(client, "router::in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput)
-            , outport(client, "router::out", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput)
-            , immediate_events(RINGBUFFER_SIZE)
-            , queued_events(RINGBUFFER_SIZE)
+            , inport(client.register_port("router::in", backend::Backend::PORT_INPUT))
     {
         // TODO: connect the input port(s) to get midi keyboard support
-        if (output_name) outport.connect_to(output_name);
-        immediate_events.mlock();
-        queued_events.mlock();
+        add_output("router::out");
+        if (output_name) outputs[0].port->connect_to(output_name);
+
+        // default - every track goes to the first port, channel == track
+        for (unsigned t = 0; t < Project::MAX_TRACK; ++t)
+            set_route(t, {{0, uchar(t)}});
+    }
+
+    /** registers a new output port. Can be called while running (not from
+     * the jack thread). Returns the port index or -1 if no more ports can be
+     * added.
+     */
+    int add_output(const std::string &name) {
+        std::scoped_lock<std::mutex> l(outputs_mtx);
+        unsigned n = output_count.load(std::memory_order_relaxed);
+        if (n >= MAX_OUTPUTS) return -1;
+
+        Output &o = outputs[n];
+        o.port = client.register_port(name.c_str(), backend::Backend::PORT_OUTPUT);
+        o.immediate_events = std::make_unique<jack::RingBuffer>(RINGBUFFER_SIZE);
+        o.queued_events    = std::make_unique<jack::RingBuffer>(RINGBUFFER_SIZE);
+        o.thru_events      = std::make_unique<jack::RingBuffer>(RINGBUFFER_SIZE);
+        o.immediate_events->mlock();
+        o.queued_events->mlock();
+        o.thru_events->mlock();
+
+        // publish the port to the jack thread
+        output_count.store(n + 1, std::memory_order_release);
+        return n;
+    }
+
+    unsigned get_output_count() const { return output_count; }
+
+    backend::Port *get_output(unsigned idx) {
+        if (idx >= output_count) return nullptr;
+        return outputs[idx].port.get();
+    }
+
+    /// replaces all destinations of a track
+    void set_route(unsigned track, const Route &r) {
+        if (track >= Project::MAX_TRACK) return;
+        routes[track].store(r.get_bits(), std::memory_order_release);
     }
 
+    /// adds another destination to a track (fan-out)
+    bool add_destination(unsigned track, Destination d) {
+        if (track >= Project::MAX_TRACK) return false;
+        Route r = get_route(track);
+        if (!r.add(d)) return false;
+        set_route(track, r);
+        return true;
+    }
+
+    Route get_route(unsigned track) const {
+        if (track >= Project::MAX_TRACK) return {};
+        return Route::from_bits(routes[track].load(std::memory_order_acquire));
+    }
+
+    /** registers a listener for the input port events.
+     * @note not thread safe, call before activating the jack client
+     */
+    bool add_input_handler(InputHandler &h) {
+        if (input_handler_count >= MAX_INPUT_HANDLERS) return false;
+        input_handlers[input_handler_count++] = &h;
+        return true;
+    }
+
+    /** traces the input and output messages (when the tracer is started).
+     * @note not thread safe, call before activating the jack client
+     */
+    void set_tracer(Tracer *t) { tracer = t; }
+
     void process(jack_nframes_t nframes) {
-        /// ======================== INTPUT ==========================
-        // TODO: Process the input here.
-        jack::MidiBuffer buf = inport.get_midi_buffer(nframes);
+        process_input(nframes);
+        process_output(nframes);
+    }
+
+    /// ======================== INTPUT ==========================
+    void process_input(jack_nframes_t nframes) {
+        backend::MidiBuffer &buf = inport->get_midi_buffer(nframes);
 
-        int nevents = buf.get_event_count();
+        uint32_t nevents = buf.get_event_count();
 
-        for (int n = 0; n < nevents; ++n) {
+        jack_nframes_t last_frame_time = client.last_frame_time();
+        period_nframes = nframes;
+
+        for (uint32_t n = 0; n < nevents; ++n) {
             jack_midi_event_t ev;
             buf.get_event(ev, n);
-            // TODO: process the event!
-        }
 
-        /// ======================== OUTPUT ==========================
-        jack::MidiBuffer jbuf = outport.get_midi_buffer(nframes);
-        jbuf.clear();
+            if (tracer)
+                tracer->trace(Tracer::TR_INPUT, last_frame_time + ev.time,
+                              Tracer::NO_PORT, Tracer::NO_TRACK, ev.buffer, ev.size);
 
+            for (size_t h = 0; h < input_handler_count; ++h)
+                input_handlers[h]->on_input(last_frame_time + ev.time,
+                                            ev.buffer, ev.size);
+        }
+    }
+
+    /// ======================== OUTPUT ==========================
+    void process_output(jack_nframes_t nframes) {
         jack_nframes_t last_frame_time = client.last_frame_time();
+        unsigned count = output_count.load(std::memory_order_acquire);
+
+        long immediate = 0, queued = 0, written = 0;
+
+        // every port drains its own queues, so they don't hold each other up
+        for (unsigned o = 0; o < count; ++o) {
+            Output &out = outputs[o];
+            backend::MidiBuffer &jbuf = out.port->get_midi_buffer(nframes);
+            jbuf.clear();
 
-        // iterate all available Midi messages in the immediate ringbuffer
-        output_events(jbuf, immediate_events, nframes, last_frame_time);
-        // and also in the queued ringbuffer
-        output_events(jbuf, queued_events, nframes, last_frame_time);
+            immediate += out.immediate_events->read_space();
+            queued    += out.queued_events->read_space();
+
+            // immediate first on ties - those were requested sooner
+            jack::RingBuffer *sources[] = {out.immediate_events.get(),
+                                           out.thru_events.get(),
+                                           out.queued_events.get()};
+            written += output_events(o, jbuf, sources, nframes, last_frame_time,
+                                     out.pacer.is_active() ? &out.pacer : nullptr);
+        }
+
+        stats.immediate_fill.set(immediate);
+        stats.queued_fill.set(queued);
+        stats.period_messages.set(written);
     }
 
-    void output_events(jack::MidiBuffer &jbuf,
-                       jack::RingBuffer &rb,
-                       jack_nframes_t nframes,
-                       jack_nframes_t last_frame_time)
+    /** Merges the time-ordered rings by frame time into the port buffer.
+     * jack needs non-decreasing times, so a message due sooner than the one
+     * already written (a late one) is moved to the last written time and
+     * counted as reordered. Returns the number of messages written.
+     *
+     * The rings hold length-prefixed records, the message bytes are read
+     * straight into the reserved jack event. Bandwidth limited ports pass
+     * the merged messages through the pacer, which decides when they
+     * actually go out.
+     */
+    template<size_t N>
+    unsigned output_events(unsigned port,
+                           backend::MidiBuffer &jbuf,
+                           jack::RingBuffer *(&sources)[N],
+                           jack_nframes_t nframes,
+                           jack_nframes_t last_frame_time,
+                           MidiPacer *pacer = nullptr)
     {
-        while (rb.read_space()) {
-            jack::MidiMessage msg;
-            size_t read = rb.peek((char *)&msg, sizeof(msg));
-
-            if (read != sizeof(msg)) {
-                // TODO: report problem!
-                rb.read_advance(read);
-                continue;
-            }
+        jack::RingBuffer::Record heads[N];
+        jack_nframes_t times[N];
+        bool due[N];
+
+        for (size_t i = 0; i < N; ++i)
+            due[i] = peek_due(*sources[i], heads[i], times[i], nframes, last_frame_time);
 
-            // if the time of the event is out of this window, break out of the loop
-            int t = msg.time + nframes - last_frame_time;
+        jack_nframes_t last_t = 0;
+        unsigned written = 0;
 
-            // sometimes we have an event queued that should already be out?!
-            if (t < 0) t = 0;
-            if (t >= nframes) break;
+        while (true) {
+            int best = -1;
 
-            // skip the read bytes now
-            rb.read_advance(read);
+            for (size_t i = 0; i < N; ++i) {
+                if (due[i] && (best < 0 || times[i] < times[best]))
+                    best = i;
+            }
+
+            if (best < 0) break;
 
-            jack_midi_data_t *evbuf = jbuf.event_reserve(t, 3);
+            jack::RingBuffer &rb = *sources[best];
+            const jack::RingBuffer::Record &rec = heads[best];
+            jack_nframes_t t = times[best];
 
-            if (evbuf) {
-                // TODO: add debug event logging here
-                std::copy(std::begin(msg.data), std::end(msg.data), evbuf);
+            if (pacer) {
+                if (rec.len <= 3) {
+                    jack::MidiMessage msg;
+                    msg.len = rec.len;
+                    rb.read_record(rec, msg.data);
+                    pacer->submit(msg, last_frame_time + t, counts);
+                    trace(Tracer::TR_PACED, last_frame_time + t, port, rec, msg.data);
+                } else if (uchar *buf = pacer->submit_long(rec.len, last_frame_time + t, counts)) {
+                    rb.read_record(rec, buf);
+                    trace(Tracer::TR_PACED, last_frame_time + t, port, rec, buf);
+                } else {
+                    rb.skip_record(rec);
+                }
             } else {
-                // TODO: report underrun/not enough space
+                Tracer::Kind kind = Tracer::TR_OUTPUT;
+
+                if (t < last_t) {
+                    t = last_t;
+                    stats.reordered.add();
+                    kind = Tracer::TR_REORDERED;
+                }
+
+                jack_midi_data_t *evbuf = jbuf.event_reserve(t, rec.len);
+
+                if (evbuf) {
+                    rb.read_record(rec, evbuf);
+                    trace(kind, last_frame_time + t, port, rec, evbuf);
+                    last_t = t;
+                    ++written;
+                } else {
+                    rb.skip_record(rec);
+                    trace(Tracer::TR_DROPPED, last_frame_time + t, port, rec, nullptr);
+                    stats.dropped.add();
+                }
             }
+
+            due[best] = peek_due(rb, heads[best], times[best],
+                                 nframes, last_frame_time);
+        }
+
+        if (pacer) {
+            written += pacer->emit(jbuf, last_frame_time, nframes, counts);
+
+            if (counts.late)    stats.late.add(counts.late);
+            if (counts.thinned) stats.thinned.add(counts.thinned);
+            if (counts.shed)    stats.shed.add(counts.shed);
+            counts = {};
         }
+
+        return written;
+    }
+
+    /** limits the output port to given bandwidth (MidiPacer::MIDI_BAUD for
+     * DIN ports), 0 is unlimited. Use for ports ending in hardware midi.
+     */
+    void set_bandwidth(unsigned port, unsigned baud, bool running_status = true) {
+        if (port >= output_count) return;
+        outputs[port].pacer.set_bandwidth(baud, client.sample_rate(), running_status);
+    }
+
+    /// counters of the problems encountered while routing
+    struct Stats {
+        metrics::Counter dropped;   // no space in the port buffer
+        metrics::Counter reordered; // late, moved to keep order
+        metrics::Counter overruns;  // queue was full
+        metrics::Gauge   immediate_fill; // bytes waiting, over all ports
+        metrics::Gauge   queued_fill;
+        metrics::Gauge   period_messages; // messages written last period
+        metrics::Counter late;    // held back by the bandwidth limit
+        metrics::Counter thinned; // controller values superseded
+        metrics::Counter shed;    // dropped by the bandwidth limit
+    };
+
+    const Stats &get_stats() const { return stats; }
+
+    void register_metrics(metrics::Registry &r, const std::string &prefix = "router") {
+        r.add(prefix + ".dropped",         stats.dropped);
+        r.add(prefix + ".reordered",       stats.reordered);
+        r.add(prefix + ".overruns",        stats.overruns);
+        r.add(prefix + ".immediate_fill",  stats.immediate_fill);
+        r.add(prefix + ".queued_fill",     stats.queued_fill);
+        r.add(prefix + ".period_messages", stats.period_messages);
+        r.add(prefix + ".late",            stats.late);
+        r.add(prefix + ".thinned",         stats.thinned);
+        r.add(prefix + ".shed",            stats.shed);
     }
 
     // queues an event to be immediately output
     // the copy in the param is here by design, we modify the timing of the event
-    bool queue_immediate(jack::MidiMessage msg) {
+    bool queue_immediate(unsigned track, jack::MidiMessage msg) override {
         // immediate send - use current frame time
         msg.time = client.frame_time();
 
-        if (immediate_events.write_space() < sizeof(msg)) {
-            // TODO: report overruns
-            return false;
-        }
-
-        immediate_events.write(reinterpret_cast<const char*>(&msg), sizeof(msg));
-        return true;
+        return dispatch(track, msg, &Output::immediate_events);
     }
 
     /** queues event to be output in time specified in the msg.time
      *  @note the msg.time has to be set relative to client.last_frame_time
      *  @note queued events have to be ordered by time
      */
-    bool queue_event(const jack::MidiMessage &msg) {
-        if (queued_events.write_space() < sizeof(msg)) {
-            // TODO: report overruns
-            return false;
-        }
+    bool queue_event(unsigned track, const jack::MidiMessage &msg) override {
+        return dispatch(track, msg, &Output::queued_events);
+    }
 
-        queued_events.write(reinterpret_cast<const char*>(&msg), sizeof(msg));
-        return true;
+    /** queues a message of any length (sysex) the same way as queue_event.
+     * The bytes are sent as they are, without changing the channel.
+     */
+    bool queue_sysex(unsigned track, jack_nframes_t time,
+                     const uchar *data, size_t size) override
+    {
+        return for_destinations(track, &Output::queued_events,
+                                [&](jack::RingBuffer &rb, Destination) {
+                                    return rb.write_record(time, data, size, track);
+                                });
+    }
+
+    /** queues an input event to be output in the current period, at the
+     * same frame it came in (zero latency thru).
+     * @note only callable from an InputHandler (jack thread)
+     */
+    bool queue_thru(unsigned track, jack::MidiMessage msg, jack_nframes_t frame) {
+        // output shifts queued events by one period, cancel that out
+        msg.time = frame - period_nframes;
+        return dispatch(track, msg, &Output::thru_events);
     }
 
 protected:
-    jack::Client &client;
-    jack::Port inport;
-    jack::Port outport;
-    jack::RingBuffer immediate_events, queued_events;
+    /** reads the head message of the ring without consuming it. Returns
+     * false if the ring is empty or the message is not due in this period.
+     */
+    bool peek_due(jack::RingBuffer &rb, jack::RingBuffer::Record &rec,
+                  jack_nframes_t &t, jack_nframes_t nframes,
+                  jack_nframes_t last_frame_time)
+    {
+        // a record still being written counts as not there yet
+        if (!rb.peek_record(rec)) return false;
+
+        // if the time of the event is out of this window, stop here
+        int rel = rec.time + nframes - last_frame_time;
+
+        // sometimes we have an event queued that should already be out?!
+        if (rel < 0) rel = 0;
+        if (jack_nframes_t(rel) >= nframes) return false;
+
+        t = rel;
+        return true;
+    }
+
+    void trace(Tracer::Kind kind, jack_nframes_t frame, unsigned port,
+               const jack::RingBuffer::Record &rec, const uchar *data)
+    {
+        if (tracer) tracer->trace(kind, frame, port, rec.tag, data, rec.len);
+    }
+
+    struct Output {
+        std::unique_ptr<backend::Port> port;
+        std::unique_ptr<jack::RingBuffer> immediate_events, queued_events;
+        std::unique_ptr<jack::RingBuffer> thru_events; // jack thread only
+        MidiPacer pacer;
+    };
+
+    using Queue = std::unique_ptr<jack::RingBuffer> Output::*;
+
+    /// writes the message to all the destinations of the track
+    bool dispatch(unsigned track, jack::MidiMessage msg, Queue queue) {
+        return for_destinations(track, queue, [&](jack::RingBuffer &rb, Destination d) {
+            // channel messages get the channel of the destination
+            if (msg.data[0] < EV_SYSEX)
+                msg.data[0] = (msg.data[0] & EV_CLEAR_CHAN_MASK) | d.channel;
+
+            return rb.write_record(msg, track);
+        });
+    }
+
+    /// calls write(ring, destination) for all the destinations of the track
+    template<typename WriteT>
+    bool for_destinations(unsigned track, Queue queue, WriteT write) {
+        if (track >= Project::MAX_TRACK) return false;
+
+        Route r = Route::from_bits(routes[track].load(std::memory_order_acquire));
+        unsigned count = output_count.load(std::memory_order_acquire);
+        bool ok = true;
+
+        for (unsigned i = 0; i < r.size(); ++i) {
+            Destination d = r.get(i);
+            if (d.port >= count) continue;
+
+            if (!write(*(outputs[d.port].*queue), d)) {
+                stats.overruns.add();
+                ok = false;
+            }
+        }
+
+        return ok;
+    }
+
+    backend::Backend &client;
+    std::unique_ptr<backend::Port> inport;
+
+    std::mutex outputs_mtx; // serializes add_output
+    Output outputs[MAX_OUTPUTS];
+    std::atomic<unsigned> output_count = 0;
+    std::atomic<uint64_t> routes[Project::MAX_TRACK];
+
+    InputHandler *input_handlers[MAX_INPUT_HANDLERS] = {};
+    Tracer *tracer = nullptr;
+    jack_nframes_t period_nframes = 0; // of the period being processed
+    MidiPacer::Counts counts;          // pacer results, jack thread only
+    size_t input_handler_count = 0;
+
+    Stats stats;
 };
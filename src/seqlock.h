@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <type_traits>
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+
+/** Single writer snapshot of a small trivially copyable record. The writer
+ * never waits, the readers retry while a write is in progress. Meant for
+ * the jack thread publishing its state to the UI thread.
+ *
+ * The record is kept in atomic words, so the torn reads the sequence
+ * counter throws away are not data races.
+ */
+template<typename T>
+class SeqLock {
+public:
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "SeqLock only holds trivially copyable records");
+
+    SeqLock() { store(T{}); }
+
+    SeqLock(const SeqLock &) = delete;
+    SeqLock &operator=(const SeqLock &) = delete;
+
+    /// the writer thread only
+    void store(const T &val) {
+        uint64_t buf[WORDS] = {};
+        std::memcpy(buf, &val, sizeof(T));
+
+        unsigned s = seq.load(std::memory_order_relaxed);
+        seq.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        for (size_t i = 0; i < WORDS; ++i)
+            words[i].store(buf[i], std::memory_order_relaxed);
+
+        seq.store(s + 2, std::memory_order_release);
+    }
+
+    T load() const {
+        uint64_t buf[WORDS];
+        unsigned s1, s2;
+
+        do {
+            s1 = seq.load(std::memory_order_acquire);
+
+            for (size_t i = 0; i < WORDS; ++i)
+                buf[i] = words[i].load(std::memory_order_relaxed);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            s2 = seq.load(std::memory_order_relaxed);
+        } while ((s1 & 1) || s1 != s2);
+
+        T val;
+        std::memcpy(&val, buf, sizeof(T));
+        return val;
+    }
+
+protected:
+    static constexpr size_t WORDS = (sizeof(T) + 7) / 8;
+
+    std::atomic<unsigned> seq = 0; // odd while writing
+    std::atomic<uint64_t> words[WORDS];
+};
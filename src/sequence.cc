@@ -20,6 +20,64 @@ void Sequence::add_note(ticks start, ticks length, uchar note, uchar velocity) {
     _tidy();
 }
 
+void Sequence::add_notes(const std::vector<Note> &notes) {
+    // scope-lock the sequence
+    lock l(mtx);
+
+    for (const auto &n : notes)
+        _add_note(n.start, n.length, n.note, n.velocity);
+
+    _tidy();
+}
+
+void Sequence::replace_notes(ticks len, const std::vector<Note> &notes) {
+    // scope-lock the sequence
+    lock l(mtx);
+
+    _unmark_all();
+
+    for (auto &e : events) {
+        if (e.is_note_on()) {
+            e.mark();
+
+            if (e.is_linked())
+                e.get_link()->mark();
+        }
+    }
+
+    _remove_marked();
+
+    length = len;
+
+    for (const auto &n : notes)
+        _add_note(n.start, n.length, n.note, n.velocity);
+
+    _tidy();
+}
+
+void Sequence::remove_range(ticks start, ticks end) {
+    // scope-lock the sequence
+    lock l(mtx);
+
+    // marks are only meaningful within one locked operation
+    _unmark_all();
+
+    for (auto &e : events) {
+        if (e.is_note_on() &&
+            e.get_ticks() >= start &&
+            e.get_ticks() < end)
+        {
+            e.mark();
+
+            if (e.is_linked())
+                e.get_link()->mark();
+        }
+    }
+
+    _remove_marked();
+    _tidy();
+}
+
 void Sequence::mark_range(ticks start, ticks end, uchar note_low,
                           uchar note_hi)
 {
@@ -145,6 +203,19 @@ uchar Sequence::get_average_velocity() {
     return 0;
 }
 
+void Sequence::copy_from(const Sequence &other) {
+    if (&other == this) return;
+
+    std::scoped_lock l(mtx, other.mtx);
+
+    events = other.events;
+    length = other.length;
+    flags  = other.flags;
+
+    // the links point into the other sequence
+    _tidy();
+}
+
 bool Sequence::is_empty() const {
     lock l(mtx);
     return events.begin() == events.end();
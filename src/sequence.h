@@ -2,6 +2,7 @@
 
 #include <mutex>
 #include <list>
+#include <vector>
 #include <functional>
 
 #include "event.h"
@@ -25,6 +26,22 @@ public:
     void add_note(ticks start, ticks length, uchar note,
                   uchar velocity = DEFAULT_VELOCITY);
 
+    struct Note {
+        ticks start;
+        ticks length;
+        uchar note;
+        uchar velocity;
+    };
+
+    // adds a batch of notes under a single lock (recording)
+    void add_notes(const std::vector<Note> &notes);
+
+    // replaces all the notes and the length under a single lock (capture)
+    void replace_notes(ticks len, const std::vector<Note> &notes);
+
+    // removes all notes starting in the time range
+    void remove_range(ticks start, ticks end);
+
     // marks a specified note(s) from the sequence - by window (unmarks all first)
     void mark_range(ticks start, ticks end, uchar note_low, uchar note_hi);
 
@@ -34,6 +51,9 @@ public:
     // removes marked notes
     void remove_marked();
 
+    // replaces the contents with a copy of the other sequence
+    void copy_from(const Sequence &other);
+
     // sets note length for marked range
     void set_note_lengths(ticks l);
 
@@ -60,12 +80,18 @@ public:
         handle(Sequence &s) : s(s), l(s.mtx) {
         }
 
+        // does not wait for the lock - check locked()
+        handle(Sequence &s, std::try_to_lock_t t) : s(s), l(s.mtx, t) {
+        }
+
         handle(handle &&h) : s(h.s), l(std::move(h.l)) {
         }
 
         const_iterator begin() const { return s.events.begin(); }
         const_iterator end()   const { return s.events.end(); }
 
+        bool locked() const { return l.owns_lock(); }
+
         Sequence &s;
         lock l;
     };
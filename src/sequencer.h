@@ -1,12 +1,16 @@
 #pragma once
 
 #include <atomic>
+#include <bitset>
 
 #include "common.h"
 #include "util.h"
 #include "jackmidi.h"
 #include "project.h"
 #include "router.h"
+#include "transport.h"
+#include "seqlock.h"
+#include "metrics.h"
 
 /// helper class that wraps all needed data to walk a sequence and schedule notes
 struct SequenceWalker {
@@ -17,6 +21,14 @@ struct SequenceWalker {
         , iter(handle.begin())
     {}
 
+    // does not wait for the sequence lock - check handle.locked()
+    SequenceWalker(unsigned track, Sequence &seq, ticks start, std::try_to_lock_t t)
+        : track(track)
+        , start(start)
+        , handle(seq, t)
+        , iter(handle.begin())
+    {}
+
     // absolute time ticks (offset by the when_started field of the track)
     ticks get_ticks() {
         if (iter != handle.end())
@@ -45,10 +57,21 @@ struct SequenceWalker {
 /** this acts like streamer for the project whilst it plays
  *  and it feeds router with events to be played.
  */
-class Sequencer : public jack::Client::Callback {
+class Sequencer {
 public:
-    Sequencer(Project &proj, Router &r, jack::Client &client)
-            : project(proj), router(r), client(client)
+    static constexpr ticks NO_CHANGE = -1; // when_change value - nothing scheduled
+
+    using NoteSet = std::bitset<NOTE_MAX + 1>;
+
+    /// what a track plays, published for the UI once per period
+    struct PlayState {
+        const Sequence *sequence = nullptr; // to compare with, not to touch
+        ticks position = 0; // ticks into the sequence
+        NoteSet notes;      // sounding right now
+    };
+
+    Sequencer(Project &proj, MidiSink &r)
+            : project(proj), router(r)
     {
     }
 
@@ -73,33 +96,53 @@ public:
         return false;
     }
 
-    int process(jack_nframes_t nframes) override {
-        auto last_frames = client.last_frame_time();
+    /// schedules all notes for the given transport window
+    void process(const Transport::Window &w) {
+        frame = w.frame;
+
+        if (w.located) relocate(ticks(w.start) - ticks(w.locate_from));
+
+        if (w.stopped) {
+            for (unsigned t = 0; t < Project::MAX_TRACK; ++t)
+                all_notes_off(t);
+        }
 
-        auto strt_us = client.frames_to_time(last_frames);
-        auto end_us = client.frames_to_time(last_frames + nframes);
+        if (!w.running) {
+            if (w.stopped) publish_play_states(false);
+            return;
+        }
 
         // calculate current tick window
-        ticks last_ticks = current_ticks;
-        ticks w_start = us_to_ticks(strt_us, project.get_bpm());
+        ticks w_start = w.first_tick();
+        ticks w_stop  = w.end_tick();
         current_ticks = w_start;
-        ticks w_stop = us_to_ticks(end_us, project.get_bpm());
 
         // TODO: Handle XRun
 
-        if (current_ticks != last_ticks) {
-            swap_sequences();
+        if (w_stop > w_start) {
+            swap_sequences(w_stop);
 
             // TODO: May revise that and remember note-off time for all notes, and
             // schedule those out of scope of the current track selection.
             // This would enable us to have out-of sequence note ends that would be
             // still valid and properly scheduled.
 
+            // we lock all the track's sequences here and gain iterators. They
+            // stay locked till the held events are released - sysex events
+            // reference the bytes stored in the sequences
+            auto walkers = lock_all_tracks(w_start);
+
             // last step - schedule notes on the current set of active track's sequences
-            schedule_notes(w_start, w_stop);
+            schedule_notes(walkers, w_start, w_stop);
+
+            // time driven effects (arpeggiator) run till the end of the window
+            advance_effects(w_stop);
+
+            // grooved events that fall into this window get sent to router
+            release_held(w, w_stop);
         }
 
-        return 0;
+        publish_play_states(true);
     }
 
     // stops all playback immediately and unconditionally (well... it will be
@@ -125,52 +168,120 @@ public:
         }
     }
 
+    /// the sequence playing on the track. @note jack thread only
+    Sequence *get_current(unsigned track) const {
+        if (track >= Project::MAX_TRACK) return nullptr;
+        return tracks[track].current;
+    }
+
+    /// tick at which the current sequence of the track (re)started
+    ticks get_when_started(unsigned track) const {
+        if (track >= Project::MAX_TRACK) return 0;
+        return tracks[track].when_started;
+    }
+
+    /** sends the held events and the note-offs of the sounding notes of all
+     * tracks at the start of the last window (end of an offline render)
+     * @note jack thread only
+     */
+    void flush() {
+        for (unsigned t = 0; t < Project::MAX_TRACK; ++t)
+            all_notes_off(t);
+    }
+
+    void register_metrics(metrics::Registry &r, const std::string &prefix = "sequencer") {
+        r.add(prefix + ".overruns",  overruns);
+        r.add(prefix + ".contended", contended);
+    }
+
+    /// the playhead and sounding notes of the track as of the last period.
+    /// Lock-free, for the UI thread
+    PlayState get_play_state(unsigned track) const {
+        if (track >= Project::MAX_TRACK) return {};
+        return tracks[track].play_state.load();
+    }
+
 protected:
     ticks next_opportunity() {
         return next_multiple(current_ticks, PPQN);
     }
 
-    void swap_sequences() {
+    // changes sequences on tracks that are scheduled to change before w_stop
+    void swap_sequences(ticks w_stop) {
         ticks current = current_ticks;
         for (unsigned t = 0; t < Project::MAX_TRACK; ++t) {
             ticks when = tracks[t].when_change;
-            if (when > 0 && when <= current) {
+            if (when != NO_CHANGE && when < w_stop) {
                 tracks[t].current = tracks[t].next;
 
-                if (tracks[t].current->get_flags() & SEQF_REPEATED) {
-                    tracks[t].when_change = current + tracks[t].current->get_length();
+                // start at the scheduled tick (windows rarely begin exactly
+                // on it), so the repeated sequences do not drift
+                ticks start = std::max(when, current);
+
+                if (tracks[t].current
+                    && (tracks[t].current->get_flags() & SEQF_REPEATED))
+                {
+                    tracks[t].when_change = start + tracks[t].current->get_length();
                 } else {
-                    tracks[t].when_change = 0;
+                    tracks[t].when_change = NO_CHANGE;
                     tracks[t].next        = nullptr;
                 }
 
-                tracks[t].when_started = current;
+                tracks[t].when_started = start;
 
-                uchar channel = project.get_track(t)->get_midi_channel();
+                all_notes_off(t);
+            }
+        }
+    }
 
-                // queue immediate note-offs
-                for (uchar i = 0; i < NOTE_MAX; ++i) {
-                    if (tracks[t].playing_notes[i]) {
-                        tracks[t].playing_notes[i] = false;
-                        router.queue_immediate(jack::MidiMessage::compose_note_off(channel, i));
-                    }
-                }
+    // queue note-offs at the start of the window for all notes playing on a track
+    void all_notes_off(unsigned t) {
+        flush_held(t);
+
+        uchar channel = project.get_track(t)->get_midi_channel();
+
+        for (uchar i = 0; i <= NOTE_MAX; ++i) {
+            if (tracks[t].playing_notes[i]) {
+                tracks[t].playing_notes[i] = false;
+                auto msg = jack::MidiMessage::compose_note_off(channel, i);
+                msg.time = frame;
+                router.queue_event(t, msg);
             }
         }
+
+        tracks[t].effects.reset();
+        tracks[t].missed = -1;
     }
 
-    /// returns true if there's any sequence playing right now
-    bool schedule_notes(ticks w_start, ticks w_stop) {
-        // we lock all the track's sequences here and gain iterators
-        auto walkers = lock_all_tracks();
+    // transport position jumped - move the sequence timing along with it so
+    // the playing sequences keep their phase
+    void relocate(ticks delta) {
+        for (unsigned t = 0; t < Project::MAX_TRACK; ++t) {
+            // the held ticks are on the old timeline
+            flush_held(t);
+
+            tracks[t].when_started = tracks[t].when_started + delta;
+            tracks[t].effects.relocate();
+            tracks[t].missed = -1;
+            if (tracks[t].when_change != NO_CHANGE)
+                tracks[t].when_change = std::max(ticks(0), tracks[t].when_change + delta);
+        }
+    }
 
+    /// returns true if there's any sequence playing right now
+    bool schedule_notes(std::vector<SequenceWalker> &walkers,
+                        ticks w_start, ticks w_stop)
+    {
         if (walkers.size() == 0) return false;
 
         bool added = false;
 
-        // move all the sequences to the start of the window
+        // move all the sequences to the start of the window - or of the
+        // first one they missed, those events go out late rather than never
         for (auto &sw : walkers) {
-            sw.advance_to(w_start);
+            ticks &missed = tracks[sw.track].missed;
+            sw.advance_to(missed >= 0 ? std::min(missed, w_start) : w_start);
+            missed = -1;
 
             // no more notes? the track is to be stopped
             if (sw.at_end()) {
@@ -206,20 +317,35 @@ protected:
                 unsigned track = walkers[c_index].track;
                 uchar channel = project.get_track(track)->get_midi_channel();
 
-                auto event = *walkers[c_index].iter;
+                const Event &event = *walkers[c_index].iter;
 
-                // here, we remember the current active notes
-                bool noteon = event.is_note_on();
-                bool noteoff = event.is_note_off();
+                // sysex is not grooved, it goes out as it is
+                if (event.is_sysex()) {
+                    ticks when = walkers[c_index].get_ticks();
+                    if (!held.push({when, track, {}, event.get_sysex(), event.get_size()})) {
+                        overruns.add();
+                        router.queue_sysex(track, frame, event.get_sysex(), event.get_size());
+                    }
 
-                if (noteon || noteoff) {
-                    tracks[c_index].playing_notes[event.get_note()] = noteon;
+                    ++walkers[c_index].iter;
+                    added = true;
+                    continue;
                 }
 
                 jack::MidiMessage msg = midi_event_to_msg(
                         event, channel);
 
-                router.queue_event(msg);
+                // effect stage - may add, drop or alter the notes
+                const EffectChain &fx = project.get_track(track)->get_effects();
+                ticks at = walkers[c_index].get_ticks();
+
+                if (fx.is_active() || tracks[track].effects.is_holding()) {
+                    Output out{this, track, walkers[c_index].start};
+                    fx.process(tracks[track].effects, {at, msg}, &Sequencer::fx_output, &out);
+                } else {
+                    output(track, walkers[c_index].start, at, msg);
+                }
+
                 // move the iter
                 ++walkers[c_index].iter;
                 added = true;
@@ -229,14 +355,120 @@ protected:
         return true;
     }
 
-    std::vector<SequenceWalker> lock_all_tracks() {
+    /// the sequence of the track started at seq_start (groove step grid)
+    struct Output {
+        Sequencer *seq;
+        unsigned track;
+        ticks seq_start;
+    };
+
+    static void fx_output(void *ctx, const EffectChain::Event &ev) {
+        Output *out = static_cast<Output *>(ctx);
+        out->seq->output(out->track, out->seq_start, ev.tick, ev.msg);
+    }
+
+    /// grooves the event of the track at tick t and holds it till its window
+    void output(unsigned track, ticks seq_start, ticks t, jack::MidiMessage msg) {
+        // groove stage - may delay the event and change velocity
+        ticks when = project.get_track(track)->get_groove().apply(
+                tracks[track].groove, t, seq_start, msg);
+
+        if (!held.push(when, track, msg)) {
+            // better late than never
+            overruns.add();
+            send(track, msg, frame);
+        }
+    }
+
+    /// sends the event to router, remembering the sounding notes
+    void send(unsigned track, jack::MidiMessage msg, jack_nframes_t time) {
+        uchar status = msg.data[0] & EV_CLEAR_CHAN_MASK;
+        if (status == EV_NOTE_ON || status == EV_NOTE_OFF) {
+            tracks[track].playing_notes[msg.data[1] & NOTE_MAX] =
+                    status == EV_NOTE_ON && msg.data[2] > 0;
+        }
+
+        msg.time = time;
+        router.queue_event(track, msg);
+    }
+
+    /** the held events of the track go out at the window start - except the
+     * note-ons, nothing would turn those off. Their ticks would be wrong
+     * after a stop, sequence change or locate
+     */
+    void flush_held(unsigned t) {
+        held.remove_track(t, [&](const GrooveQueue::Item &it) {
+            if (it.long_data) {
+                router.queue_sysex(t, frame, it.long_data, it.long_len);
+                return;
+            }
+
+            uchar status = it.msg.data[0] & EV_CLEAR_CHAN_MASK;
+            if (status == EV_NOTE_ON && it.msg.data[2] > 0) return;
+
+            send(t, it.msg, frame);
+        });
+    }
+
+    void advance_effects(ticks w_stop) {
+        for (unsigned t = 0; t < Project::MAX_TRACK; ++t) {
+            const EffectChain &fx = project.get_track(t)->get_effects();
+            if (!fx.is_active() && !tracks[t].effects.is_holding()) continue;
+
+            Output out{this, t, tracks[t].when_started};
+            fx.advance(tracks[t].effects, w_stop, &Sequencer::fx_output, &out);
+        }
+    }
+
+    /** sends all held events sooner than w_stop to router, converting the
+     * ticks to frame offsets inside the current window
+     */
+    void release_held(const Transport::Window &w, ticks w_stop) {
+        held.pop_until(w_stop, [&](const GrooveQueue::Item &it) {
+            jack_nframes_t time = w.frame + w.tick_to_offset(double(it.tick));
+
+            if (it.long_data)
+                router.queue_sysex(it.track, time, it.long_data, it.long_len);
+            else
+                send(it.track, it.msg, time);
+        });
+    }
+
+    /// a stopped transport leaves the sequences in place, without a playhead
+    void publish_play_states(bool running) {
+        for (unsigned t = 0; t < Project::MAX_TRACK; ++t) {
+            TrackStatus &ts = tracks[t];
+            PlayState st;
+
+            if (running && ts.current) {
+                st.sequence = ts.current;
+                st.position = current_ticks - ts.when_started;
+                st.notes    = ts.playing_notes;
+            }
+
+            ts.play_state.store(st);
+        }
+    }
+
+    /** locks the sequences of the playing tracks. A sequence being edited
+     * (the recorder merging, the UI) is not waited for - the track is
+     * skipped this period and catches up from w_start in the next one
+     */
+    std::vector<SequenceWalker> lock_all_tracks(ticks w_start) {
         std::vector<SequenceWalker> result;
 
         result.reserve(Project::MAX_TRACK);
 
         for (unsigned t = 0; t < Project::MAX_TRACK; ++t) {
-            if (tracks[t].current) {
-                result.emplace_back(t, *tracks[t].current, tracks[t].when_started);
+            if (!tracks[t].current) continue;
+
+            result.emplace_back(t, *tracks[t].current, tracks[t].when_started,
+                                std::try_to_lock);
+
+            if (!result.back().handle.locked()) {
+                result.pop_back();
+                if (tracks[t].missed < 0) tracks[t].missed = w_start;
+                contended.add();
             }
         }
 
@@ -245,17 +477,25 @@ protected:
 
     struct TrackStatus {
         // only used in jack thread context
-        bool playing_notes[NOTE_MAX];
+        NoteSet playing_notes;
+        Groove::State groove;
+        EffectChain::State effects;
         // atomics here because we lock-lessly access these
         Sequence *current = nullptr;
+        ticks missed = -1; // start of the first window skipped (sequence locked), -1 none
         std::atomic<Sequence *> next    = nullptr;
         std::atomic<ticks> when_started = 0; // ticks when the current sequence started playing
-        std::atomic<ticks> when_change  = 0; // when do we change to the next track?
+        std::atomic<ticks> when_change  = NO_CHANGE; // when do we change to the next track?
+        SeqLock<PlayState> play_state;
     };
 
     Project &project;
-    Router  &router;
-    jack::Client &client;
-    std::atomic<ticks> current_ticks;
+    MidiSink &router;
+    std::atomic<ticks> current_ticks = 0;
+    jack_nframes_t frame = 0; // start of the current window
     TrackStatus tracks[Project::MAX_TRACK];
+    GrooveQueue held; // grooved events waiting for their window
+
+    metrics::Counter overruns;  // the hold queue was full, sent right away
+    metrics::Counter contended; // a sequence was locked, the track was skipped
 };
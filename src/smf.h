@@ -0,0 +1,86 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cmath>
+
+#include "common.h"
+#include "error.h"
+
+/** Standard MIDI File writer. Produces a format 0 file (single track) with
+ * PPQN ticks per quarter note, so sequencer ticks are written as they are.
+ */
+class SmfWriter {
+public:
+    SmfWriter(double bpm = DEFAULT_BPM) {
+        // tempo meta event at the start - microseconds per quarter note
+        uint32_t tempo = uint32_t(std::lround(pulse_length_us(bpm, PPQN) * PPQN));
+        add_meta(0, 0x51, {uchar(tempo >> 16), uchar(tempo >> 8), uchar(tempo)});
+    }
+
+    /// adds a channel message. Events have to be added in time order
+    void add_event(ticks t, const uchar *data, size_t size) {
+        write_delta(t);
+        track.insert(track.end(), data, data + size);
+    }
+
+    /// adds a sysex message (F0 ... F7, as sent on the wire)
+    void add_sysex(ticks t, const uchar *data, size_t size) {
+        if (!size || data[0] != EV_SYSEX) return;
+
+        write_delta(t);
+        track.push_back(EV_SYSEX);
+        write_vlq(size - 1); // the length counts the bytes after F0
+        track.insert(track.end(), data + 1, data + size);
+    }
+
+    void add_meta(ticks t, uchar type, std::initializer_list<uchar> data) {
+        write_delta(t);
+        track.push_back(0xFF);
+        track.push_back(type);
+        write_vlq(data.size());
+        track.insert(track.end(), data.begin(), data.end());
+    }
+
+    /// finishes the track (end of track at given time) and writes the file
+    void write(const std::string &path, ticks end) {
+        add_meta(std::max(end, last), 0x2F, {});
+
+        std::ofstream f(path, std::ios::binary);
+        if (!f) throw Exception(format("Cannot open ", path, " for writing"));
+
+        const uchar header[] = {'M', 'T', 'h', 'd', 0, 0, 0, 6,
+                                0, 0,  // format 0
+                                0, 1,  // one track
+                                uchar(PPQN >> 8), uchar(PPQN & 0xFF)};
+        f.write(reinterpret_cast<const char *>(header), sizeof(header));
+
+        uint32_t len = track.size();
+        const uchar mtrk[] = {'M', 'T', 'r', 'k', uchar(len >> 24),
+                              uchar(len >> 16), uchar(len >> 8), uchar(len)};
+        f.write(reinterpret_cast<const char *>(mtrk), sizeof(mtrk));
+        f.write(reinterpret_cast<const char *>(track.data()), track.size());
+
+        if (!f) throw Exception(format("Cannot write ", path));
+    }
+
+protected:
+    void write_delta(ticks t) {
+        if (t < last) t = last; // never go back in time
+        write_vlq(uint32_t(t - last));
+        last = t;
+    }
+
+    // variable length quantity, 7 bits per byte, MSB first
+    void write_vlq(uint32_t v) {
+        uchar buf[5];
+        int n = 0;
+        buf[n++] = v & 0x7F;
+        while (v >>= 7) buf[n++] = 0x80 | (v & 0x7F);
+        while (n) track.push_back(buf[--n]);
+    }
+
+    std::vector<uchar> track;
+    ticks last = 0;
+};
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <type_traits>
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/mman.h>
+
+/** Typed single producer, single consumer queue of fixed size records.
+ *
+ * Replaces jack::RingBuffer where every record has the same size - there is
+ * no byte-wise peek/advance and no partial record to handle. The read and
+ * write indexes live on separate cache lines, each side keeps a cached copy
+ * of the other side's index, so the shared lines are only touched when the
+ * cached view runs out.
+ *
+ * @note capacity is rounded up to a power of two
+ */
+template<typename T>
+class SpscQueue {
+public:
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "SpscQueue only holds trivially copyable records");
+
+    static constexpr size_t CACHE_LINE = 64;
+
+    explicit SpscQueue(size_t capacity)
+        : cap(round_up(capacity))
+        , mask(cap - 1)
+        , storage(new T[cap])
+    {}
+
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    ~SpscQueue() {
+        if (locked) munlock(storage.get(), cap * sizeof(T));
+    }
+
+    /// locks the storage in memory, so the realtime side never page faults
+    int mlock() {
+        int res = ::mlock(storage.get(), cap * sizeof(T));
+        locked = res == 0;
+        return res;
+    }
+
+    size_t capacity() const { return cap; }
+
+    // ======================== PRODUCER ==========================
+    bool push(const T &item) { return push(&item, 1) == 1; }
+
+    /// pushes as many of the items as fit, returns the number pushed
+    size_t push(const T *items, size_t n) {
+        size_t w = prod.write_idx.load(std::memory_order_relaxed);
+        size_t free = cap - (w - prod.cached_read);
+
+        if (free < n) {
+            prod.cached_read = cons.read_idx.load(std::memory_order_acquire);
+            free = cap - (w - prod.cached_read);
+        }
+
+        n = std::min(n, free);
+        if (!n) return 0;
+
+        size_t pos   = w & mask;
+        size_t first = std::min(n, cap - pos);
+        std::copy(items, items + first, storage.get() + pos);
+        std::copy(items + first, items + n, storage.get());
+
+        prod.write_idx.store(w + n, std::memory_order_release);
+        return n;
+    }
+
+    /// free slots as seen by the producer
+    size_t write_space() const {
+        return cap - (prod.write_idx.load(std::memory_order_relaxed)
+                      - cons.read_idx.load(std::memory_order_acquire));
+    }
+
+    // ======================== CONSUMER ==========================
+    bool pop(T &item) { return pop(&item, 1) == 1; }
+
+    /// pops up to n items, returns the number popped
+    size_t pop(T *items, size_t n) {
+        return consume([items](const T *span, size_t count) mutable {
+            items = std::copy(span, span + count, items);
+        }, n);
+    }
+
+    /// the oldest item without removing it, nullptr if empty
+    const T *front() {
+        if (!available()) return nullptr;
+        return storage.get() + (cons.read_idx.load(std::memory_order_relaxed) & mask);
+    }
+
+    /// removes n items (after inspecting them via front/consume)
+    void advance(size_t n) {
+        size_t r = cons.read_idx.load(std::memory_order_relaxed);
+        cons.read_idx.store(r + std::min(n, available()), std::memory_order_release);
+    }
+
+    /** in-place consumption: calls cb(const T *span, size_t count) with up
+     * to two contiguous spans covering at most max items, then frees them.
+     * Returns the number of items consumed.
+     */
+    template<typename CbT>
+    size_t consume(CbT cb, size_t max = SIZE_MAX) {
+        size_t n = std::min(available(), max);
+        if (!n) return 0;
+
+        size_t r     = cons.read_idx.load(std::memory_order_relaxed);
+        size_t pos   = r & mask;
+        size_t first = std::min(n, cap - pos);
+
+        cb(static_cast<const T *>(storage.get() + pos), first);
+        if (n > first) cb(static_cast<const T *>(storage.get()), n - first);
+
+        cons.read_idx.store(r + n, std::memory_order_release);
+        return n;
+    }
+
+    /// items waiting as seen by the consumer
+    size_t available() {
+        size_t r = cons.read_idx.load(std::memory_order_relaxed);
+        if (cons.cached_write == r)
+            cons.cached_write = prod.write_idx.load(std::memory_order_acquire);
+        return cons.cached_write - r;
+    }
+
+    bool empty() { return available() == 0; }
+
+protected:
+    static size_t round_up(size_t n) {
+        size_t p = 1;
+        while (p < n) p <<= 1;
+        return p;
+    }
+
+    // each side's index and its cached view of the other side's index
+    struct alignas(CACHE_LINE) Producer {
+        std::atomic<size_t> write_idx = 0;
+        size_t cached_read = 0;
+    };
+
+    struct alignas(CACHE_LINE) Consumer {
+        std::atomic<size_t> read_idx = 0;
+        size_t cached_write = 0;
+    };
+
+    const size_t cap;
+    const size_t mask;
+    std::unique_ptr<T[]> storage;
+    bool locked = false;
+
+    Producer prod;
+    Consumer cons;
+};
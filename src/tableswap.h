@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+
+/** Two sets of lookup tables, configured from one thread (UI) and read from
+ * another one (jack). The writer fills the spare set and publishes it, the
+ * reader marks the set it is looking at for the duration of a Use.
+ *
+ * Before the writer touches the spare set again it waits for the reader to
+ * let go of it. The reader only holds a set for one lookup, so the wait is
+ * short and it never depends on the jack thread coming round again - any
+ * number of configuration calls in a row are safe. The reader never waits.
+ *
+ * @note a single reader thread
+ */
+template<typename T>
+class TableSwap {
+public:
+    TableSwap() = default;
+
+    TableSwap(const TableSwap &) = delete;
+    TableSwap &operator=(const TableSwap &) = delete;
+
+    /// writer - the set to fill, once the reader is done with it
+    T &spare() {
+        unsigned s = current.load(std::memory_order_relaxed) ^ 1;
+        while (in_use.load(std::memory_order_seq_cst) == s)
+            std::this_thread::yield();
+        return sets[s];
+    }
+
+    /// writer - makes the filled spare set the current one
+    void publish() {
+        current.store(current.load(std::memory_order_relaxed) ^ 1,
+                      std::memory_order_seq_cst);
+    }
+
+    /// reader - the current set, held till the end of the scope
+    class Use {
+    public:
+        explicit Use(const TableSwap &ts) : ts(ts) {
+            unsigned c;
+
+            // re-check after marking - the writer may have published between
+            do {
+                c = ts.current.load(std::memory_order_seq_cst);
+                ts.in_use.store(c, std::memory_order_seq_cst);
+            } while (ts.current.load(std::memory_order_seq_cst) != c);
+
+            tb = &ts.sets[c];
+        }
+
+        ~Use() { ts.in_use.store(NONE, std::memory_order_release); }
+
+        Use(const Use &) = delete;
+        Use &operator=(const Use &) = delete;
+
+        const T &operator*() const { return *tb; }
+        const T *operator->() const { return tb; }
+
+    protected:
+        const TableSwap &ts;
+        const T *tb;
+    };
+
+protected:
+    static constexpr unsigned NONE = 2;
+
+    T sets[2];
+    std::atomic<unsigned> current = 0;
+    mutable std::atomic<unsigned> in_use = NONE;
+};
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <algorithm>
+
+#include "common.h"
+#include "jackmidi.h"
+#include "project.h"
+#include "router.h"
+#include "tableswap.h"
+
+/** MIDI thru - forwards the router input (a keyboard) to the outputs of the
+ * selected track, in the same period and at the same frame offset as it
+ * came in, so it adds no latency.
+ *
+ * The filters (input channel to track map, note range, transpose and
+ * velocity curve) are precomputed into lookup tables on configuration (UI
+ * thread), the jack thread only looks them up.
+ */
+class MidiThru : public Router::InputHandler {
+public:
+    static constexpr uchar CH_SELECTED = 0xFE; // input channel goes to the selected track
+    static constexpr uchar CH_DROP     = 0xFF; // input channel is ignored
+    static constexpr uchar NO_NOTE     = 0xFF; // note filtered out
+
+    MidiThru(Router &router) : router(router) {
+        rebuild();
+    }
+
+    MidiThru(const MidiThru &) = delete;
+    MidiThru &operator=(const MidiThru &) = delete;
+
+    void set_enabled(bool e) { enabled.store(e, std::memory_order_relaxed); }
+    bool is_enabled() const { return enabled.load(std::memory_order_relaxed); }
+
+    /// the track that receives the input (usually the one being edited)
+    void set_track(unsigned track) {
+        if (track < Project::MAX_TRACK)
+            selected.store(track, std::memory_order_relaxed);
+    }
+
+    unsigned get_track() const { return selected.load(std::memory_order_relaxed); }
+
+    /// routes an input channel to a fixed track, CH_SELECTED or CH_DROP
+    void set_channel_map(uchar channel, uchar track) {
+        if (channel > 15) return;
+        if (track >= Project::MAX_TRACK && track != CH_SELECTED && track != CH_DROP)
+            return;
+        channel_map[channel] = track;
+        rebuild();
+    }
+
+    /// notes outside of [lo, hi] are not passed through
+    void set_note_range(uchar lo, uchar hi) {
+        note_lo = std::min(lo, NOTE_MAX);
+        note_hi = std::min(hi, NOTE_MAX);
+        rebuild();
+    }
+
+    /// in semitones, notes transposed out of range are dropped
+    void set_transpose(int semitones) {
+        transpose = std::clamp(semitones, -int(NOTE_MAX), int(NOTE_MAX));
+        rebuild();
+    }
+
+    /** velocity curve - the input velocity is scaled to [lo, hi] with given
+     * exponent (1 is linear, < 1 makes soft playing louder, > 1 softer)
+     */
+    void set_velocity_curve(double gamma, uchar lo = 1, uchar hi = NOTE_MAX) {
+        velo_gamma = gamma > 0 ? gamma : 1.0;
+        velo_lo    = std::clamp(lo, uchar(1), NOTE_MAX);
+        velo_hi    = std::clamp(hi, velo_lo, NOTE_MAX);
+        rebuild();
+    }
+
+    // Router::InputHandler
+    void on_input(jack_nframes_t frame, const uchar *data, size_t size) override {
+        if (!enabled.load(std::memory_order_relaxed)) return;
+        if (size < 1 || size > 3) return;
+
+        uchar status = data[0] & EV_CLEAR_CHAN_MASK;
+        uchar ch     = data[0] & 0x0F;
+
+        // system messages (clock, sysex...) are not ours to forward
+        if (status < EV_STATUS_BIT || status == EV_SYSEX) return;
+
+        TableSwap<Tables>::Use use(tables);
+        const Tables &tb = *use;
+
+        uchar target = tb.channel[ch];
+        if (target == CH_DROP) return;
+        unsigned track = target == CH_SELECTED
+                                 ? selected.load(std::memory_order_relaxed)
+                                 : target;
+
+        jack::MidiMessage msg;
+        msg.len = size;
+        std::copy(data, data + size, msg.data);
+
+        bool is_on  = status == EV_NOTE_ON && size == 3 && data[2] > 0;
+        bool is_off = (status == EV_NOTE_OFF || status == EV_NOTE_ON) && size == 3
+                      && !is_on;
+
+        if (is_on) {
+            uchar n = tb.note[data[1] & NOTE_MAX];
+            if (n == NO_NOTE) return;
+
+            msg.data[1] = n;
+            msg.data[2] = tb.velocity[data[2] & NOTE_MAX];
+
+            // the note-off has to follow the note-on, even if the config changes
+            Sounding &s = sounding[ch][data[1] & NOTE_MAX];
+            s.note  = n;
+            s.track = track;
+        } else if (is_off) {
+            Sounding &s = sounding[ch][data[1] & NOTE_MAX];
+            if (s.note == NO_NOTE) return;
+
+            msg.data[1] = s.note;
+            track = s.track;
+            s.note = NO_NOTE;
+        } else if (status == EV_AFTERTOUCH && size == 3) {
+            uchar n = tb.note[data[1] & NOTE_MAX];
+            if (n == NO_NOTE) return;
+            msg.data[1] = n;
+        }
+
+        router.queue_thru(track, msg, frame);
+    }
+
+protected:
+    struct Tables {
+        uchar channel[16];
+        uchar note[NOTE_MAX + 1];
+        uchar velocity[NOTE_MAX + 1];
+    };
+
+    struct Sounding {
+        uchar note = NO_NOTE; // the note we sent out for the note-on
+        uchar track = 0;
+    };
+
+    /// recomputes the spare table set and publishes it
+    void rebuild() {
+        Tables &tb = tables.spare();
+
+        std::copy(std::begin(channel_map), std::end(channel_map), tb.channel);
+
+        for (int n = 0; n <= NOTE_MAX; ++n) {
+            int t = n + transpose;
+            bool pass = n >= note_lo && n <= note_hi && t >= 0 && t <= NOTE_MAX;
+            tb.note[n] = pass ? uchar(t) : NO_NOTE;
+        }
+
+        tb.velocity[0] = 0;
+        for (int v = 1; v <= NOTE_MAX; ++v) {
+            double c = std::pow(double(v) / NOTE_MAX, velo_gamma);
+            tb.velocity[v] = uchar(std::lround(velo_lo + c * (velo_hi - velo_lo)));
+        }
+
+        tables.publish();
+    }
+
+    Router &router;
+
+    std::atomic<bool> enabled = true;
+    std::atomic<unsigned> selected = 0;
+
+    // configuration (UI thread only)
+    uchar  channel_map[16] = {CH_SELECTED, CH_SELECTED, CH_SELECTED, CH_SELECTED,
+                              CH_SELECTED, CH_SELECTED, CH_SELECTED, CH_SELECTED,
+                              CH_SELECTED, CH_SELECTED, CH_SELECTED, CH_SELECTED,
+                              CH_SELECTED, CH_SELECTED, CH_SELECTED, CH_SELECTED};
+    uchar  note_lo    = 0;
+    uchar  note_hi    = NOTE_MAX;
+    int    transpose  = 0;
+    double velo_gamma = 1.0;
+    uchar  velo_lo    = 1;
+    uchar  velo_hi    = NOTE_MAX;
+
+    TableSwap<Tables> tables;
+
+    // jack thread only - per input channel and note
+    Sounding sounding[16][NOTE_MAX + 1];
+};
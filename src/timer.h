@@ -0,0 +1,172 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+
+/** Timers of the UI thread on a monotonic clock - a hashed wheel of SLOTS
+ * slots TICK apart, so scheduling and firing cost the same however many
+ * timers are pending. Timers further than a turn of the wheel wait in their
+ * slot for the right turn. Only next_due() looks at all of them.
+ *
+ * The callbacks run in the thread calling advance(), outside of any lock -
+ * they may schedule and cancel timers.
+ */
+class TimerWheel {
+public:
+    using Clock    = std::chrono::steady_clock;
+    using Callback = std::function<void()>;
+    using Id       = uint64_t;
+
+    static constexpr Clock::duration TICK = std::chrono::milliseconds(10);
+    static constexpr unsigned SLOTS = 256;
+    static constexpr Id NO_TIMER = 0;
+
+    /// wake is called when a timer is scheduled earlier than the last next_due()
+    explicit TimerWheel(Callback wake = nullptr, Clock::time_point now = Clock::now())
+        : wake(std::move(wake)), origin(now)
+    {}
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    /// runs cb after the delay, then every period if given
+    Id schedule(Clock::duration delay, Callback cb,
+                Clock::duration period = Clock::duration::zero())
+    {
+        bool earliest;
+        Id id;
+
+        {
+            std::scoped_lock<std::mutex> l(mtx);
+
+            id = ++last_id;
+            uint64_t due = std::max(to_tick(Clock::now() + delay), current + 1);
+            earliest = due < waited_due;
+            if (earliest) waited_due = due;
+
+            insert({id, due, to_ticks(period), std::move(cb)});
+        }
+
+        if (earliest && wake) wake();
+        return id;
+    }
+
+    /// true if the timer was pending
+    bool cancel(Id id) {
+        std::scoped_lock<std::mutex> l(mtx);
+
+        auto it = where.find(id);
+        if (it == where.end()) return false;
+
+        auto &slot = slots[it->second];
+        slot.erase(std::find_if(slot.begin(), slot.end(),
+                                [id](const Entry &e) { return e.id == id; }));
+        where.erase(it);
+        return true;
+    }
+
+    /// fires the timers due by now, returns how many fired
+    unsigned advance(Clock::time_point now = Clock::now()) {
+        std::vector<Entry> fired;
+
+        {
+            std::scoped_lock<std::mutex> l(mtx);
+
+            uint64_t target = to_tick(now);
+            if (target <= current) return 0;
+
+            // a whole turn visits every slot - no need to go around again
+            uint64_t steps = std::min<uint64_t>(target - current, SLOTS);
+
+            for (uint64_t t = current + 1; t <= current + steps; ++t) {
+                auto &slot = slots[t % SLOTS];
+
+                auto due = std::stable_partition(
+                        slot.begin(), slot.end(),
+                        [target](const Entry &e) { return e.due > target; });
+
+                for (auto it = due; it != slot.end(); ++it) where.erase(it->id);
+                std::move(due, slot.end(), std::back_inserter(fired));
+                slot.erase(due, slot.end());
+            }
+
+            current = target;
+
+            std::stable_sort(fired.begin(), fired.end(),
+                             [](const Entry &a, const Entry &b) { return a.due < b.due; });
+
+            // repeating ones go back before any callback could cancel them
+            for (const Entry &e : fired) {
+                if (!e.period) continue;
+
+                uint64_t due = e.due + e.period;
+                if (due <= current) due = current + e.period - (current - e.due) % e.period;
+                insert({e.id, due, e.period, e.cb});
+            }
+        }
+
+        for (Entry &e : fired) e.cb();
+        return fired.size();
+    }
+
+    /// when the next timer is due, Clock::time_point::max() if none is pending
+    Clock::time_point next_due() const {
+        std::scoped_lock<std::mutex> l(mtx);
+
+        waited_due = earliest_due();
+        if (waited_due == UINT64_MAX) return Clock::time_point::max();
+        return origin + waited_due * TICK;
+    }
+
+    size_t pending() const {
+        std::scoped_lock<std::mutex> l(mtx);
+        return where.size();
+    }
+
+protected:
+    struct Entry {
+        Id id;
+        uint64_t due;    // tick
+        uint64_t period; // ticks, 0 for one shot
+        Callback cb;
+    };
+
+    uint64_t to_tick(Clock::time_point t) const {
+        if (t <= origin) return 0;
+        return (t - origin) / TICK;
+    }
+
+    // rounded up, a period is at least a tick
+    static uint64_t to_ticks(Clock::duration d) {
+        if (d <= Clock::duration::zero()) return 0;
+        return std::max<uint64_t>(1, (d + TICK - Clock::duration(1)) / TICK);
+    }
+
+    void insert(Entry e) {
+        unsigned s = e.due % SLOTS;
+        where[e.id] = s;
+        slots[s].push_back(std::move(e));
+    }
+
+    uint64_t earliest_due() const {
+        uint64_t res = UINT64_MAX;
+        for (const auto &slot : slots)
+            for (const Entry &e : slot) res = std::min(res, e.due);
+        return res;
+    }
+
+    Callback wake;
+    const Clock::time_point origin;
+
+    mutable std::mutex mtx;
+    std::vector<Entry> slots[SLOTS];
+    std::unordered_map<Id, unsigned> where; // pending timer -> slot
+    uint64_t current = 0; // last tick advanced to
+    mutable uint64_t waited_due = UINT64_MAX; // the last next_due()
+    Id last_id = NO_TIMER;
+};
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+
+#include <jack/types.h>
+
+#include "common.h"
+#include "error.h"
+#include "metrics.h"
+#include "spsc.h"
+
+/** Midi event trace for debugging the timing. The jack thread writes small
+ * fixed size binary records (frame, port, source track, message bytes) into
+ * a preallocated, mlocked ring and a writer thread drains them into a file.
+ * Tracing never blocks nor allocates in the jack thread - when the writer
+ * falls behind, records are dropped and counted - so it can stay enabled in
+ * production at a fixed memory cost.
+ *
+ * The file is the FileHeader followed by the Records, see tools/lseq_trace.cc
+ * for the decoder.
+ *
+ * @note single producer - only the jack thread traces
+ */
+class Tracer {
+public:
+    static constexpr size_t CAPACITY  = 16384; // records
+    static constexpr size_t DATA_SIZE = 8;     // message bytes kept per record
+    static constexpr auto   FLUSH_INTERVAL = std::chrono::milliseconds(20);
+
+    static constexpr uint8_t NO_PORT  = 0xFF;
+    static constexpr uint8_t NO_TRACK = 0xFF;
+
+    enum Kind : uint8_t {
+        TR_INPUT     = 0, // came in on the router input
+        TR_OUTPUT    = 1, // written to the port buffer
+        TR_REORDERED = 2, // written, but later than due
+        TR_PACED     = 3, // handed to the bandwidth pacer (frame is the due one)
+        TR_DROPPED   = 4  // no space in the port buffer
+    };
+
+    struct Record {
+        uint32_t frame; // absolute frame time
+        uint8_t  kind;
+        uint8_t  port;
+        uint8_t  track;
+        uint8_t  len;   // whole message length, saturated at 255
+        uchar    data[DATA_SIZE]; // message prefix
+    };
+
+    static_assert(sizeof(Record) == 16, "trace records are 16 bytes");
+
+    struct FileHeader {
+        char     magic[4]    = {'L', 'S', 'T', 'R'};
+        uint32_t version     = 1;
+        uint32_t sample_rate = 0;
+        uint32_t record_size = sizeof(Record);
+    };
+
+    Tracer() : ring(CAPACITY) {
+        ring.mlock();
+    }
+
+    Tracer(const Tracer &) = delete;
+    Tracer &operator=(const Tracer &) = delete;
+
+    ~Tracer() { stop(); }
+
+    /** starts tracing into a new file.
+     * @note not realtime safe, call from the UI thread
+     */
+    void start(const std::string &path, jack_nframes_t sample_rate) {
+        stop();
+
+        file = std::fopen(path.c_str(), "wb");
+        if (!file) throw Exception(format("Cannot open trace file ", path));
+
+        FileHeader h;
+        h.sample_rate = sample_rate;
+        std::fwrite(&h, sizeof(h), 1, file);
+
+        // leftovers of a previous run (we are the only consumer now)
+        ring.consume([](const Record *, size_t) {});
+
+        do_exit = false;
+        writer  = std::thread([this] { write_loop(); });
+        enabled.store(true, std::memory_order_release);
+    }
+
+    /// stops tracing, the file is complete once this returns
+    void stop() {
+        enabled.store(false, std::memory_order_release);
+        if (!writer.joinable()) return;
+
+        do_exit = true;
+        writer.join();
+
+        std::fclose(file);
+        file = nullptr;
+    }
+
+    bool is_enabled() const { return enabled.load(std::memory_order_relaxed); }
+
+    /// records a message, data may be nullptr. @note jack thread only
+    void trace(Kind kind, jack_nframes_t frame, unsigned port, unsigned track,
+               const uchar *data, size_t len)
+    {
+        if (!enabled.load(std::memory_order_relaxed)) return;
+
+        Record r{frame, kind, uint8_t(std::min(port, 0xFFu)),
+                 uint8_t(std::min(track, 0xFFu)), uint8_t(std::min(len, size_t(0xFF))),
+                 {}};
+        if (data) std::copy(data, data + std::min(len, DATA_SIZE), r.data);
+
+        if (!ring.push(r)) dropped.add();
+    }
+
+    void register_metrics(metrics::Registry &r, const std::string &prefix = "trace") {
+        r.add(prefix + ".written", written);
+        r.add(prefix + ".dropped", dropped);
+    }
+
+    /** reads a whole trace file (decoder side). Returns false if the file is
+     * not a trace.
+     */
+    static bool read_file(const std::string &path, FileHeader &h,
+                          std::vector<Record> &records)
+    {
+        FILE *f = std::fopen(path.c_str(), "rb");
+        if (!f) return false;
+
+        FileHeader ref;
+        bool ok = std::fread(&h, sizeof(h), 1, f) == 1
+                  && std::equal(h.magic, h.magic + 4, ref.magic)
+                  && h.version == ref.version && h.record_size == sizeof(Record);
+
+        Record r;
+        while (ok && std::fread(&r, sizeof(r), 1, f) == 1)
+            records.push_back(r);
+
+        std::fclose(f);
+        return ok;
+    }
+
+protected:
+    // ======================== WRITER THREAD ==========================
+    void write_loop() {
+        while (!do_exit) {
+            std::this_thread::sleep_for(FLUSH_INTERVAL);
+            drain();
+            std::fflush(file);
+        }
+
+        drain();
+    }
+
+    void drain() {
+        size_t n = ring.consume([this](const Record *recs, size_t count) {
+            std::fwrite(recs, sizeof(Record), count, file);
+        });
+
+        if (n) written.add(n);
+    }
+
+    SpscQueue<Record> ring;
+    std::atomic<bool> enabled = false;
+
+    // writer thread (and start/stop)
+    FILE *file = nullptr;
+    std::atomic<bool> do_exit = false;
+    std::thread writer;
+
+    metrics::Counter written;
+    metrics::Counter dropped; // ring was full
+};
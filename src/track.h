@@ -2,6 +2,8 @@
 
 #include "common.h"
 #include "sequence.h"
+#include "groove.h"
+#include "effects.h"
 
 class Track {
 public:
@@ -29,8 +31,16 @@ public:
     /// 0-15
     void set_midi_channel(uchar chan) { midi_chan = chan & 0x0F; }
 
+    /// swing/groove template/humanize applied to this track's output
+    Groove &get_groove() { return groove; }
+
+    /// arpeggiator/transpose/velocity/ratchet chain, before the groove
+    EffectChain &get_effects() { return effects; }
+
 protected:
     uchar midi_chan = 0;
     Sequence sequences[MAX_SEQUENCE];
+    Groove groove;
+    EffectChain effects;
     bool muted = false;
 };
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <algorithm>
+
+#include <jack/types.h>
+
+#include "common.h"
+#include "project.h"
+
+/** Musical time keeper. Accumulates the tick position period by period from
+ * the current tempo, so tempo changes take effect immediately without
+ * jumping the position. Everything playing in sync (sequencer, midi clock)
+ * takes its timing from the Window produced here.
+ *
+ * @note start/stop/locate are requested from any thread and applied at the
+ * start of the next process period, advance() is jack thread only.
+ */
+class Transport {
+public:
+    /// Timing of a single process period in ticks.
+    struct Window {
+        double start = 0;           // tick position of the first frame
+        double stop  = 0;           // tick position of the frame past the period
+        double frames_per_tick = 1;
+        jack_nframes_t frame   = 0; // absolute frame time of the first frame
+        jack_nframes_t nframes = 0;
+
+        bool running   = false;
+        bool started   = false; // started from zero in this period
+        bool continued = false; // resumed from the current position
+        bool stopped   = false; // stopped in this period
+        bool located   = false; // position jumped (locate_from is the old one)
+        double locate_from = 0;
+
+        /// first whole tick inside the period
+        ticks first_tick() const { return ticks(std::ceil(start)); }
+
+        /// first whole tick past the period ([first_tick, end_tick) is ours)
+        ticks end_tick() const { return ticks(std::ceil(stop)); }
+
+        /// frame offset within the period of the given tick position
+        jack_nframes_t tick_to_offset(double t) const {
+            double off = (t - start) * frames_per_tick;
+            if (off <= 0) return 0;
+            if (off >= nframes) return nframes ? nframes - 1 : 0;
+            return jack_nframes_t(off);
+        }
+    };
+
+    /** External time source (i.e. MIDI clock slave). When set, the
+     * transport follows it instead of the project tempo.
+     * @note called from the jack thread only
+     */
+    struct Sync {
+        struct State {
+            bool valid     = false; // false - no timing info, keep internal
+            bool running   = false;
+            bool started   = false; // edge-triggered flags, cleared on read
+            bool continued = false;
+            bool stopped   = false;
+            bool located   = false;
+            double position = 0;     // tick position at the queried frame
+            double bpm      = DEFAULT_BPM;
+        };
+
+        /// returns the sync state for the frame past the current period
+        virtual State sync_at(jack_nframes_t frame,
+                              jack_nframes_t sample_rate) = 0;
+    };
+
+    Transport(Project &project) : project(project) {}
+
+    /// switches to following an external source, nullptr for internal
+    void set_sync(Sync *s) { sync = s; }
+    bool is_synced() const { return sync != nullptr; }
+
+    void start()    { requests.fetch_or(REQ_START); }
+    void stop()     { requests.fetch_or(REQ_STOP); }
+    void cont()     { requests.fetch_or(REQ_CONTINUE); }
+
+    /// moves the playback position to given tick
+    void locate(ticks t) {
+        locate_to = t;
+        requests.fetch_or(REQ_LOCATE);
+    }
+
+    bool is_running() const { return running; }
+
+    /// last known position (updated every period)
+    ticks get_ticks() const { return position; }
+
+    /// tempo used for the last period
+    double get_bpm() const { return bpm; }
+
+    /// computes the window for a period and moves the position forward
+    Window advance(jack_nframes_t frame, jack_nframes_t nframes,
+                   jack_nframes_t sample_rate)
+    {
+        Sync *s = sync;
+        if (s) {
+            Sync::State st = s->sync_at(frame + nframes, sample_rate);
+            if (st.valid) return follow(st, frame, nframes, sample_rate);
+        }
+
+        Window w;
+        unsigned req = requests.exchange(0);
+        bool run     = running;
+
+        if (req & REQ_STOP) {
+            w.stopped = run;
+            run = false;
+        }
+
+        if (req & REQ_LOCATE) {
+            w.located     = true;
+            w.locate_from = pos;
+            pos = double(locate_to.load());
+        }
+
+        if (req & REQ_START) {
+            if (pos != 0 && !w.located) {
+                w.located     = true;
+                w.locate_from = pos;
+            }
+            pos       = 0;
+            w.started = true;
+            run       = true;
+        } else if ((req & REQ_CONTINUE) && !run) {
+            w.continued = true;
+            run = true;
+        }
+
+        double b = tempo();
+        bpm = b;
+
+        w.frames_per_tick = sample_rate * pulse_length_us(b, PPQN) / 1000000.0;
+        w.frame   = frame;
+        w.nframes = nframes;
+        w.running = run;
+        w.start   = pos;
+
+        if (run) pos += nframes / w.frames_per_tick;
+
+        w.stop = pos;
+
+        running  = run;
+        position = ticks(pos);
+        return w;
+    }
+
+protected:
+    /** external sync variant of advance. The window always continues where
+     * the last one stopped, only the speed is adjusted so the end of the
+     * window meets the position of the sync source.
+     */
+    Window follow(const Sync::State &st, jack_nframes_t frame,
+                  jack_nframes_t nframes, jack_nframes_t sample_rate)
+    {
+        Window w;
+        requests = 0; // local requests are meaningless while following
+
+        w.stopped   = st.stopped && running;
+        w.started   = st.started;
+        w.continued = st.continued && !st.started;
+
+        if (st.started || st.located) {
+            w.located     = pos != st.position || st.started;
+            w.locate_from = pos;
+            pos = st.started ? 0 : st.position;
+        }
+
+        double b = st.bpm;
+        bpm = b;
+
+        w.frame   = frame;
+        w.nframes = nframes;
+        w.running = st.running;
+        w.start   = pos;
+
+        if (st.running) pos = std::max(pos, st.position);
+
+        w.stop = pos;
+
+        if (w.stop > w.start)
+            w.frames_per_tick = nframes / (w.stop - w.start);
+        else
+            w.frames_per_tick = sample_rate * pulse_length_us(b, PPQN) / 1000000.0;
+
+        running  = st.running;
+        position = ticks(pos);
+        return w;
+    }
+
+    enum Requests : unsigned {
+        REQ_START    = 1,
+        REQ_STOP     = 2,
+        REQ_CONTINUE = 4,
+        REQ_LOCATE   = 8
+    };
+
+    /// tempo source for the next period
+    double tempo() const {
+        return project.get_bpm();
+    }
+
+    Project &project;
+    std::atomic<Sync *> sync = nullptr;
+
+    double pos = 0; // jack thread only
+    std::atomic<unsigned> requests = 0;
+    std::atomic<ticks>  locate_to  = 0;
+    std::atomic<bool>   running    = false;
+    std::atomic<ticks>  position   = 0;
+    std::atomic<double> bpm        = DEFAULT_BPM;
+};
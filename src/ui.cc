@@ -1,5 +1,4 @@
 #include <iostream>
-#include <ctime>
 
 #include "ui.h"
 #include "sequence.h"
@@ -7,31 +6,42 @@
 #include "project.h"
 #include "track.h"
 
-UIScreen::UIScreen(UI &ui) : ui(ui), launchpad(ui.launchpad) {}
+UIScreen::UIScreen(UI &ui) : ui(ui), grid(ui.grid) {}
 
 void UIScreen::set_active_mode_button(unsigned m) {
-    launchpad.set_color(Launchpad::BC_SESSION, 0, m == 0 ? 3 : 0);
-    launchpad.set_color(Launchpad::BC_USER1, 0, m == 1 ? 3 : 0);
-    launchpad.set_color(Launchpad::BC_USER2, 0, m == 2 ? 3 : 0);
-    launchpad.set_color(Launchpad::BC_MIXER, 0, m == 3 ? 3 : 0);
+    grid.set_color(GridSurface::BC_SESSION, 0, m == 0 ? 3 : 0);
+    grid.set_color(GridSurface::BC_USER1, 0, m == 1 ? 3 : 0);
+    grid.set_color(GridSurface::BC_USER2, 0, m == 2 ? 3 : 0);
+    grid.set_color(GridSurface::BC_MIXER, 0, m == 3 ? 3 : 0);
 }
 
 void UIScreen::wake_up() {
     ui.wake_up();
 }
 
+TimerWheel &UIScreen::get_timers() const {
+    return ui.timers;
+}
+
+jack_nframes_t UIScreen::sample_rate() const {
+    return ui.get_owner().get_client().sample_rate();
+}
+
 /* -------------------------------------------------------------------------- */
 /* ---- Track/Project setup View -------------------------------------------- */
 /* -------------------------------------------------------------------------- */
-void TrackScreen::on_key(const Launchpad::KeyEvent &ev) {
+void TrackScreen::on_key(const GridSurface::KeyEvent &ev) {
+    // before locking - on_gesture takes mtx itself
+    gestures.on_key(ev);
+
     lock l(mtx);
 
-    if (ev.code == Launchpad::BC_MIXER) {
+    if (ev.code == GridSurface::BC_MIXER) {
         shift = ev.press;
         return;
     }
 
-    if (ev.type == Launchpad::BTN_GRID) {
+    if (ev.type == GridSurface::BTN_GRID) {
         // on and off button presses are distinct to allow for long press and button combos
         if (ev.press) {
             if (shift) {
@@ -50,14 +60,14 @@ void TrackScreen::on_key(const Launchpad::KeyEvent &ev) {
     if (ev.press) {
         // only button press events here, no release events
         switch (ev.code) {
-        case Launchpad::BC_LEFT : updates.left_right--; updates.mark_dirty(); return;
-        case Launchpad::BC_RIGHT: updates.left_right++; updates.mark_dirty(); return;
+        case GridSurface::BC_LEFT : updates.left_right--; updates.mark_dirty(); return;
+        case GridSurface::BC_RIGHT: updates.left_right++; updates.mark_dirty(); return;
             // TODO: Use note scaler here
-        case Launchpad::BC_DOWN : updates.up_down--; updates.mark_dirty(); return;
-        case Launchpad::BC_UP   : updates.up_down++; updates.mark_dirty(); return;
+        case GridSurface::BC_DOWN : updates.up_down--; updates.mark_dirty(); return;
+        case GridSurface::BC_UP   : updates.up_down++; updates.mark_dirty(); return;
         }
 
-        if (ev.type == Launchpad::BTN_SIDE) {
+        if (ev.type == GridSurface::BTN_SIDE) {
             // side button pressed
             updates.side_buttons |= 1 << ev.y;
             updates.mark_dirty();
@@ -66,6 +76,29 @@ void TrackScreen::on_key(const Launchpad::KeyEvent &ev) {
 
 }
 
+void TrackScreen::on_gesture(const Gestures::Gesture &g) {
+    // press one, press free space - copies the sequence there. The source
+    // press was a plain play press before the copy was known, so the source
+    // plays as usual - only the free space pressed is kept from playing
+    if (g.kind != Gestures::G_HOLD_PRESS || g.anchor >= GridSurface::BC_UP
+        || g.code >= GridSurface::BC_UP)
+        return;
+
+    unsigned sx = GridSurface::btn_x(g.anchor), sy = GridSurface::btn_y(g.anchor);
+    unsigned dx = GridSurface::btn_x(g.code),   dy = GridSurface::btn_y(g.code);
+    if (sx >= grid.width() || dx >= grid.width()) return; // side buttons
+
+    Sequence *src = get_seq_for_xy(sx, sy).second;
+    Sequence *dst = get_seq_for_xy(dx, dy).second;
+    if (!src || !dst || src->is_empty() || !dst->is_empty()) return;
+
+    lock l(mtx);
+    updates.copy_x = sx;
+    updates.copy_y = sy;
+    updates.copy_to.mark(dx, dy);
+    updates.mark_dirty();
+}
+
 ScreenType TrackScreen::on_enter() {
     // color up our mode button
     set_active_mode_button(0);
@@ -73,7 +106,7 @@ ScreenType TrackScreen::on_enter() {
     repaint();
 
     // present
-    launchpad.flip();
+    grid.flip();
 
     return get_type();
 };
@@ -91,14 +124,14 @@ void TrackScreen::update() {
     // From here forward, we only use "ub", not "updates"
     bool dirty = false;
 
-    Launchpad::Bitmap prev = held_buttons;
+    GridSurface::Bitmap prev = held_buttons;
 
     // repaint whole screen if held buttons changed
     if (held_buttons != prev) dirty = true;
 
     if (ub.side_buttons) {
         // mute tracks that were pressed
-        for (unsigned y = 0; y < Launchpad::MATRIX_H; ++y) {
+        for (unsigned y = 0; y < grid.height(); ++y) {
             Track *tr = get_track_for_y(y);
             if (!tr) continue;
             if ((ub.side_buttons >> y) & 1) {
@@ -125,6 +158,16 @@ void TrackScreen::update() {
             }
     }
 
+    // copies - the free places pressed do not get played
+    ub.copy_to.iterate([&](unsigned x, unsigned y) {
+        Sequence *src = get_seq_for_xy(ub.copy_x, ub.copy_y).second;
+        Sequence *dst = get_seq_for_xy(x, y).second;
+        if (src && dst) dst->copy_from(*src);
+        dirty = true;
+    });
+
+    ub.grid_on &= ~ub.copy_to;
+
     // any presses to play the sequence?
     ub.grid_on.iterate([&](unsigned x, unsigned y) {
                            schedule_sequence_for_xy(x, y);
@@ -140,44 +183,77 @@ void TrackScreen::update() {
 };
 
 void TrackScreen::repaint() {
-    uchar view[Launchpad::MATRIX_W][Launchpad::MATRIX_H];
-
-    for (uchar y = 0; y < Launchpad::MATRIX_H; ++y) {
-        for (uchar x = 0; x < Launchpad::MATRIX_W; ++x) {
-            Sequence *s = get_seq_for_xy(x, y).second;
+    GridSurface::Color view[GridSurface::MAX_W][GridSurface::MAX_H];
 
-            if (!s) {
-                view[x][y] = Launchpad::CL_BLACK;
-                continue;
-            }
+    for (uchar y = 0; y < grid.height(); ++y) {
+        playing[y] = playing_x(y);
 
-            // TODO: Customizable color per track...
-            uchar col = s->is_empty() ? Launchpad::CL_BLACK
-                        : Launchpad::CL_AMBER;
-
-            // all pressed keys will show up, but only first to be released
-            if (held_buttons.get(x, y)) col = Launchpad::CL_RED;
-
-            view[x][y] = col;
-        }
+        for (uchar x = 0; x < grid.width(); ++x)
+            view[x][y] = cell_color(x, y);
 
         // mutes?
         Track *t = get_track_for_y(y);
-        uchar col = t->is_muted() ? Launchpad::CL_BLACK : Launchpad::CL_GREEN;
-        launchpad.set_color(Launchpad::coord_to_btn(8, y), col);
+        GridSurface::Color col = t->is_muted() ? GridSurface::CL_BLACK
+                                                  : GridSurface::CL_GREEN;
+        grid.set_color(grid.side_btn(y), col);
     }
 
-    launchpad.fill_matrix(
+    grid.fill_matrix(
             [&view](unsigned x, unsigned y) {
                 return view[x][y];
             });
 
     // TODO: light up buttons based on positioning - can we go more to the
     // sides, etc?
-    launchpad.flip(true);
+    grid.flip();
 };
 
 
+void TrackScreen::on_frame() {
+    bool changed = false;
+
+    // only the rows whose playing sequence moved get redrawn
+    for (uchar y = 0; y < grid.height(); ++y) {
+        int x = playing_x(y);
+        if (x == playing[y]) continue;
+
+        int old = playing[y];
+        playing[y] = x;
+
+        if (old != NOT_PLAYING) grid.set_color(GridSurface::coord_to_btn(old, y), cell_color(old, y));
+        if (x != NOT_PLAYING) grid.set_color(GridSurface::coord_to_btn(x, y), cell_color(x, y));
+        changed = true;
+    }
+
+    if (changed) grid.flip();
+}
+
+GridSurface::Color TrackScreen::cell_color(uchar x, uchar y) {
+    Sequence *s = get_seq_for_xy(x, y).second;
+    if (!s) return GridSurface::CL_BLACK;
+
+    // all pressed keys will show up, but only first to be released
+    if (held_buttons.get(x, y)) return GridSurface::CL_RED;
+
+    if (playing[y] == x) return GridSurface::CL_GREEN;
+
+    // TODO: Customizable color per track...
+    return s->is_empty() ? GridSurface::CL_BLACK : GridSurface::CL_AMBER;
+}
+
+int TrackScreen::playing_x(uchar y) {
+    Track *t = get_track_for_y(y);
+    if (!t) return NOT_PLAYING;
+
+    auto st = ui.owner.get_sequencer().get_play_state(project.get_track_index(t));
+    if (!st.sequence) return NOT_PLAYING;
+
+    for (uchar x = 0; x < grid.width(); ++x)
+        if (get_seq_for_xy(x, y).second == st.sequence) return x;
+
+    return NOT_PLAYING;
+}
+
 Track *TrackScreen::get_track_for_y(uchar y) {
     unsigned tr = y + vy;
     if (tr >= project.get_track_count()) return nullptr;
@@ -218,12 +294,13 @@ void TrackScreen::on_exit() {
     held_buttons.clear();
     shift_held_buttons.clear();
     shift = false;
+    gestures.reset();
 };
 
 /* -------------------------------------------------------------------------- */
 /* ---- Song Arrangement View ----------------------------------------------- */
 /* -------------------------------------------------------------------------- */
-void SongScreen::on_key(const Launchpad::KeyEvent &ev) {
+void SongScreen::on_key(const GridSurface::KeyEvent &ev) {
     lock l(mtx);
 
     // arrow keys move the view if applicable
@@ -239,13 +316,13 @@ void SongScreen::repaint() {
     set_active_mode_button(1);
 
     // render the UI part
-    launchpad.fill_matrix(
+    grid.fill_matrix(
             [this](unsigned x, unsigned y) {
-                return Launchpad::color((x + y) % 4, 0);
+                return GridSurface::color((x + y) % 4, 0);
             });
 
     // present
-    launchpad.flip();
+    grid.flip();
 }
 
 // Note - no need to flip here maybe.
@@ -257,31 +334,49 @@ void SongScreen::on_exit() {
 /* -------------------------------------------------------------------------- */
 void SequenceScreen::on_exit() {
     held_buttons.clear();
+    kept_notes.clear();
+    gestures.reset();
+    grid.set_blink(GridSurface::BC_MIXER, false);
 };
 
-void SequenceScreen::on_key(const Launchpad::KeyEvent &ev) {
+void SequenceScreen::on_gesture(const Gestures::Gesture &g) {
+    if (g.code != GridSurface::BC_MIXER) return;
+
     lock l(mtx);
 
-    if (ev.code == Launchpad::BC_MIXER) {
-        shift = ev.press;
-        if (ev.press) {
-            shift_only = true;
-            shift_start = std::time(nullptr);
-        } else {
-            // TODO: do this so we get the effect before releasing (easier usage)
-            // just mark up the start of the shift event and decide in update code
-            // but that needs a timer to wake the ui screen up after the decided time
-            updates.shift_only = shift_only;
-            updates.shift_held = std::time(nullptr) - shift_start;
-            updates.mark_dirty();
-        }
+    switch (g.kind) {
+    case Gestures::G_LONG_PRESS:
+        // shift held alone unselects, before it gets released
+        updates.unselect = true;
+        break;
+    case Gestures::G_HOLD_PRESS: {
+        // shift pressed over a held note - the note stays on release
+        unsigned x = GridSurface::btn_x(g.anchor), y = GridSurface::btn_y(g.anchor);
+        if (g.anchor >= GridSurface::BC_UP || x >= grid.width()) return;
+
+        updates.keep_notes.mark(x, y);
+        break;
+    }
+    default:
         return;
     }
 
-    shift_only = false;
+    updates.mark_dirty();
+}
+
+void SequenceScreen::on_key(const GridSurface::KeyEvent &ev) {
+    // before locking - on_gesture takes mtx itself
+    gestures.on_key(ev);
+
+    lock l(mtx);
+
+    if (ev.code == GridSurface::BC_MIXER) {
+        shift = ev.press;
+        return;
+    }
 
     // handle grid ops
-    if (ev.type == Launchpad::BTN_GRID) {
+    if (ev.type == GridSurface::BTN_GRID) {
         // on and off button presses are distinct to allow for long press and button combos
         if (ev.press) {
             if (shift) {
@@ -303,15 +398,15 @@ void SequenceScreen::on_key(const Launchpad::KeyEvent &ev) {
         if (ev.press) {
             // only button press events here, no release events
             switch (ev.code) {
-            case Launchpad::BC_LEFT : updates.left_right--; updates.mark_dirty(); return;
-            case Launchpad::BC_RIGHT: updates.left_right++; updates.mark_dirty(); return;
+            case GridSurface::BC_LEFT : updates.left_right--; updates.mark_dirty(); return;
+            case GridSurface::BC_RIGHT: updates.left_right++; updates.mark_dirty(); return;
                 // TODO: Use note scaler here
-            case Launchpad::BC_DOWN : updates.up_down--; updates.mark_dirty(); return;
-            case Launchpad::BC_UP   : updates.up_down++; updates.mark_dirty(); return;
+            case GridSurface::BC_DOWN : updates.up_down--; updates.mark_dirty(); return;
+            case GridSurface::BC_UP   : updates.up_down++; updates.mark_dirty(); return;
             }
         }
 
-        if (ev.type == Launchpad::BTN_SIDE) {
+        if (ev.type == GridSurface::BTN_SIDE) {
             // side button pressed
             updates.side_buttons |= 1 << ev.y;
             updates.mark_dirty();
@@ -320,7 +415,7 @@ void SequenceScreen::on_key(const Launchpad::KeyEvent &ev) {
         if (!ev.press) return;
 
         // special mode buttons while shift is pressed
-        if (ev.type == Launchpad::BTN_SIDE) {
+        if (ev.type == GridSurface::BTN_SIDE) {
             switch (ev.y) {
             case 0:  // switch triplets on/off
                 updates.switch_triplets = true;
@@ -331,13 +426,13 @@ void SequenceScreen::on_key(const Launchpad::KeyEvent &ev) {
                 updates.mark_dirty();
                 break;
             }
-        } else if (ev.type == Launchpad::BTN_TOP) {
+        } else if (ev.type == GridSurface::BTN_TOP) {
             switch (ev.code) {
-            case Launchpad::BC_LEFT:  // zoom out
+            case GridSurface::BC_LEFT:  // zoom out
                 updates.time_scale--;
                 updates.mark_dirty();
                 break;
-            case Launchpad::BC_RIGHT: // zoom in
+            case GridSurface::BC_RIGHT: // zoom in
                 updates.time_scale++;
                 updates.mark_dirty();
                 break;
@@ -370,18 +465,17 @@ void SequenceScreen::update() {
 
     // we now walk through all the update points and update our display model
     bool dirty = false; // this means we need a global repaint...
-    bool flip = false;
+
+    kept_notes |= b.keep_notes;
 
     // TODO: also schedule a midi event in router so that we hear what we press
     // update from note press bitmap
     b.grid_on.iterate([&](unsigned x, unsigned y) {
-        flip = !dirty;
-
         // see the status of the current field, if there is a note don't add
         // another one
         // if buttons are held, see if any of them is in row
         // if so, we just change length of the note and repaint
-        uchar row = held_buttons.row(y);
+        unsigned row = held_buttons.row(y);
 
         if (row) {
             // there are buttons being held in the row where button event occured
@@ -410,9 +504,8 @@ void SequenceScreen::update() {
         }
     });
 
-    // TODO: Rework this to be initiated by timing, not by button release
-    // if it's held for more than specified time, and released without pressing anything else
-    if ((b.shift_held > 1) && b.shift_only) {
+    // shift held alone for a while, no need to wait for the release
+    if (b.unselect) {
         sequence->unselect_all();
         dirty = true;
     }
@@ -432,9 +525,10 @@ void SequenceScreen::update() {
         if (modified_notes.get(x,y))
             queue_note_off(note_scaler.to_note(y));
 
-        // only remove the note if it was a held note (not shift-marked)
+        // only remove the note if it was a held note (not shift-marked, nor
+        // kept by a shift press while held)
         if ((view[x][y] & FS_HAS_NOTE) && held_buttons.get(x, y)
-            && !modified_notes.get(x, y))
+            && !modified_notes.get(x, y) && !kept_notes.get(x, y))
         {
             if (view[x][y] & FS_IS_SELECTED)
                 --marked_notes;
@@ -442,7 +536,7 @@ void SequenceScreen::update() {
         }
 
         modified_notes.unmark(x, y);
-        flip = !dirty;
+        kept_notes.unmark(x, y);
     });
 
     // update our held buttons with grid_on, grid_off bits
@@ -466,16 +560,15 @@ void SequenceScreen::update() {
                                                     1 * 16};
 
                 // if so, we're setting velocity for the held notes
-                set_note_velocities(velo_table[vel_bit]);
+                set_note_velocities(velo_table[vel_bit * 8 / grid.height()]);
 
                 // mark all currently held buttons as modified, so we won't
                 // remove the notes
                 modified_notes |= held_buttons;
-                flip = !dirty;
             }
         } else {
             uchar velo = get_average_held_velocity();
-            paint_sidebar_value(velo, Launchpad::CL_AMBER);
+            paint_sidebar_value(velo, GridSurface::CL_AMBER);
         }
 
     } else {
@@ -528,8 +621,8 @@ void SequenceScreen::update() {
 
     if (dirty) repaint();
 
-    // present
-    if (flip) launchpad.flip(true); // we use copy if we do partial updates too
+    // present - only the changed leds get sent
+    grid.flip();
 }
 
 void SequenceScreen::paint() {
@@ -540,11 +633,11 @@ void SequenceScreen::repaint() {
     set_active_mode_button(2);
 
     if (!sequence) {
-        launchpad.flip();
+        grid.flip();
         return;
     }
 
-    // TODO: if we're live, also draw a time bar
+    overlay = read_overlay();
 
     // prepare a buffer for the sequence display
     clear_view();
@@ -577,7 +670,7 @@ void SequenceScreen::repaint() {
             continue;
         }
 
-        if (x >= Launchpad::MATRIX_W) {
+        if (x >= grid.width()) {
             x_post = true;
             continue;
         }
@@ -587,7 +680,7 @@ void SequenceScreen::repaint() {
             continue;
         }
 
-        if (y >= Launchpad::MATRIX_H) {
+        if (y >= grid.height()) {
             y_above = true;
             continue;
         }
@@ -617,17 +710,17 @@ void SequenceScreen::repaint() {
         for (long c = 0; c < l; ++c) {
             long xc = x + c;
             if (xc < 0) continue;
-            if (xc >= Launchpad::MATRIX_W) break;
+            if (xc >= grid.width()) break;
             view[xc][y] |= FS_CONT;
             if (is_selected)
                 view[xc][y] |= FS_IS_SELECTED;
         }
     }
 
-    for (uchar x = 0; x < Launchpad::MATRIX_W; ++x) {
+    for (uchar x = 0; x < grid.width(); ++x) {
         ticks ticks = time_scaler.to_ticks(x);
         if (ticks >= sequence->get_length()) {
-            for (uchar y = 0; y < Launchpad::MATRIX_H; ++y) {
+            for (uchar y = 0; y < grid.height(); ++y) {
                 view[x][y] |= FS_SEQ_END;
             }
             break;
@@ -638,67 +731,122 @@ void SequenceScreen::repaint() {
     // are we holding any notes? if so we display average velocity
     if (held_buttons.has_value()) {
         uchar velo = get_average_held_velocity();
-        paint_sidebar_value(velo, Launchpad::CL_AMBER);
+        paint_sidebar_value(velo, GridSurface::CL_AMBER);
     } else {
         paint_status_sidebar();
     }
 
     // render the UI part
-    launchpad.fill_matrix(
+    grid.fill_matrix(
             [this](unsigned x, unsigned y) {
                 return to_color(view, x, y);
             });
 
     // colorize the arrows based on the out-of-sight flags
-    uchar out_col = Launchpad::CL_GREEN;
-    launchpad.set_color(Launchpad::BC_UP,  y_below  ? out_col : 0);
-    launchpad.set_color(Launchpad::BC_DOWN, y_above ? out_col : 0);
-    launchpad.set_color(Launchpad::BC_LEFT,  x_pre  ? out_col : 0);
-    launchpad.set_color(Launchpad::BC_RIGHT, x_post ? out_col : 0);
-
-    launchpad.set_color(Launchpad::BC_MIXER,
-                        (marked_notes > 0) ? Launchpad::CL_GREEN : 0);
-
-    launchpad.flip(true);
+    GridSurface::Color out_col = GridSurface::CL_GREEN;
+    grid.set_color(GridSurface::BC_UP,  y_below  ? out_col : GridSurface::CL_BLACK);
+    grid.set_color(GridSurface::BC_DOWN, y_above ? out_col : GridSurface::CL_BLACK);
+    grid.set_color(GridSurface::BC_LEFT,  x_pre  ? out_col : GridSurface::CL_BLACK);
+    grid.set_color(GridSurface::BC_RIGHT, x_post ? out_col : GridSurface::CL_BLACK);
+
+    // shift blinks while there's a selection
+    grid.set_color(GridSurface::BC_MIXER,
+                   (marked_notes > 0) ? GridSurface::CL_GREEN
+                                      : GridSurface::CL_BLACK);
+    grid.set_blink(GridSurface::BC_MIXER, marked_notes > 0);
+
+    grid.flip();
 }
 
 // converts cell status info from given position to color for rendering
-uchar SequenceScreen::to_color(View &v, unsigned x, unsigned y) {
+GridSurface::Color SequenceScreen::to_color(View &v, unsigned x, unsigned y) {
     uchar s = v[x][y];
 
-    uchar col = Launchpad::CL_BLACK;
+    GridSurface::Color col = GridSurface::CL_BLACK;
 
     if (s & FS_SCALE_MARK)
-        col = Launchpad::CL_YELLOW_M;
+        col = GridSurface::CL_YELLOW_M;
 
     if (s & FS_CONT)
-        col = Launchpad::CL_RED_L;
+        col = GridSurface::CL_RED_L;
 
     if (s & FS_HAS_NOTE)
-        col = Launchpad::CL_RED;
+        col = GridSurface::CL_RED;
 
     // both of these boil down to incomplete information kind of a deal
     if (s & FS_INACCURATE || s & FS_MULTIPLE)
-        col = Launchpad::CL_AMBER;
+        col = GridSurface::CL_AMBER;
 
     // marked notes are highest priority there is
     if (s & FS_IS_SELECTED) {
-        col = ((s & FS_CONT) && !(s & FS_HAS_NOTE)) ? Launchpad::CL_GREEN_L
-                                                    : Launchpad::CL_GREEN;
+        col = ((s & FS_CONT) && !(s & FS_HAS_NOTE)) ? GridSurface::CL_GREEN_L
+                                                    : GridSurface::CL_GREEN;
     }
 
     // medium green marks sequence end
     if (s & FS_SEQ_END) {
-        col = Launchpad::CL_ORANGE;
+        col = GridSurface::CL_ORANGE;
+    }
+
+    // the playhead - sounding notes light up, the rest of the column is dim
+    if (int(x) == overlay.x) {
+        if (!(s & (FS_CONT | FS_HAS_NOTE)))
+            col = GridSurface::CL_GREEN_L;
+        else if (overlay.notes[note_scaler.to_note(y) & NOTE_MAX])
+            col = GridSurface::CL_YELLOW;
     }
 
     return col;
 }
 
+SequenceScreen::Overlay SequenceScreen::read_overlay() {
+    Overlay o;
+    if (!sequence || !track) return o;
+
+    LSeq &owner = ui.get_owner();
+    auto st = owner.get_sequencer().get_play_state(
+            owner.get_project().get_track_index(track));
+
+    // only the pointer is compared, the sequence stays unlocked
+    if (st.sequence != sequence) return o;
+
+    if (st.position < time_scaler.to_ticks(0)) return o;
+
+    long x = time_scaler.to_quantum(st.position);
+    if (x >= long(grid.width())) return o;
+
+    o.x     = int(x);
+    o.notes = st.notes;
+    return o;
+}
+
+void SequenceScreen::paint_column(int x) {
+    if (x < 0) return;
+
+    for (unsigned y = 0; y < grid.height(); ++y)
+        grid.set_color(GridSurface::coord_to_btn(x, y), to_color(view, x, y));
+}
+
+void SequenceScreen::on_frame() {
+    if (!sequence) return;
+
+    Overlay o = read_overlay();
+    if (o == overlay) return;
+
+    // only the old and the new playhead column change
+    int old = overlay.x;
+    overlay = o;
+
+    paint_column(old);
+    if (o.x != old) paint_column(o.x);
+
+    grid.flip();
+}
+
 void SequenceScreen::clear_view() {
     // TODO: Implement halftone marks as well?
-    for (uchar x = 0; x < Launchpad::MATRIX_W; ++x)
-        for (uchar y = 0; y < Launchpad::MATRIX_H; ++y)
+    for (uchar x = 0; x < grid.width(); ++x)
+        for (uchar y = 0; y < grid.height(); ++y)
             view[x][y] = bg_flags(x, y);
 }
 
@@ -710,6 +858,12 @@ void SequenceScreen::set_active_sequence(Track *tr, Sequence *seq)
 {
     track    = tr;
     sequence = seq;
+
+    // keyboard plays the track being edited
+    if (track) {
+        LSeq &owner = ui.get_owner();
+        owner.get_thru().set_track(owner.get_project().get_track_index(track));
+    }
 }
 
 void SequenceScreen::add_note(unsigned x, unsigned y, bool repaint) {
@@ -721,8 +875,8 @@ void SequenceScreen::add_note(unsigned x, unsigned y, bool repaint) {
     view[x][y] |= FS_HAS_NOTE;
 
     if (repaint) {
-        unsigned btn = Launchpad::coord_to_btn(x, y);
-        launchpad.set_color(btn, to_color(view, x, y));
+        unsigned btn = GridSurface::coord_to_btn(x, y);
+        grid.set_color(btn, to_color(view, x, y));
     }
 }
 
@@ -742,7 +896,7 @@ void SequenceScreen::remove_note(unsigned x, unsigned y, bool repaint) {
 
     // clear continuations
     if (c & FS_CONT) {
-        for (uchar xc = x + 1; xc < Launchpad::MATRIX_W; ++xc)
+        for (uchar xc = x + 1; xc < grid.width(); ++xc)
         {
             // stop on no continuations or on a new note
             if ((view[xc][y] & FS_CONT) == 0) break;
@@ -753,8 +907,8 @@ void SequenceScreen::remove_note(unsigned x, unsigned y, bool repaint) {
     }
 
     for (uchar xc = x; xc <= last_x; ++xc) {
-        unsigned btn = Launchpad::coord_to_btn(xc, y);
-        launchpad.set_color(btn, to_color(view, xc, y));
+        unsigned btn = GridSurface::coord_to_btn(xc, y);
+        grid.set_color(btn, to_color(view, xc, y));
     }
 }
 
@@ -769,7 +923,7 @@ void SequenceScreen::set_note_lengths(unsigned x, unsigned y, unsigned len, bool
 
     uchar last_x = x;
 
-    for (uchar xc = x; xc < Launchpad::MATRIX_W; ++xc)
+    for (uchar xc = x; xc < grid.width(); ++xc)
     {
         int cl = xc - x;
         // stop on no continuations or on a new note
@@ -786,8 +940,8 @@ void SequenceScreen::set_note_lengths(unsigned x, unsigned y, unsigned len, bool
     }
 
     for (uchar xc = x; xc <= last_x; ++xc) {
-        unsigned btn = Launchpad::coord_to_btn(xc, y);
-        launchpad.set_color(btn, to_color(view, xc, y));
+        unsigned btn = GridSurface::coord_to_btn(xc, y);
+        grid.set_color(btn, to_color(view, xc, y));
     }
 }
 
@@ -808,7 +962,7 @@ void SequenceScreen::set_note_velocities(uchar velo) {
     // no repaint needed aside from the velocity indicator
     // which we do here locally
     // TODO: Paint the given velocity
-    paint_sidebar_value(velo, Launchpad::CL_AMBER);
+    paint_sidebar_value(velo, GridSurface::CL_AMBER);
 }
 
 void SequenceScreen::move_selected_notes(int mx, int my) {
@@ -822,31 +976,31 @@ void SequenceScreen::move_selected_notes(int mx, int my) {
 
 
 
-void SequenceScreen::paint_sidebar_value(uchar val, uchar color) {
+void SequenceScreen::paint_sidebar_value(uchar val, GridSurface::Color color) {
     if (val > 127) val = 127;
 
-    // convert velocity to 0-8 button lights
-    val = (val + 1) * 8 / 128;
+    // convert velocity to 0-height button lights
+    unsigned lit = (val + 1) * grid.height() / 128;
 
     // from the bottom up (inverted to be more readable)
-    for (uchar y = 0; y < Launchpad::MATRIX_H; ++y) {
-        launchpad.set_color(
-                launchpad.coord_to_btn(8, Launchpad::MATRIX_H - 1 - y),
-                (val > y) ? color : Launchpad::CL_BLACK);
+    for (uchar y = 0; y < grid.height(); ++y) {
+        grid.set_color(
+                grid.side_btn(grid.height() - 1 - y),
+                (lit > y) ? color : GridSurface::CL_BLACK);
     }
 }
 
 void SequenceScreen::paint_status_sidebar() {
     // render other indicators
     // triplets (green means triplets are enabled)
-    launchpad.set_color(launchpad.coord_to_btn(8, 0),
-                        time_scaler.get_triplets() ? Launchpad::CL_GREEN
-                        : Launchpad::CL_BLACK);
+    grid.set_color(grid.side_btn(0),
+                   time_scaler.get_triplets() ? GridSurface::CL_GREEN
+                   : GridSurface::CL_BLACK);
 
     // clear the rest of the BTN_SIDE buttons
-    for (uchar y = 1; y < Launchpad::MATRIX_H; ++y) {
-        launchpad.set_color(launchpad.coord_to_btn(8, y),
-                            Launchpad::CL_BLACK);
+    for (uchar y = 1; y < grid.height(); ++y) {
+        grid.set_color(grid.side_btn(y),
+                       GridSurface::CL_BLACK);
     }
 }
 
@@ -864,12 +1018,16 @@ uchar SequenceScreen::get_average_held_velocity() {
 }
 
 void SequenceScreen::queue_note_on(uchar n, uchar vel) {
-    ui.get_owner().get_router().queue_immediate(
+    LSeq &owner = ui.get_owner();
+    owner.get_router().queue_immediate(
+            owner.get_project().get_track_index(track),
             jack::MidiMessage::compose_note_on(track->get_midi_channel(), n, vel));
 }
 
 void SequenceScreen::queue_note_off(uchar n) {
-    ui.get_owner().get_router().queue_immediate(
+    LSeq &owner = ui.get_owner();
+    owner.get_router().queue_immediate(
+            owner.get_project().get_track_index(track),
             jack::MidiMessage::compose_note_off(track->get_midi_channel(), n));
 }
 
@@ -1,9 +1,15 @@
 #pragma once
 
 #include <atomic>
+#include <bitset>
+#include <chrono>
+#include <algorithm>
+#include <iterator>
 
 #include "common.h"
-#include "launchpad.h"
+#include "grid.h"
+#include "animation.h"
+#include "gesture.h"
 #include "sequence.h"
 
 class UI;
@@ -24,7 +30,7 @@ public:
 
     UIScreen(UI &ui);
 
-    virtual void on_key(const Launchpad::KeyEvent &ev) = 0;
+    virtual void on_key(const GridSurface::KeyEvent &ev) = 0;
 
     virtual ScreenType on_enter() = 0;
 
@@ -34,6 +40,9 @@ public:
 
     virtual void update() {};
 
+    /// the frame tick - at most every UI::FRAME_INTERVAL, draws the playback
+    virtual void on_frame() {};
+
     virtual void wake_up();
 
 protected:
@@ -42,8 +51,12 @@ protected:
 
     void set_active_mode_button(unsigned o);
 
+    // for the gestures - the timers of the ui, the rate of the key stamps
+    TimerWheel &get_timers() const;
+    jack_nframes_t sample_rate() const;
+
     UI &ui;
-    Launchpad &launchpad;
+    GridSurface &grid;
 
     // mutex for multithreaded access locking
     std::mutex mtx;
@@ -55,18 +68,24 @@ class TrackScreen : public UIScreen {
 public:
     TrackScreen(UI &ui, Project &project)
             : UIScreen(ui), project(project), updates(this)
+            , gestures(get_timers(), sample_rate(),
+                       [this](const Gestures::Gesture &g) { on_gesture(g); })
     {
+        std::fill(std::begin(playing), std::end(playing), NOT_PLAYING);
     }
 
     virtual ScreenType get_type() const override { return SCR_TRACK; };
 
-    void on_key(const Launchpad::KeyEvent &ev) override;
+    void on_key(const GridSurface::KeyEvent &ev) override;
     ScreenType on_enter() override;
     void on_exit() override;
 
     void update() override;
+    void on_frame() override;
 
 private:
+    static constexpr int NOT_PLAYING = -1;
+
     // TODO: Could we base this on some baseclass perhaps?
     struct UpdateBlock {
         UpdateBlock(TrackScreen *s = nullptr) : owner(s) {}
@@ -78,6 +97,7 @@ private:
             grid_on.clear();
             grid_off.clear();
             shift_grid_on.clear();
+            copy_to.clear();
             dirty = false;
         }
 
@@ -93,6 +113,9 @@ private:
             grid_on         = o.grid_on;
             grid_off        = o.grid_off;
             shift_grid_on   = o.shift_grid_on;
+            copy_x          = o.copy_x;
+            copy_y          = o.copy_y;
+            copy_to         = o.copy_to;
             return *this;
         }
 
@@ -102,11 +125,15 @@ private:
         int up_down    = 0; // counts requests to move up/down
         int left_right = 0; // counts requests to move left/right
         unsigned side_buttons = 0; // bitmap of side buttons pressed
-        Launchpad::Bitmap grid_on;  // key-on events from the grid
-        Launchpad::Bitmap grid_off; // key-off envets from the grid
-        Launchpad::Bitmap shift_grid_on;  // any shift pressed button is stored here
+        GridSurface::Bitmap grid_on;  // key-on events from the grid
+        GridSurface::Bitmap grid_off; // key-off envets from the grid
+        GridSurface::Bitmap shift_grid_on;  // any shift pressed button is stored here
+        unsigned copy_x = 0, copy_y = 0; // the held sequence to copy
+        GridSurface::Bitmap copy_to; // free places pressed while holding it
     };
 
+    void on_gesture(const Gestures::Gesture &g);
+
     // total repaint of the view
     void repaint();
 
@@ -114,6 +141,11 @@ private:
     std::pair<Track *, Sequence *> get_seq_for_xy(uchar x, uchar y);
     bool      schedule_sequence_for_xy(uchar x, uchar y);
 
+    GridSurface::Color cell_color(uchar x, uchar y);
+
+    // column of the sequence the track of the row plays, NOT_PLAYING if none
+    int playing_x(uchar y);
+
     std::atomic<bool> shift = false; // mixer key status TODO: make it thread safe?
 
     Project &project;
@@ -121,9 +153,13 @@ private:
     // View coords
     int vx = 0, vy = 0;
 
-    Launchpad::Bitmap held_buttons;
-    Launchpad::Bitmap shift_held_buttons;
+    GridSurface::Bitmap held_buttons;
+    GridSurface::Bitmap shift_held_buttons;
     UpdateBlock updates;
+
+    int playing[GridSurface::MAX_H]; // playing_x of the rows as drawn
+
+    Gestures gestures;
 };
 
 /** Track screen. Shows the flow of all the sequences in project
@@ -134,7 +170,7 @@ public:
 
     virtual ScreenType get_type() const override { return SCR_TRACK; };
 
-    void on_key(const Launchpad::KeyEvent &ev) override;
+    void on_key(const GridSurface::KeyEvent &ev) override;
     ScreenType on_enter() override;
     void on_exit() override;
 
@@ -151,21 +187,38 @@ public:
         : UIScreen(ui)
         , updates(this)
         , time_scaler(0)
-        , note_scaler(NOTE_C3, Launchpad::MATRIX_H)
+        , note_scaler(NOTE_C3, grid.height())
+        , gestures(get_timers(), sample_rate(),
+                   [this](const Gestures::Gesture &g) { on_gesture(g); },
+                   Gestures::Config{LONG_PRESS})
     {}
 
     virtual ScreenType get_type() const override { return SCR_SEQUENCE; };
 
     void set_active_sequence(Track *track, Sequence *seq);
 
-    void on_key(const Launchpad::KeyEvent &ev) override;
+    void on_key(const GridSurface::KeyEvent &ev) override;
     ScreenType on_enter() override;
     void on_exit() override;
 
     virtual void update() override;
+    void on_frame() override;
 
 private:
-    using View = uchar[Launchpad::MATRIX_W][Launchpad::MATRIX_H];
+    using View = uchar[GridSurface::MAX_W][GridSurface::MAX_H];
+
+    /// the playback drawn over the view
+    struct Overlay {
+        int x = -1; // playhead column, -1 if not in the view
+        std::bitset<NOTE_MAX + 1> notes; // sounding
+
+        bool operator==(const Overlay &o) const { return x == o.x && notes == o.notes; }
+        bool operator!=(const Overlay &o) const { return !(*this == o); }
+    };
+
+    static constexpr Gestures::Duration LONG_PRESS{1500}; // shift alone unselects
+
+    void on_gesture(const Gestures::Gesture &g);
 
     // total repaint of the view
     void repaint();
@@ -177,7 +230,11 @@ private:
     void clear_view();
 
     // converts view state for given coords to color for rendering
-    uchar to_color(View &v, unsigned x, unsigned y);
+    GridSurface::Color to_color(View &v, unsigned x, unsigned y);
+
+    // the playback of our sequence, as published by the sequencer
+    Overlay read_overlay();
+    void paint_column(int x);
 
     uchar bg_flags(unsigned x, unsigned y);
 
@@ -195,11 +252,11 @@ private:
             switch_triplets = false;
             switch_scale    = false;
             side_buttons = 0;
-            shift_only = false;
-            shift_held = 0;
+            unselect = false;
             grid_on.clear();
             grid_off.clear();
             shift_grid_on.clear();
+            keep_notes.clear();
             dirty = false;
         }
 
@@ -218,8 +275,8 @@ private:
             grid_on         = o.grid_on;
             shift_grid_on   = o.shift_grid_on;
             grid_off        = o.grid_off;
-            shift_only      = o.shift_only;
-            shift_held      = o.shift_held;
+            unselect        = o.unselect;
+            keep_notes      = o.keep_notes;
             return *this;
         }
 
@@ -232,17 +289,15 @@ private:
         bool switch_triplets = false; // indicates triplet switch was requested
         bool switch_scale    = false; // indicates scale switch was requested
         unsigned side_buttons = 0; // bitmap of side buttons pressed
-        bool shift_only = false; // only shift was held, no button pressed
-        time_t shift_held = 0; // time in seconds the shift was held for
-        Launchpad::Bitmap grid_on;  // any pressed button is stored here
-        Launchpad::Bitmap shift_grid_on;  // any shift pressed button is stored here
-        Launchpad::Bitmap grid_off; // any pressed button is stored here
+        bool unselect = false; // shift was held alone for LONG_PRESS
+        GridSurface::Bitmap grid_on;  // any pressed button is stored here
+        GridSurface::Bitmap shift_grid_on;  // any shift pressed button is stored here
+        GridSurface::Bitmap grid_off; // any pressed button is stored here
+        GridSurface::Bitmap keep_notes; // held notes shift was pressed over
     };
 
-    /// Used in on_key, different thread than the rest!
+    /// Used in on_key - dispatched in the UI thread, before update
     bool shift = false; // mixer key status TODO: make it thread safe?
-    bool shift_only = false;
-    time_t shift_start = 0; // when the shift was pressed. used on release
     UpdateBlock updates; // current updates - accessed in both threads
     /// end of on_key variable block
 
@@ -251,15 +306,16 @@ private:
     void set_note_lengths(unsigned x, unsigned y, unsigned len, bool repaint);
     void set_note_velocities(uchar velo);
     void move_selected_notes(int mx, int my);
-    void paint_sidebar_value(uchar val, uchar color);
+    void paint_sidebar_value(uchar val, GridSurface::Color color);
     void paint_status_sidebar();
     uchar get_average_held_velocity();
 
     void queue_note_on(uchar n, uchar vel);
     void queue_note_off(uchar n);
 
-    Launchpad::Bitmap held_buttons;
-    Launchpad::Bitmap modified_notes;
+    GridSurface::Bitmap held_buttons;
+    GridSurface::Bitmap modified_notes;
+    GridSurface::Bitmap kept_notes; // not erased on release
 
     // counter of visible marked notes
     unsigned marked_notes;
@@ -281,13 +337,21 @@ private:
 
     // this encodes the current view. each field is a bitmap (see FieldStatus)
     View view = {};
+    Overlay overlay;
+
+    Gestures gestures;
 };
 
 class UI {
 public:
-    UI(LSeq &owner, Project &project, Launchpad &l)
+    /// the playback overlays redraw at most this often
+    static constexpr auto FRAME_INTERVAL = std::chrono::milliseconds(40);
+
+    UI(LSeq &owner, Project &project, GridSurface &g, TimerWheel &timers)
         : owner(owner)
-        , launchpad(l)
+        , timers(timers)
+        , animator(g, timers)
+        , grid(animator)
         , track_screen(*this, project)
         , song_screen(*this)
         , sequence_screen(*this)
@@ -295,10 +359,15 @@ public:
     {
         // set current screen to project screen
         set_screen(SCR_TRACK);
-        launchpad.set_callback(
-                [this](Launchpad &l, const Launchpad::KeyEvent &ev) { cb(l, ev); });
+        grid.set_callback(
+                [this](GridSurface &g, const GridSurface::KeyEvent &ev) { cb(g, ev); });
+
+        frame_timer = timers.schedule(FRAME_INTERVAL, [this] { frame(); },
+                                      FRAME_INTERVAL);
     }
 
+    ~UI() { timers.cancel(frame_timer); }
+
     void set_screen(ScreenType t);
     UIScreen *get_current_screen() const;
 
@@ -307,6 +376,11 @@ public:
         if (screen) screen->update();
     }
 
+    void frame() {
+        UIScreen *screen = get_current_screen();
+        if (screen) screen->on_frame();
+    }
+
     // causes the main loop to wake up from sleep
     void wake_up();
 
@@ -321,13 +395,13 @@ private:
     UI(UI &o) = delete;
     UI &operator=(UI &o) = delete;
 
-    void cb(Launchpad &l, const Launchpad::KeyEvent &ev) {
+    void cb(GridSurface &g, const GridSurface::KeyEvent &ev) {
         // we have top 3 buttons on the right reserved to screen change
         // NOTE: could use a 2 screen mode (red/green) on any of these (press again to swap screens)
         switch (ev.code) {
-        case Launchpad::BC_SESSION: if (ev.press) set_screen(SCR_TRACK); return;
-        case Launchpad::BC_USER1: if (ev.press) set_screen(SCR_SONG); return;
-        case Launchpad::BC_USER2: if (ev.press) set_screen(SCR_SEQUENCE); return;
+        case GridSurface::BC_SESSION: if (ev.press) set_screen(SCR_TRACK); return;
+        case GridSurface::BC_USER1: if (ev.press) set_screen(SCR_SONG); return;
+        case GridSurface::BC_USER2: if (ev.press) set_screen(SCR_SEQUENCE); return;
         default:
             // event dispatcher. The events get distributed to currently selected UI
             // screen
@@ -338,7 +412,9 @@ private:
 
 public:
     LSeq &owner;
-    Launchpad &launchpad;
+    TimerWheel &timers;
+    Animator animator; // the screens draw through it
+    GridSurface &grid;
 
     // various screens
     TrackScreen track_screen;
@@ -349,4 +425,6 @@ protected:
     // current screen has to be locked via mutex while accesing
     mutable std::mutex mut;
     UIScreen *current_screen;
+
+    TimerWheel::Id frame_timer = TimerWheel::NO_TIMER;
 };
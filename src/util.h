@@ -4,7 +4,10 @@
 #include "event.h"
 #include "jackmidi.h"
 
+/// converts a short (non-sysex) event, channel messages get the channel
 inline jack::MidiMessage midi_event_to_msg(const Event &ev, uchar channel) {
     const auto &data = ev.get_data();
-    return {static_cast<uchar>(ev.get_status() | channel), data[0], data[1]};
+    uchar status = ev.get_status();
+    if (status < EV_SYSEX) status |= channel;
+    return jack::MidiMessage(uint8_t(ev.get_size()), status, data[0], data[1]);
 }
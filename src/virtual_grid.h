@@ -0,0 +1,183 @@
+#pragma once
+
+#include <mutex>
+
+#include "common.h"
+#include "error.h"
+#include "grid.h"
+
+/** Several controllers tiled into one surface - 2x1, 1x2 or 2x2 devices.
+ * The screens draw on the whole surface, the virtual grid splits the drawing
+ * per device. Each device keeps its own frame, led slots and output queue,
+ * so a device never waits for the others.
+ *
+ * Only the side columns of the rightmost devices and the top rows of the
+ * topmost devices belong to the surface, the inner ones stay dark.
+ */
+class VirtualGrid : public GridSurface {
+public:
+    using GridSurface::set_color;
+    using GridSurface::fill_matrix;
+
+    static const unsigned TILE_W = GridController::MATRIX_W;
+    static const unsigned TILE_H = GridController::MATRIX_H;
+
+    static const unsigned MAX_COLS = MAX_W / TILE_W;
+    static const unsigned MAX_ROWS = MAX_H / TILE_H;
+
+    VirtualGrid(unsigned cols, unsigned rows) : cols(cols), rows(rows) {
+        if (!cols || !rows || cols > MAX_COLS || rows > MAX_ROWS)
+            throw Exception(format("Unsupported tiling ", cols, "x", rows));
+    }
+
+    ~VirtualGrid() {
+        for (auto &row : tiles)
+            for (GridController *dev : row)
+                if (dev) dev->set_callback(nullptr);
+    }
+
+    VirtualGrid(const VirtualGrid &) = delete;
+    VirtualGrid &operator=(const VirtualGrid &) = delete;
+
+    unsigned width() const override  { return cols * TILE_W; }
+    unsigned height() const override { return rows * TILE_H; }
+
+    /// places the device at the tile col, row (0, 0 is top left)
+    void attach(unsigned col, unsigned row, GridController &dev) {
+        if (col >= cols || row >= rows)
+            throw Exception(format("No tile ", col, ",", row, " in the grid"));
+
+        dev.set_callback([this, col, row](GridSurface &, const KeyEvent &ev) {
+            on_device_key(col, row, ev);
+        });
+
+        lock l(tiles_mtx);
+        tiles[row][col] = &dev;
+    }
+
+    /// removes the device from the surface, the tile stays empty
+    void detach(GridController &dev) {
+        lock l(tiles_mtx);
+
+        for (auto &row : tiles) {
+            for (GridController *&d : row) {
+                if (d != &dev) continue;
+                d = nullptr;
+                dev.set_callback(nullptr);
+            }
+        }
+    }
+
+    void set_callback(KeyCb c) override {
+        lock l(cb_mtx);
+        callback = c;
+    }
+
+    void set_color(unsigned btn, Color col) override {
+        route(btn, [col](GridController &dev, unsigned b) { dev.set_color(b, col); });
+    }
+
+    void set_blink(unsigned btn, bool blink) override {
+        route(btn, [blink](GridController &dev, unsigned b) { dev.set_blink(b, blink); });
+    }
+
+    void blink_phase(bool on) override {
+        lock l(tiles_mtx);
+
+        for (auto &row : tiles)
+            for (GridController *dev : row)
+                if (dev) dev->blink_phase(on);
+    }
+
+    void fill_matrix(ColorCb cb) override {
+        lock l(tiles_mtx);
+
+        for (unsigned r = 0; r < rows; ++r) {
+            for (unsigned c = 0; c < cols; ++c) {
+                GridController *dev = tiles[r][c];
+                if (!dev) continue;
+
+                dev->fill_matrix([&cb, c, r](unsigned x, unsigned y) {
+                    return cb(c * TILE_W + x, r * TILE_H + y);
+                });
+            }
+        }
+    }
+
+    /// presents the frame - every device sends its own changes
+    void flip() override {
+        lock l(tiles_mtx);
+
+        for (auto &row : tiles)
+            for (GridController *dev : row)
+                if (dev) dev->flip();
+    }
+
+protected:
+    /// calls fn with the device of the surface button and its code there
+    template<typename FnT>
+    void route(unsigned btn, FnT fn) {
+        lock l(tiles_mtx);
+
+        if (btn >= BC_UP) {
+            unsigned x = btn - BC_UP;
+            if (x >= width()) return;
+
+            if (GridController *dev = tiles[0][x / TILE_W])
+                fn(*dev, top_btn(x % TILE_W));
+            return;
+        }
+
+        unsigned x = btn_x(btn), y = btn_y(btn);
+        if (y >= height() || x > width()) return;
+
+        if (x == width()) {
+            if (GridController *dev = tiles[y / TILE_H][cols - 1])
+                fn(*dev, dev->side_btn(y % TILE_H));
+            return;
+        }
+
+        if (GridController *dev = tiles[y / TILE_H][x / TILE_W])
+            fn(*dev, coord_to_btn(x % TILE_W, y % TILE_H));
+    }
+
+    /// converts the key of a tile to the surface coordinates
+    void on_device_key(unsigned col, unsigned row, const KeyEvent &ev) {
+        KeyEvent gev = ev;
+
+        switch (ev.type) {
+        case BTN_GRID:
+            gev.x    = col * TILE_W + ev.x;
+            gev.y    = row * TILE_H + ev.y;
+            gev.code = coord_to_btn(gev.x, gev.y);
+            break;
+        case BTN_SIDE:
+            if (col != cols - 1) return; // between the tiles
+            gev.x    = width();
+            gev.y    = row * TILE_H + ev.y;
+            gev.code = coord_to_btn(gev.x, gev.y);
+            break;
+        case BTN_TOP:
+            if (row != 0) return;
+            gev.x    = col * TILE_W + ev.x;
+            gev.code = top_btn(gev.x);
+            break;
+        }
+
+        KeyCb cback;
+        {
+            lock l(cb_mtx);
+            cback = callback;
+        }
+
+        if (cback) cback(*this, gev);
+    }
+
+    const unsigned cols, rows;
+
+    std::mutex tiles_mtx;
+    GridController *tiles[MAX_ROWS][MAX_COLS] = {};
+
+    std::mutex cb_mtx;
+    KeyCb callback;
+};
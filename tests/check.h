@@ -0,0 +1,58 @@
+#pragma once
+
+/** Minimal test harness - the tests register themselves, main runs all of
+ * them (or the ones named on the command line) and fails if any check did.
+ * A failed check reports and lets the test go on.
+ */
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+namespace test {
+
+struct Case {
+    const char *name;
+    void (*fn)();
+};
+
+inline std::vector<Case> &cases() {
+    static std::vector<Case> c;
+    return c;
+}
+
+inline unsigned &failures() {
+    static unsigned f = 0;
+    return f;
+}
+
+struct Register {
+    Register(const char *name, void (*fn)()) { cases().push_back({name, fn}); }
+};
+
+inline void fail(const char *file, int line, const std::string &what) {
+    std::printf("  %s:%d: %s\n", file, line, what.c_str());
+    ++failures();
+}
+
+} // namespace test
+
+#define TEST(name)                                          \
+    static void name();                                     \
+    static test::Register name##_reg(#name, &name);         \
+    static void name()
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) test::fail(__FILE__, __LINE__, #cond);             \
+    } while (0)
+
+#define CHECK_EQ(a, b)                                                  \
+    do {                                                                \
+        auto a_ = (a);                                                  \
+        auto b_ = (b);                                                  \
+        if (!(a_ == b_))                                                \
+            test::fail(__FILE__, __LINE__,                              \
+                       format(#a " == " #b ": ", a_, " != ", b_));      \
+    } while (0)
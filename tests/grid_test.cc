@@ -0,0 +1,86 @@
+/** Led update rate of tiled controllers - the measurement of grid_bench as a
+ * check. Each device of a VirtualGrid has its own queue, so the updates per
+ * device must not drop as devices are added.
+ */
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "check.h"
+#include "fakebackend.h"
+#include "controllers.h"
+#include "virtual_grid.h"
+
+namespace {
+
+constexpr unsigned PERIODS = 2000;
+
+/// allowed drop of the per device rate against a single device
+constexpr double TOLERANCE = 0.02;
+
+struct Devices : backend::Callback {
+    std::vector<std::unique_ptr<GridController>> list;
+
+    int process(jack_nframes_t nframes) override {
+        for (auto &d : list) d->process(nframes);
+        return 0;
+    }
+};
+
+/// led messages per second and device, the whole surface repainted every period
+double led_rate(unsigned cols, unsigned rows, const char *port) {
+    FakeBackend client;
+    client.set_capture(false);
+
+    Devices devs;
+    for (unsigned i = 0; i < cols * rows; ++i)
+        devs.list.push_back(make_grid_controller(client, "lp" + std::to_string(i), port));
+
+    VirtualGrid surface(cols, rows);
+    for (unsigned i = 0; i < devs.list.size(); ++i)
+        surface.attach(i % cols, i / cols, *devs.list[i]);
+
+    client.set_callback(devs);
+    client.activate();
+
+    for (unsigned p = 0; p < PERIODS; ++p) {
+        // a moving pattern, every led changes
+        surface.fill_matrix([p](unsigned x, unsigned y) {
+            return GridSurface::color((x + y + p) % 4, (x + p) % 3);
+        });
+        surface.flip();
+        client.cycle();
+    }
+
+    double secs = double(PERIODS) * client.get_period() / client.sample_rate();
+
+    uint64_t msgs = 0;
+    for (auto &d : devs.list) msgs += d->get_stats().led_messages.get();
+
+    return msgs / secs / devs.list.size();
+}
+
+void check_scaling(const char *port) {
+    double one = led_rate(1, 1, port);
+    CHECK(one > 0);
+
+    for (auto [cols, rows] : {std::pair{2u, 1u}, std::pair{2u, 2u}}) {
+        double rate = led_rate(cols, rows, port);
+        if (rate < one * (1 - TOLERANCE))
+            test::fail(__FILE__, __LINE__,
+                       format(port, " ", cols, "x", rows, ": ", rate,
+                              " led msgs/s per device, ", one, " with one"));
+    }
+}
+
+} // namespace
+
+TEST(grid_rate_per_device_launchpad) {
+    check_scaling("Launchpad");
+}
+
+TEST(grid_rate_per_device_launchpad_mk2) {
+    check_scaling("Launchpad MK2");
+}
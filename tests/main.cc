@@ -0,0 +1,36 @@
+/** Runs the registered tests.
+ *
+ *   lseq_tests [test names]
+ */
+#include <cstdio>
+#include <cstring>
+#include <exception>
+
+#include "check.h"
+
+int main(int argc, char **argv) {
+    unsigned failed = 0, run = 0;
+
+    for (const test::Case &c : test::cases()) {
+        bool wanted = argc < 2;
+        for (int i = 1; i < argc; ++i) wanted = wanted || !std::strcmp(argv[i], c.name);
+        if (!wanted) continue;
+
+        unsigned before = test::failures();
+
+        try {
+            c.fn();
+        } catch (const std::exception &e) {
+            test::fail(__FILE__, __LINE__, format("exception: ", e.what()));
+        }
+
+        bool ok = test::failures() == before;
+        std::printf("%s %s\n", ok ? "ok  " : "FAIL", c.name);
+
+        ++run;
+        if (!ok) ++failed;
+    }
+
+    std::printf("%u of %u tests failed\n", failed, run);
+    return failed ? 1 : 0;
+}
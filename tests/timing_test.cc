@@ -0,0 +1,223 @@
+/** Timing of the engine on the fake backend - clock pulses, thru latency,
+ * and the note-offs of the rendered output through groove and effects.
+ * All deterministic, no jack server needed.
+ */
+#include <algorithm>
+#include <vector>
+
+#include "check.h"
+#include "fakebackend.h"
+#include "transport.h"
+#include "midiclock.h"
+#include "router.h"
+#include "thru.h"
+#include "render.h"
+
+namespace {
+
+/// the clock master on its own, driven by the transport
+struct ClockRig : backend::Callback {
+    FakeBackend client;
+    Project project;
+    Transport transport{project};
+    ClockMaster clock{client};
+
+    ClockRig() {
+        client.set_callback(*this);
+        client.activate();
+    }
+
+    int process(jack_nframes_t nframes) override {
+        clock.process(transport.advance(client.last_frame_time(), nframes,
+                                        client.sample_rate()));
+        return 0;
+    }
+};
+
+/// the router with the thru as its only input handler
+struct ThruRig : backend::Callback {
+    FakeBackend client;
+    Router router{client};
+    MidiThru thru{router};
+
+    ThruRig() {
+        router.add_input_handler(thru);
+        client.set_callback(*this);
+        client.activate();
+    }
+
+    int process(jack_nframes_t nframes) override {
+        router.process_input(nframes);
+        router.process_output(nframes);
+        return 0;
+    }
+};
+
+/// renderer that can be stepped period by period, to reconfigure meanwhile
+struct StepRenderer : OfflineRenderer {
+    using OfflineRenderer::OfflineRenderer;
+
+    void start()              { transport.start(); }
+    void step(unsigned n = 1) { while (n--) run_period(); }
+
+    void stop() {
+        transport.stop();
+        run_period();
+        sequencer.flush();
+    }
+};
+
+std::vector<FakeBackend::Event> only(const std::vector<FakeBackend::Event> &evs,
+                                     uchar status)
+{
+    std::vector<FakeBackend::Event> res;
+    for (const auto &e : evs)
+        if ((e.data[0] & (status < EV_SYSEX ? EV_CLEAR_CHAN_MASK : 0xFF)) == status)
+            res.push_back(e);
+    return res;
+}
+
+unsigned note_ons(const OfflineRenderer &r) {
+    unsigned n = 0;
+    for (const auto &c : r.get_events())
+        if ((c.msg.data[0] & EV_CLEAR_CHAN_MASK) == EV_NOTE_ON && c.msg.data[2]) ++n;
+    return n;
+}
+
+Sequence &one_track(Project &p, ticks length) {
+    Sequence &s = *p.get_track(0)->get_sequence(0);
+    s.set_length(length);
+    return s;
+}
+
+} // namespace
+
+TEST(clock_pulse_spacing) {
+    ClockRig rig;
+    rig.project.set_bpm(120);
+    rig.transport.start();
+    rig.client.run(400); // about 2 s
+
+    const auto &out = rig.client.get_captured("clock::out");
+    CHECK(!out.empty() && out[0].data[0] == EV_CLOCK_START);
+
+    // 120 bpm, 24 ppqn at 48 kHz - a pulse every 1000 frames
+    auto pulses = only(out, EV_MIDI_CLOCK);
+    CHECK(pulses.size() > 90);
+
+    jack_nframes_t lo = ~0u, hi = 0;
+    for (size_t i = 1; i < pulses.size(); ++i) {
+        jack_nframes_t d = pulses[i].frame - pulses[i - 1].frame;
+        lo = std::min(lo, d);
+        hi = std::max(hi, d);
+    }
+
+    CHECK(lo >= 999);
+    CHECK(hi <= 1001);
+}
+
+TEST(thru_latency) {
+    ThruRig rig;
+    rig.client.run(2);
+
+    jack_nframes_t f = rig.client.last_frame_time();
+    rig.client.inject("router::in", f + 100, {0x90, 60, 64});
+    rig.client.inject("router::in", f + 300, {0x80, 60, 0});
+    rig.client.run(4);
+
+    // same period, same frame offset
+    auto notes = rig.client.get_captured("router::out");
+    CHECK_EQ(notes.size(), size_t(2));
+    if (notes.size() != 2) return;
+
+    CHECK_EQ(notes[0].frame, f + 100);
+    CHECK_EQ(notes[1].frame, f + 300);
+    CHECK_EQ(unsigned(notes[1].data[1]), 60u);
+}
+
+TEST(render_pairs_note_offs) {
+    // stopped in the middle of the ratcheted and the arpeggiated notes
+    {
+        Project p;
+        one_track(p, 4 * PPQN).add_note(0, 2 * PPQN, 60);
+        p.get_track(0)->get_effects().set_ratchet(8, PPQN / 8);
+
+        OfflineRenderer r(p);
+        r.get_sequencer().schedule_sequence(0, 0, 0);
+        r.render(PPQN / 2);
+
+        CHECK(note_ons(r) > 1);
+        CHECK_EQ(r.hanging_notes(), 0u);
+    }
+
+    {
+        Project p;
+        Sequence &s = one_track(p, 4 * PPQN);
+        s.add_note(0, 4 * PPQN, 60);
+        s.add_note(0, 4 * PPQN, 64);
+        p.get_track(0)->get_effects().set_arpeggiator(PPQN / 4, EffectChain::ARP_UP, 2, 90);
+
+        OfflineRenderer r(p);
+        r.get_sequencer().schedule_sequence(0, 0, 0);
+        r.render(PPQN + PPQN / 8);
+
+        CHECK(note_ons(r) > 1);
+        CHECK_EQ(r.hanging_notes(), 0u);
+    }
+}
+
+TEST(groove_keeps_note_length) {
+    Groove g;
+    g.set_swing(66);
+    g.set_humanize(10, 0);
+
+    Groove::State st;
+    for (unsigned s = 0; s < Groove::STEPS; ++s) {
+        ticks t = s * Groove::STEP_LENGTH;
+        auto on  = jack::MidiMessage::compose_note_on(0, 60, 100);
+        auto off = jack::MidiMessage::compose_note_off(0, 60);
+
+        ticks a = g.apply(st, t, 0, on);
+        ticks b = g.apply(st, t + 24, 0, off);
+        CHECK_EQ(b - a, ticks(24));
+    }
+}
+
+TEST(transpose_off_releases_held_note) {
+    Project p;
+    one_track(p, 4 * PPQN).add_note(0, PPQN, 60);
+    EffectChain &fx = p.get_track(0)->get_effects();
+    fx.set_transpose(5);
+
+    StepRenderer r(p);
+    r.get_sequencer().schedule_sequence(0, 0, 0);
+    r.start();
+    r.step(10);
+    fx.set_transpose(0); // while the note sounds
+    r.step(200);
+    r.stop();
+
+    CHECK_EQ(note_ons(r), 1u);
+    CHECK_EQ(r.hanging_notes(), 0u);
+    for (const auto &c : r.get_events())
+        CHECK_EQ(unsigned(c.msg.data[1]), 65u);
+}
+
+TEST(ratchet_cut_at_note_off) {
+    Project p;
+    one_track(p, 4 * PPQN).add_note(0, PPQN / 2, 60);
+    p.get_track(0)->get_effects().set_ratchet(16, PPQN / 8);
+
+    StepRenderer r(p);
+    r.get_sequencer().schedule_sequence(0, 0, 0);
+    r.start();
+    r.step(300);
+    r.stop();
+
+    // a repeat every 1/32 while the 1/8 note is held
+    CHECK_EQ(note_ons(r), 4u);
+    CHECK_EQ(r.hanging_notes(), 0u);
+
+    for (const auto &c : r.get_events())
+        CHECK(c.tick <= PPQN / 2);
+}
@@ -0,0 +1,142 @@
+/** Decoder of the midi traces written by Tracer (LSEQ_TRACE=file lseq).
+ *
+ *   lseq-trace FILE         prints the records
+ *   lseq-trace FILE FILE2   compares the output of two traces - the messages
+ *                           per port in order, timing relative to the first
+ *                           output message of each trace
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <string>
+
+#include "trace.h"
+
+namespace {
+
+const char *kind_name(uint8_t kind) {
+    switch (kind) {
+    case Tracer::TR_INPUT:     return "in";
+    case Tracer::TR_OUTPUT:    return "out";
+    case Tracer::TR_REORDERED: return "late";
+    case Tracer::TR_PACED:     return "paced";
+    case Tracer::TR_DROPPED:   return "drop";
+    default:                   return "?";
+    }
+}
+
+std::string bytes(const Tracer::Record &r) {
+    std::string res;
+    char buf[4];
+
+    size_t n = std::min<size_t>(r.len, Tracer::DATA_SIZE);
+    for (size_t i = 0; i < n; ++i) {
+        std::snprintf(buf, sizeof(buf), "%02x ", r.data[i]);
+        res += buf;
+    }
+
+    if (r.len > n) res += "...";
+    return res;
+}
+
+bool is_output(const Tracer::Record &r) {
+    return r.kind == Tracer::TR_OUTPUT || r.kind == Tracer::TR_REORDERED
+           || r.kind == Tracer::TR_PACED;
+}
+
+bool load(const char *path, Tracer::FileHeader &h, std::vector<Tracer::Record> &recs) {
+    if (Tracer::read_file(path, h, recs)) return true;
+    std::fprintf(stderr, "%s: not a trace file\n", path);
+    return false;
+}
+
+int print(const char *path) {
+    Tracer::FileHeader h;
+    std::vector<Tracer::Record> recs;
+    if (!load(path, h, recs)) return 1;
+
+    double ms = h.sample_rate ? 1000.0 / h.sample_rate : 0;
+    uint32_t first = recs.empty() ? 0 : recs.front().frame;
+
+    for (const auto &r : recs) {
+        std::printf("%10u %10.3f ms  %-5s ", r.frame, int32_t(r.frame - first) * ms,
+                    kind_name(r.kind));
+
+        if (r.port == Tracer::NO_PORT) std::printf("port -  ");
+        else std::printf("port %-2u ", r.port);
+
+        if (r.track == Tracer::NO_TRACK) std::printf("track -  ");
+        else std::printf("track %-2u ", r.track);
+
+        std::printf("%s\n", bytes(r).c_str());
+    }
+
+    return 0;
+}
+
+int diff(const char *path_a, const char *path_b) {
+    Tracer::FileHeader ha, hb;
+    std::vector<Tracer::Record> a, b;
+    if (!load(path_a, ha, a) || !load(path_b, hb, b)) return 1;
+
+    // per port output streams
+    std::vector<Tracer::Record> pa[256], pb[256];
+    for (const auto &r : a) if (is_output(r)) pa[r.port].push_back(r);
+    for (const auto &r : b) if (is_output(r)) pb[r.port].push_back(r);
+
+    auto origin = [](const std::vector<Tracer::Record> &recs) {
+        for (const auto &r : recs) if (is_output(r)) return r.frame;
+        return uint32_t(0);
+    };
+
+    uint32_t oa = origin(a), ob = origin(b);
+    double ms_a = ha.sample_rate ? 1000.0 / ha.sample_rate : 0;
+    double ms_b = hb.sample_rate ? 1000.0 / hb.sample_rate : 0;
+
+    unsigned mismatches = 0;
+    double max_dt = 0, sum_dt = 0;
+    size_t compared = 0;
+
+    for (unsigned p = 0; p < 256; ++p) {
+        size_t n = std::min(pa[p].size(), pb[p].size());
+
+        for (size_t i = 0; i < n; ++i) {
+            const auto &ra = pa[p][i];
+            const auto &rb = pb[p][i];
+
+            double ta = int32_t(ra.frame - oa) * ms_a;
+            double tb = int32_t(rb.frame - ob) * ms_b;
+            double dt = tb - ta;
+
+            max_dt = std::max(max_dt, std::fabs(dt));
+            sum_dt += std::fabs(dt);
+            ++compared;
+
+            if (ra.len != rb.len || bytes(ra) != bytes(rb)) {
+                if (mismatches++ < 20)
+                    std::printf("port %u #%zu: %10.3f ms %-24s | %10.3f ms %s\n", p, i,
+                                ta, bytes(ra).c_str(), tb, bytes(rb).c_str());
+            }
+        }
+
+        if (pa[p].size() != pb[p].size())
+            std::printf("port %u: %zu vs %zu messages\n", p, pa[p].size(), pb[p].size());
+    }
+
+    std::printf("%zu messages compared, %u differ, timing deviation max %.3f ms, "
+                "mean %.3f ms\n",
+                compared, mismatches, max_dt, compared ? sum_dt / compared : 0.0);
+
+    return mismatches ? 2 : 0;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    if (argc == 2) return print(argv[1]);
+    if (argc == 3) return diff(argv[1], argv[2]);
+
+    std::fprintf(stderr, "usage: %s FILE [FILE2]\n", argv[0]);
+    return 1;
+}